@@ -14,143 +14,395 @@
  * You should have received a copy of the GNU General Public License 
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <err.h>
-#include <gelf.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <memory.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <libelf.h>
-#include "marvel-88mw30x-firmware.h"
-#include "crc32.h"
+#include "libmrvlfw.h"
+#include "cache.h"
+#include "stats.h"
+#include "threadpool.h"
 
-
-void print_phdr(GElf_Phdr *phdr) {
+static void print_phdr(const struct elf32_phdr_le *phdr) {
 	printf("PHDR:\n");
 	printf("    %-10s          %8x\n", "p_type",   phdr->p_type);
-	printf("    %-10s  %16lx\n",       "p_offset", phdr->p_offset);
-	printf("    %-10s  %16lx\n",       "p_vaddr",  phdr->p_vaddr);
-	printf("    %-10s  %16lx\n",       "p_filesz", phdr->p_filesz);
+	printf("    %-10s  %16x\n",       "p_offset", phdr->p_offset);
+	printf("    %-10s  %16x\n",       "p_vaddr",  phdr->p_vaddr);
+	printf("    %-10s  %16x\n",       "p_filesz", phdr->p_filesz);
+}
+
+/* Per worker thread, reused from one manifest entry to the next. */
+struct worker {
+	uint8_t *input, *image, *old;
+	size_t input_cap, image_cap, old_cap;
+};
+
+enum result { CONVERTED, UNCHANGED, FAILED };
+
+struct conversion {
+	const char *input, *output;
+	enum result result;
+	char error[256];
+};
+
+static struct worker *workers;          // [0] for the main thread
+static uint32_t batch_ctime;
+static mode_t create_mode;
+
+
+/* The ctime of new images: $SOURCE_DATE_EPOCH for reproducible builds, else now. */
+static uint32_t build_time(void) {
+	const char *env = getenv("SOURCE_DATE_EPOCH");
+	char *end;
+	if (!env || !*env)
+		return (uint32_t) time(NULL);
+	errno = 0;
+	unsigned long long t = strtoull(env, &end, 10);
+	if (errno || *end || t > UINT32_MAX)
+		errx(EXIT_FAILURE, "invalid SOURCE_DATE_EPOCH: %s", env);
+	return (uint32_t) t;
+}
+
+/* Read size bytes of fd into *buf, growing it as needed. */
+static int read_all(int fd, size_t size, uint8_t **buf, size_t *cap) {
+	if (size > *cap) {
+		uint8_t *p = realloc(*buf, size);
+		if (!p) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*buf = p;
+		*cap = size;
+		MRVL_STATS_ALLOC(size);
+	}
+	for (size_t done = 0; done < size; ) {
+		ssize_t n = pread(fd, *buf + done, size - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;                  // truncated under us
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = write(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* Whether output already holds exactly image. */
+static int unchanged(struct worker *w, const char *output, const uint8_t *image, size_t size) {
+	struct stat st;
+	int fd = open(output, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	int same = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t) st.st_size == size &&
+		read_all(fd, size, &w->old, &w->old_cap) == 0 && memcmp(w->old, image, size) == 0;
+	close(fd);
+	return same;
+}
+
+/*
+ * Write to a temporary file next to output and rename it over output, so
+ * that readers see the old image or the new one, never a partial one.
+ */
+static int replace_file(const char *output, const uint8_t *image, size_t size) {
+	char tmp[4096];
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", output) >= (int) sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	MRVL_STATS_START(t);
+	int failed = fchmod(fd, create_mode) != 0 || write_all(fd, image, size) != 0;
+	int saved = errno;
+	// close exactly once: another worker may get the same number right after
+	if (close(fd) != 0 && !failed) {
+		failed = 1;
+		saved = errno;
+	}
+	if (!failed && rename(tmp, output) != 0) {
+		failed = 1;
+		saved = errno;
+	}
+	if (failed) {
+		unlink(tmp);
+		errno = saved;
+		return -1;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_FW_WRITE, size);
+	return 0;
+}
+
+static void convert(struct worker *w, struct conversion *c) {
+	struct stat st;
+	size_t size;
+	int status, fd;
+
+	MRVL_STATS_START(t);
+	c->result = FAILED;
+	if ((fd = open(c->input, O_RDONLY)) < 0) {
+		snprintf(c->error, sizeof(c->error), "open failed: %s", strerror(errno));
+		return;
+	}
+	int ok = fstat(fd, &st) == 0 && read_all(fd, st.st_size, &w->input, &w->input_cap) == 0;
+	int saved = errno;
+	close(fd);
+	if (!ok) {
+		snprintf(c->error, sizeof(c->error), "read failed: %s", strerror(saved));
+		return;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, st.st_size);
+
+	status = mrvl_from_elf_into(w->input, st.st_size, batch_ctime, &w->image, &w->image_cap, &size);
+	if (status != MRVL_OK) {
+		snprintf(c->error, sizeof(c->error), "%s", mrvl_strerror(status));
+		return;
+	}
+	if (unchanged(w, c->output, w->image, size)) {
+		c->result = UNCHANGED;
+	} else if (replace_file(c->output, w->image, size) == 0) {
+		c->result = CONVERTED;
+	} else {
+		snprintf(c->error, sizeof(c->error), "cannot write %s: %s", c->output, strerror(errno));
+		return;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, st.st_size);
+}
+
+static void convert_task(void *arg) {
+	convert(&workers[threadpool_worker() + 1], arg);
+}
+
+/*
+ * One "input output" pair per line, separated by a tab, or by blanks when
+ * there is no tab. Empty lines and lines starting with # are skipped.
+ */
+static struct conversion* read_manifest(const char *path, int *count) {
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (!f)
+		err(EXIT_FAILURE, "open %s failed", path);
+
+	struct conversion *conv = NULL;
+	char *line = NULL;
+	size_t cap = 0, linecap = 0;
+	ssize_t len;
+	int lineno = 0;
+	*count = 0;
+	while ((len = getline(&line, &linecap, f)) != -1) {
+		lineno++;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		char *sep = strchr(line, '\t') ? "\t" : " ", *save;
+		char *input = strtok_r(line, sep, &save);
+		char *output = input ? strtok_r(NULL, sep, &save) : NULL;
+		if (!output || strtok_r(NULL, sep, &save))
+			errx(EXIT_FAILURE, "%s:%d: expected an input and an output file", path, lineno);
+		if (*count == cap) {
+			cap = cap ? cap * 2 : 256;
+			conv = realloc(conv, sizeof(struct conversion) * cap);
+			assert(conv);
+		}
+		conv[*count].input = strdup(input);
+		conv[*count].output = strdup(output);
+		(*count)++;
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return conv;
 }
 
+/*
+ * Failures are reported in manifest order, followed by a summary. Outputs
+ * that would not change are left alone, so their mtime is kept too.
+ */
+static int run_batch(const char *manifest, int threads) {
+	struct taskgroup group = TASKGROUP_INIT;
+	int count, failed = 0, converted = 0;
+
+	struct conversion *conv = read_manifest(manifest, &count);
+	mode_t mask = umask(0);
+	umask(mask);
+	create_mode = 0666 & ~mask;
+	batch_ctime = build_time();
+
+	struct threadpool *pool = threadpool_new(threads);
+	if (!pool)
+		errx(EXIT_FAILURE, "cannot create thread pool");
+	int nworkers = threadpool_size(pool) + 1;
+	workers = calloc(nworkers, sizeof(struct worker));
+	assert(workers);
+	for (int i = 0; i < count; i++)
+		threadpool_submit(pool, &group, convert_task, &conv[i]);
+	threadpool_wait(pool, &group);
+	threadpool_free(pool);
+
+	for (int i = 0; i < count; i++) {
+		if (conv[i].result == FAILED) {
+			warnx("%s: %s", conv[i].input, conv[i].error);
+			failed++;
+		} else if (conv[i].result == CONVERTED) {
+			converted++;
+		}
+		free((char*) conv[i].input);
+		free((char*) conv[i].output);
+	}
+	printf("%d converted, %d unchanged, %d failed\n", converted, count - converted - failed, failed);
+	for (int i = 0; i < nworkers; i++) {
+		free(workers[i].input);
+		free(workers[i].image);
+		free(workers[i].old);
+	}
+	free(workers);
+	free(conv);
+	return failed ? EXIT_FAILURE : 0;
+}
+
+static long parse_count(const char *option, const char *arg, long min, long max) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be a number in %ld..%ld: %s", option, min, max, arg);
+	return n;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-C cache-dir] [--stats[=perf]] axf-filename firmware-filename\n"
+		"       %s [-j threads] [--stats[=perf]] -m manifest|-\n"
+		"       %s -S [-C cache-dir]\n"
+		"  -m  convert every \"input output\" pair listed in manifest, one per line\n"
+		"  -j  worker threads for -m, default one per CPU\n"
+		"The image ctime is $SOURCE_DATE_EPOCH if set, else the current time.", prog, prog, prog);
+}
 
 int main(int argc, char** argv) {
-	FILE *fin, *fout;
-	Elf *e;
-	GElf_Ehdr ehdr;
-	GElf_Phdr phdr;
-	size_t shstrndx, n;
-	int i;
-
-	if (argc != 3)
-		errx(EXIT_FAILURE, "usage: %s axf-filename firmware-filename", argv[0]);
-	
-	if (elf_version(EV_CURRENT) ==  EV_NONE)
-		errx(EXIT_FAILURE, "ELF library initialization failed: %s", elf_errmsg(-1));
-	
-	if (!(fin = fopen(argv[1], "rb"))) {
-		err(EXIT_FAILURE, "open %s failed", argv[1]);
-	}
-
-	if ((e = elf_begin(fileno(fin), ELF_C_READ, NULL)) == NULL)
-		errx(EXIT_FAILURE, "elf_begin() failed: %s", elf_errmsg(-1));
-
-	if (elf_kind(e) != ELF_K_ELF)
-		errx(EXIT_FAILURE, "%s is not an ELF object", argv[1]);
-
-	if (gelf_getehdr(e, &ehdr) == NULL)
-		errx(EXIT_FAILURE, "getehdr() failed: %s.", elf_errmsg(-1));
-
-	if ((i = gelf_getclass(e)) == ELFCLASSNONE) 
-		errx(EXIT_FAILURE, "getclass() failed: %s.", elf_errmsg(-1));
-	
-	if (i != ELFCLASS32)
-		errx(EXIT_FAILURE, "this program only supports 32-bit ELF.");
-
-	if (elf_getshdrstrndx(e, &shstrndx ) != 0)
-		errx(EXIT_FAILURE, "elf_getshdrstrndx() failed: %s.", elf_errmsg(-1));
-	
-	if (elf_getphdrnum(e, &n) != 0)
-		errx(EXIT_FAILURE, "elf_getphdrnum() failed: %s.", elf_errmsg(-1));
-
-	struct MarvellFirmware *fw = new_mrvl_firmware();
-	fw->header.ctime = (uint32_t) time(NULL);
-	fw->header.elf_version = ehdr.e_version;
-	fw->header.num_segments = 0;
-
-	// count usable segments
-	for (int i = 0; i < n; i++) {
-		if (gelf_getphdr(e, i, &phdr) != &phdr)
-			errx(EXIT_FAILURE, "getphdr() failed: %s.", elf_errmsg(-1));
-		print_phdr(&phdr);
-		if (phdr.p_type == PT_LOAD && phdr.p_filesz > 0) {
-			fw->header.num_segments++;
+	int fdin, fdout, stats = 0, threads = 0, opt;
+	const char *cachedir = NULL, *manifest = NULL;
+	struct cache cache;
+	struct stat st;
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "C:Sj:m:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = parse_count("-j", optarg, 0, 4096);
+				break;
+			case 'm':
+				manifest = optarg;
+				break;
+			case 'C':
+				cachedir = optarg;
+				break;
+			case 'S':
+				stats = 1;
+				break;
+			case 's':
+				if (mrvl_stats_enable("axf2firmware", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
 		}
 	}
-	if (fw->header.num_segments == 0)
-		errx(EXIT_FAILURE, "ELF contains no suitable segments");
-	if (fw->header.num_segments > 9)
-		errx(EXIT_FAILURE, "ELF contains more than the maximum allowed 9 segments");
-
-	fw->seghdrs = malloc(sizeof(struct MarvellSegmentHeader) * fw->header.num_segments);
-	assert(fw->seghdrs);
-	memset(fw->seghdrs, 0, sizeof(struct MarvellSegmentHeader) * fw->header.num_segments);
-	fw->segments = malloc(sizeof(void*) * fw->header.num_segments);
-	assert(fw->segments);
-
-	if (!(fout = fopen(argv[2], "wb"))) {
-		err(EXIT_FAILURE, "open %s failed", argv[2]);
-	}
-	if (fwrite(&fw->header, sizeof(struct MarvellHeader), 1, fout) != 1)
-		errx(EXIT_FAILURE, "cannot write firmware header.");
-	if (fwrite(fw->seghdrs, sizeof(struct MarvellSegmentHeader) * fw->header.num_segments, 1, fout) != 1)
-		errx(EXIT_FAILURE, "cannot write to firmware");
-	
-	// write segments, populate segment headers
-	int si = 0;
-	for (int i = 0; i < n; i++) {
-		if (gelf_getphdr(e, i, &phdr) != &phdr)
-			errx(EXIT_FAILURE, "getphdr() failed: %s.", elf_errmsg(-1));
-		
-		if (phdr.p_type == PT_LOAD && phdr.p_filesz > 0) {
-			struct MarvellSegmentHeader *msh = &(fw->seghdrs[si]);
-			msh->vaddr = phdr.p_vaddr;
-
-			uint32_t padding = ((phdr.p_filesz + 3) & 0xfffffffc) - phdr.p_filesz;
-			msh->size = phdr.p_filesz + padding;
-			fw->segments[si] = malloc(msh->size);
-			memset(fw->segments[si], 0xFF, padding);
-			if (fseek(fin, phdr.p_offset, SEEK_SET))
-				err(EXIT_FAILURE, "cannot seek to ELF segment.");
-			if (fread(fw->segments[si], phdr.p_filesz, 1, fin) != 1)
-				err(EXIT_FAILURE, "cannot read ELF segment.");
-			msh->checksum = crc32_byte(fw->segments[si], msh->size);
-			msh->offset = ftell(fout);
-			if (fwrite(fw->segments[si], msh->size, 1, fout) != 1) {
-				errx(EXIT_FAILURE, "cannot write firmware segment.");
-			}
-			msh->type = 2; // seems to be constant
-
-			si++;
+	if (manifest) {
+		// unchanged outputs are detected by content, so the cache is not needed
+		if (optind != argc || stats || cachedir)
+			usage(argv[0]);
+		return run_batch(manifest, threads);
+	}
+
+	int caching = cache_open(&cache, cachedir);
+	if (stats) {
+		if (!caching)
+			errx(EXIT_FAILURE, "no cache, use -C or set MRVLFW_CACHE_DIR");
+		cache_print_stats(&cache, stdout);
+		return 0;
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+	const char *input = argv[optind], *output = argv[optind + 1];
+
+	MRVL_STATS_START(t);
+	if ((fdin = open(input, O_RDONLY)) < 0)
+		err(EXIT_FAILURE, "open %s failed", input);
+	if (fstat(fdin, &st) != 0)
+		err(EXIT_FAILURE, "stat %s failed", input);
+	uint8_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fdin, 0);
+	if (image == MAP_FAILED)
+		err(EXIT_FAILURE, "cannot map %s", input);
+	posix_madvise(image, st.st_size, POSIX_MADV_SEQUENTIAL);
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, st.st_size);
+
+	// with $SOURCE_DATE_EPOCH the ctime is part of the key; otherwise a hit
+	// keeps the ctime of the first conversion
+	uint32_t ctime = build_time();
+	if (caching) {
+		char options[32] = "";
+		if (getenv("SOURCE_DATE_EPOCH") && *getenv("SOURCE_DATE_EPOCH"))
+			snprintf(options, sizeof(options), "ctime=%u", ctime);
+		cache_key(&cache, "axf2firmware", options, image, st.st_size);
+		if (cache_fetch(&cache, output)) {
+			MRVL_STATS_STOP(t, MRVL_PHASE_JOB, st.st_size);
+			munmap(image, st.st_size);
+			close(fdin);
+			return 0;
 		}
 	}
 
-	// write segment headers
-	fseek(fout, sizeof(struct MarvellHeader), SEEK_SET);
-	for (int i = 0; i < fw->header.num_segments; i++) {
-		if (fwrite(&(fw->seghdrs[i]), sizeof(struct MarvellSegmentHeader), 1, fout) != 1)
-			errx(EXIT_FAILURE, "failed to write firmware segment.");
+	if ((fdout = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		err(EXIT_FAILURE, "open %s failed", output);
+
+	int status = mrvl_from_elf_fd(image, st.st_size, ctime, fdout);
+	if (status == MRVL_ERR_IO)
+		err(EXIT_FAILURE, "cannot write firmware");
+	if (status != MRVL_OK) {
+		unlink(output);
+		errx(EXIT_FAILURE, "%s: %s", input, mrvl_strerror(status));
 	}
-	assert(ftell(fout) == fw->seghdrs[0].offset);
 
-	elf_end(e);
-	free_mrvl_firmware(fw);
-	fclose(fin);
-	fclose(fout);
+	// the program headers were validated by the conversion
+	const struct elf32_ehdr_le *ehdr = (const struct elf32_ehdr_le*) image;
+	const struct elf32_phdr_le *phdr = (const struct elf32_phdr_le*) (image + ehdr->e_phoff);
+	for (int i = 0; i < ehdr->e_phnum; i++)
+		print_phdr(&phdr[i]);
+
+	munmap(image, st.st_size);
+	close(fdin);
+	if (close(fdout) != 0)
+		err(EXIT_FAILURE, "cannot write firmware");
+	if (caching)
+		cache_store(&cache, output);
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, st.st_size);
 	return 0;
 }
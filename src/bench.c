@@ -0,0 +1,262 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark suite. Generates synthetic inputs with mkfirmware, then
+ * measures CRC throughput per kernel, parse latency and the conversion
+ * tools, and prints a JSON report to stdout.
+ */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "marvel-88mw30x-firmware.h"
+#include "crc32.h"
+
+struct run_result {
+	double seconds;                       // best wall time
+	long peak_rss_kb;                     // largest over all runs
+};
+
+static const char *bindir = "bin";
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t parse_size(const char *s) {
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+	switch (*end) {
+		case 'k': case 'K': v <<= 10; break;
+		case 'm': case 'M': v <<= 20; break;
+		case 'g': case 'G': v <<= 30; break;
+	}
+	return v;
+}
+
+/* Run bindir/tool with args, stdout to /dev/null; best of `runs`. */
+static struct run_result run_tool(const char *tool, char *const args[], int runs) {
+	struct run_result res = { 1e30, 0 };
+	char path[4096];
+	char *argv[16];
+	int argc = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", bindir, tool);
+	argv[argc++] = path;
+	for (int i = 0; args[i] && argc < 15; i++)
+		argv[argc++] = args[i];
+	argv[argc] = NULL;
+
+	for (int r = 0; r < runs; r++) {
+		double t0 = now();
+		pid_t pid = fork();
+		if (pid < 0)
+			err(EXIT_FAILURE, "fork failed");
+		if (pid == 0) {
+			int devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, STDOUT_FILENO);
+			execv(path, argv);
+			_exit(127);
+		}
+
+		int status;
+		struct rusage ru;
+		if (wait4(pid, &status, 0, &ru) < 0)
+			err(EXIT_FAILURE, "wait failed");
+		double t = now() - t0;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(EXIT_FAILURE, "%s failed", path);
+		if (t < res.seconds)
+			res.seconds = t;
+		if (ru.ru_maxrss > res.peak_rss_kb)
+			res.peak_rss_kb = ru.ru_maxrss;
+	}
+	return res;
+}
+
+static void bench_crc(size_t size) {
+	uint8_t *buf = malloc(size);
+	if (!buf)
+		errx(EXIT_FAILURE, "failed to allocate %zu bytes", size);
+	uint64_t x = 88;
+	for (size_t i = 0; i < size; i++) {
+		x = x * 6364136223846793005ull + 1442695040888963407ull;
+		buf[i] = x >> 56;
+	}
+
+	printf("  \"crc32\": {\n");
+	printf("    \"selftest\": %s,\n", crc32_selftest() == 0 ? "true" : "false");
+	printf("    \"active\": \"%s\"", crc32_get_kernel()->name);
+	for (const struct crc32_kernel *k = crc32_kernels; k->name; k++) {
+		if (!k->supported())
+			continue;
+		// at least 0.2 s per kernel
+		double best = 1e30, spent = 0;
+		volatile uint32_t sink = 0;
+		while (spent < 0.2) {
+			double t0 = now();
+			sink ^= k->fn(0, buf, size);
+			double t = now() - t0;
+			spent += t;
+			if (t < best)
+				best = t;
+		}
+		(void) sink;
+		printf(",\n    \"%s_mb_per_s\": %.1f", k->name, size / best / 1e6);
+	}
+	printf("\n  },\n");
+	free(buf);
+}
+
+/* The mapped reader does not touch segment data, the buffered one reads it all. */
+static void bench_parse(const char *image, uint64_t size) {
+	struct MarvellArena arena;
+	struct MarvellFirmware *fw;
+	double t0, mapped, buffered;
+	const char *msg;
+	char errbuf[256];
+	int iterations = 1000;
+
+	t0 = now();
+	for (int i = 0; i < iterations; i++) {
+		if (!(fw = load_marvel_firmware(image, NULL, errbuf, sizeof(errbuf))))
+			errx(EXIT_FAILURE, "%s", errbuf);
+		free_mrvl_firmware(fw);
+	}
+	mapped = (now() - t0) / iterations;
+
+	iterations = (1 << 30) / size;
+	if (iterations < 3)
+		iterations = 3;
+	mrvl_arena_init(&arena);
+	t0 = now();
+	for (int i = 0; i < iterations; i++) {
+		FILE *f = fopen(image, "rb");
+		if (!f)
+			err(EXIT_FAILURE, "open %s failed", image);
+		if (!(fw = read_marvel_firmware(f, &arena, &msg)))
+			errx(EXIT_FAILURE, "%s: %s", image, msg);
+		free_mrvl_firmware(fw);
+		fclose(f);
+		mrvl_arena_reset(&arena);
+	}
+	buffered = (now() - t0) / iterations;
+
+	printf("  \"parse\": {\n");
+	printf("    \"mmap_us\": %.2f,\n", mapped * 1e6);
+	printf("    \"buffered_us\": %.2f,\n", buffered * 1e6);
+	printf("    \"buffered_arena_blocks\": %zu,\n", arena.allocations);
+	printf("    \"buffered_arena_peak_bytes\": %zu\n", arena.peak);
+	printf("  },\n");
+	mrvl_arena_free(&arena);
+}
+
+static void print_run(const char *name, struct run_result r, uint64_t bytes, int last) {
+	printf("  \"%s\": { \"seconds\": %.6f, \"mb_per_s\": %.1f, \"peak_rss_kb\": %ld }%s\n",
+		name, r.seconds, bytes / r.seconds / 1e6, r.peak_rss_kb, last ? "" : ",");
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-s image-size] [-n runs] [-b bindir]", prog);
+}
+
+int main(int argc, char** argv) {
+	uint64_t size = 64 << 20;
+	int runs = 5, opt;
+
+	while ((opt = getopt(argc, argv, "s:n:b:")) != -1) {
+		switch (opt) {
+			case 's':
+				size = parse_size(optarg);
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				break;
+			case 'b':
+				bindir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (size < 64 * 1024 || runs < 1)
+		usage(argv[0]);
+
+	char dir[] = "/tmp/mrvl-bench.XXXXXX";
+	if (!mkdtemp(dir))
+		err(EXIT_FAILURE, "mkdtemp failed");
+	char image[64], axf[64], elf[64], out[64];
+	snprintf(image, sizeof(image), "%s/image.bin", dir);
+	snprintf(axf, sizeof(axf), "%s/image.axf", dir);
+	snprintf(elf, sizeof(elf), "%s/out.elf", dir);
+	snprintf(out, sizeof(out), "%s/out.bin", dir);
+
+	// three segments like the SDK samples: small .init, bulk of .text, some .data
+	char seg0[32], seg1[32], seg2[32];
+	snprintf(seg0, sizeof(seg0), "%llu:inc", (unsigned long long) size / 16);
+	snprintf(seg1, sizeof(seg1), "%llu:random", (unsigned long long) (size - size / 16 - size / 64 - 2));
+	snprintf(seg2, sizeof(seg2), "%llu:text", (unsigned long long) size / 64);
+	char *gen_mrvl[] = { "-s", seg0, "-s", seg1, "-s", seg2, image, NULL };
+	char *gen_axf[] = { "-a", "-s", seg0, "-s", seg1, "-s", seg2, axf, NULL };
+	run_tool("mkfirmware", gen_mrvl, 1);
+	run_tool("mkfirmware", gen_axf, 1);
+
+	struct stat st;
+	if (stat(image, &st) != 0)
+		err(EXIT_FAILURE, "stat %s failed", image);
+
+	printf("{\n");
+	printf("  \"version\": \"%s\",\n", MRVLFW_VERSION);
+	printf("  \"image_bytes\": %lld,\n", (long long) st.st_size);
+	bench_crc(size);
+	bench_parse(image, st.st_size);
+
+	char *f2e[] = { image, elf, NULL };
+	char *f2e_libelf[] = { "-L", image, elf, NULL };
+	char *a2f[] = { axf, out, NULL };
+	print_run("firmware2elf", run_tool("firmware2elf", f2e, runs), st.st_size, 0);
+	print_run("firmware2elf_libelf", run_tool("firmware2elf", f2e_libelf, runs), st.st_size, 0);
+	print_run("axf2firmware", run_tool("axf2firmware", a2f, runs), st.st_size, 0);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("  \"bench_peak_rss_kb\": %ld\n", ru.ru_maxrss);
+	printf("}\n");
+
+	unlink(image);
+	unlink(axf);
+	unlink(elf);
+	unlink(out);
+	rmdir(dir);
+	return 0;
+}
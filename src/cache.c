@@ -0,0 +1,385 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 700
+
+#include "cache.h"
+#include "marvel-88mw30x-firmware.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/*
+ * A cache is an optimization: every failure here is a warning, and the
+ * tool carries on as if caching was disabled.
+ */
+
+#define INDEX_VERSION 1
+
+struct __attribute__((packed))
+cache_index_header {
+	char magic[4];                        // "MRVC"
+	uint32_t version;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct __attribute__((packed))
+cache_entry {
+	uint8_t key[SHA256_DIGEST_SIZE];
+	uint64_t size;
+	uint64_t atime;                       // ns since the epoch
+	uint32_t hits;
+	uint32_t reserved;
+};
+
+struct cache_index {
+	struct cache_index_header header;
+	struct cache_entry *entries;          // sorted by key
+	uint32_t cap;
+};
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t parse_size(const char *s) {
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+	switch (*end) {
+		case 'k': case 'K': v <<= 10; break;
+		case 'm': case 'M': v <<= 20; break;
+		case 'g': case 'G': v <<= 30; break;
+	}
+	return v;
+}
+
+/* A unique name in tmp/, so parallel invocations never share one. */
+static void tmp_path(struct cache *c, const char *what, char *path, size_t len) {
+	static unsigned counter;
+	snprintf(path, len, "%s/tmp/%s.%ld.%u", c->dir, what, (long) getpid(), counter++);
+}
+
+static void object_path(struct cache *c, char *path, size_t len) {
+	snprintf(path, len, "%s/objects/%s", c->dir, c->keyhex);
+}
+
+static int make_dir(const char *path) {
+	if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+		warn("cache: cannot create %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+int cache_open(struct cache *c, const char *dir) {
+	char path[PATH_MAX + 16];
+	memset(c, 0, sizeof(*c));
+	if (!dir)
+		dir = getenv("MRVLFW_CACHE_DIR");
+	if (!dir || !*dir)
+		return 0;
+	if (strlen(dir) >= sizeof(c->dir) - 16) {
+		warnx("cache: path too long: %s", dir);
+		return 0;
+	}
+	strcpy(c->dir, dir);
+
+	const char *size = getenv("MRVLFW_CACHE_SIZE");
+	c->max_bytes = size ? parse_size(size) : CACHE_DEFAULT_MAX_BYTES;
+
+	if (make_dir(c->dir) != 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/objects", c->dir);
+	if (make_dir(path) != 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/tmp", c->dir);
+	if (make_dir(path) != 0)
+		return 0;
+	return 1;
+}
+
+void cache_key(struct cache *c, const char *tool, const char *options, const void *input, size_t len) {
+	struct sha256_state st;
+	sha256_init(&st);
+	sha256_update(&st, tool, strlen(tool) + 1);
+	sha256_update(&st, MRVLFW_VERSION, sizeof(MRVLFW_VERSION));
+	sha256_update(&st, options, strlen(options) + 1);
+	sha256_update(&st, input, len);
+	sha256_final(&st, c->key);
+	sha256_hex(c->key, c->keyhex);
+}
+
+/* A missing or damaged index is an empty one. */
+static void load_index(struct cache *c, struct cache_index *idx) {
+	char path[PATH_MAX + 16];
+	struct stat st;
+
+	memset(idx, 0, sizeof(*idx));
+	memcpy(idx->header.magic, "MRVC", 4);
+	idx->header.version = INDEX_VERSION;
+
+	snprintf(path, sizeof(path), "%s/index", c->dir);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct cache_index_header)) {
+		struct cache_index_header hdr;
+		size_t n = st.st_size - sizeof(hdr);
+		void *entries = malloc(n ? n : 1);
+		if (entries && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+				memcmp(hdr.magic, "MRVC", 4) == 0 && hdr.version == INDEX_VERSION &&
+				(uint64_t) hdr.count * sizeof(struct cache_entry) == n &&
+				read(fd, entries, n) == n) {
+			idx->header = hdr;
+			idx->entries = entries;
+			idx->cap = hdr.count;
+			entries = NULL;
+		}
+		free(entries);
+	}
+	close(fd);
+}
+
+static void save_index(struct cache *c, struct cache_index *idx) {
+	char tmp[PATH_MAX + 128], path[PATH_MAX + 16];
+	size_t n = sizeof(struct cache_entry) * idx->header.count;
+
+	tmp_path(c, "index", tmp, sizeof(tmp));
+	snprintf(path, sizeof(path), "%s/index", c->dir);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0) {
+		warn("cache: cannot create %s", tmp);
+		return;
+	}
+	int ok = write(fd, &idx->header, sizeof(idx->header)) == sizeof(idx->header) &&
+		(n == 0 || write(fd, idx->entries, n) == n);
+	if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+		warn("cache: cannot update %s", path);
+		unlink(tmp);
+	}
+}
+
+static struct cache_entry* find_entry(struct cache_index *idx, const uint8_t *key, uint32_t *pos) {
+	uint32_t lo = 0, hi = idx->header.count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(idx->entries[mid].key, key, SHA256_DIGEST_SIZE);
+		if (cmp == 0)
+			return &idx->entries[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return NULL;
+}
+
+/* NULL if the index cannot grow; the caller then leaves it as it is. */
+static struct cache_entry* get_entry(struct cache_index *idx, const uint8_t *key, uint64_t size) {
+	uint32_t pos = 0;
+	struct cache_entry *e = find_entry(idx, key, &pos);
+	if (e)
+		return e;
+	if (idx->header.count == idx->cap) {
+		uint32_t cap = idx->cap ? idx->cap * 2 : 64;
+		struct cache_entry *entries = realloc(idx->entries, sizeof(struct cache_entry) * cap);
+		if (!entries) {
+			warn("cache: cannot update the index");
+			return NULL;
+		}
+		idx->entries = entries;
+		idx->cap = cap;
+	}
+	e = &idx->entries[pos];
+	memmove(e + 1, e, sizeof(struct cache_entry) * (idx->header.count - pos));
+	memset(e, 0, sizeof(*e));
+	memcpy(e->key, key, SHA256_DIGEST_SIZE);
+	e->size = size;
+	idx->header.count++;
+	return e;
+}
+
+/* A reflink where the file system can share extents, else a plain copy. */
+static int copy_file(const char *from, const char *to, mode_t mode) {
+	char buf[64 * 1024];
+	int ok = 1;
+	int in = open(from, O_RDONLY);
+	if (in < 0)
+		return -1;
+	int out = open(to, O_WRONLY | O_CREAT | O_EXCL, mode);
+	if (out < 0) {
+		close(in);
+		return -1;
+	}
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		close(in);
+		if (close(out) != 0) {
+			unlink(to);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	for (;;) {
+		ssize_t n = read(in, buf, sizeof(buf));
+		if (n <= 0) {
+			ok = n == 0;
+			break;
+		}
+		if (write(out, buf, n) != n) {
+			ok = 0;
+			break;
+		}
+	}
+	close(in);
+	if (close(out) != 0 || !ok) {
+		unlink(to);
+		return -1;
+	}
+	return 0;
+}
+
+int cache_fetch(struct cache *c, const char *output) {
+	char obj[PATH_MAX + 96], tmp[PATH_MAX + 16];
+	struct stat st;
+
+	object_path(c, obj, sizeof(obj));
+	if (stat(obj, &st) != 0)
+		return 0;
+
+	// replace output atomically by a private copy, which may be written like a fresh output
+	snprintf(tmp, sizeof(tmp), "%s.cache.%ld", output, (long) getpid());
+	unlink(tmp);
+	if (copy_file(obj, tmp, 0666) != 0)
+		return 0;
+	if (rename(tmp, output) != 0) {
+		unlink(tmp);
+		return 0;
+	}
+
+	struct cache_index idx;
+	load_index(c, &idx);
+	struct cache_entry *e = get_entry(&idx, c->key, st.st_size);
+	if (e) {
+		e->atime = now_ns();
+		e->hits++;
+		idx.header.hits++;
+		save_index(c, &idx);
+	}
+	free(idx.entries);
+	return 1;
+}
+
+static int by_key(const void *a, const void *b) {
+	return memcmp(((const struct cache_entry*) a)->key, ((const struct cache_entry*) b)->key, SHA256_DIGEST_SIZE);
+}
+
+static int by_atime(const void *a, const void *b) {
+	const struct cache_entry *x = a, *y = b;
+	return (x->atime > y->atime) - (x->atime < y->atime);
+}
+
+/* Drop least recently used objects until the total fits max_bytes. */
+static void evict(struct cache *c, struct cache_index *idx) {
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < idx->header.count; i++)
+		total += idx->entries[i].size;
+	if (total <= c->max_bytes)
+		return;
+
+	qsort(idx->entries, idx->header.count, sizeof(struct cache_entry), by_atime);
+	uint32_t first = 0;
+	while (first < idx->header.count && total > c->max_bytes) {
+		char obj[PATH_MAX + 96], hex[2 * SHA256_DIGEST_SIZE + 1];
+		struct cache_entry *e = &idx->entries[first++];
+		sha256_hex(e->key, hex);
+		snprintf(obj, sizeof(obj), "%s/objects/%s", c->dir, hex);
+		unlink(obj);
+		total -= e->size;
+		idx->header.evictions++;
+	}
+	idx->header.count -= first;
+	memmove(idx->entries, idx->entries + first, sizeof(struct cache_entry) * idx->header.count);
+	qsort(idx->entries, idx->header.count, sizeof(struct cache_entry), by_key);
+}
+
+void cache_store(struct cache *c, const char *output) {
+	char obj[PATH_MAX + 96], tmp[PATH_MAX + 128];
+	struct stat st;
+
+	if (stat(output, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	// a copy, so later changes to output cannot reach the object
+	object_path(c, obj, sizeof(obj));
+	tmp_path(c, c->keyhex, tmp, sizeof(tmp));
+	if (copy_file(output, tmp, 0444) != 0) {
+		warn("cache: cannot store %s", output);
+		return;
+	}
+	if (rename(tmp, obj) != 0) {
+		warn("cache: cannot store %s", output);
+		unlink(tmp);
+		return;
+	}
+
+	struct cache_index idx;
+	load_index(c, &idx);
+	struct cache_entry *e = get_entry(&idx, c->key, st.st_size);
+	if (e) {
+		e->size = st.st_size;
+		e->atime = now_ns();
+		idx.header.misses++;
+		evict(c, &idx);
+		save_index(c, &idx);
+	}
+	free(idx.entries);
+}
+
+void cache_print_stats(struct cache *c, FILE *f) {
+	struct cache_index idx;
+	uint64_t total = 0;
+
+	load_index(c, &idx);
+	for (uint32_t i = 0; i < idx.header.count; i++)
+		total += idx.entries[i].size;
+	uint64_t lookups = idx.header.hits + idx.header.misses;
+	fprintf(f, "cache:     %s\n", c->dir);
+	fprintf(f, "entries:   %u\n", idx.header.count);
+	fprintf(f, "bytes:     %llu of %llu\n", (unsigned long long) total, (unsigned long long) c->max_bytes);
+	fprintf(f, "hits:      %llu\n", (unsigned long long) idx.header.hits);
+	fprintf(f, "misses:    %llu\n", (unsigned long long) idx.header.misses);
+	fprintf(f, "evictions: %llu\n", (unsigned long long) idx.header.evictions);
+	fprintf(f, "hit rate:  %.1f%%\n", lookups ? 100.0 * idx.header.hits / lookups : 0.0);
+	free(idx.entries);
+}
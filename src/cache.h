@@ -0,0 +1,67 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sha256.h"
+
+/*
+ * Content-addressed cache for conversion results.
+ *
+ * The key is SHA-256 over the tool name, MRVLFW_VERSION, the options that
+ * affect the output and the input bytes. Layout of the cache directory:
+ *   objects/<key>   read-only output files, copied to the outputs
+ *   index           sorted table of keys with size, last use and hit count
+ *   tmp/            files being written
+ *
+ * Nothing is locked. Objects and the index are written to tmp/ and renamed
+ * into place, so readers always see complete files. Two processes updating
+ * the index at the same time can lose each other's LRU and statistics
+ * updates, never objects: an object missing from the index still hits.
+ */
+#define CACHE_DEFAULT_MAX_BYTES (1024ull * 1024 * 1024)
+
+struct cache {
+	char dir[PATH_MAX];
+	uint64_t max_bytes;                   // LRU limit for all objects
+	uint8_t key[SHA256_DIGEST_SIZE];
+	char keyhex[2 * SHA256_DIGEST_SIZE + 1];
+};
+
+/*
+ * dir == NULL uses $MRVLFW_CACHE_DIR; returns 0 if that is not set either,
+ * i.e. caching is disabled. $MRVLFW_CACHE_SIZE sets max_bytes (K/M/G).
+ */
+extern int cache_open(struct cache *c, const char *dir);
+
+extern void cache_key(struct cache *c, const char *tool, const char *options, const void *input, size_t len);
+
+/*
+ * On a hit, replace output by a copy of the cached object and return 1.
+ * The copy is a reflink where the file system supports it. It is a new,
+ * writable file like any other output, so rewriting it never touches
+ * the cache.
+ */
+extern int cache_fetch(struct cache *c, const char *output);
+
+/* Add output under the current key, then evict down to max_bytes. */
+extern void cache_store(struct cache *c, const char *output);
+
+extern void cache_print_stats(struct cache *c, FILE *f);
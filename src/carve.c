@@ -0,0 +1,256 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "carve.h"
+#include "crc32.h"
+#include "marvel-88mw30x-firmware.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SCAN_AVX2
+#endif
+#ifdef __SSE2__
+#define HAVE_SCAN_SSE2
+#endif
+
+/* Dumps are scanned in pieces of this size, one task each. */
+#define CARVE_CHUNK_SIZE (8 * 1024 * 1024)
+
+/* "MRVL" followed by 0x2E9CF17B, little-endian */
+static const uint8_t signature[8] = { 'M', 'R', 'V', 'L', 0x7B, 0xF1, 0x9C, 0x2E };
+
+/*
+ * A scanner returns the first p in [from, to) where the signature starts,
+ * or NULL. It may read, but not match, up to limit.
+ */
+typedef const uint8_t* (*scan_fn)(const uint8_t *from, const uint8_t *to, const uint8_t *limit);
+
+struct carve_chunk {
+	const uint8_t *buf;
+	size_t len;
+	size_t start;
+	size_t end;
+	int flags;
+	struct MarvellCarvedImage *images;
+	size_t count;
+	size_t cap;
+	int failed;                           // out of memory, later images are dropped
+};
+
+static scan_fn scan;
+
+
+static const uint8_t* scan_generic(const uint8_t *from, const uint8_t *to, const uint8_t *limit) {
+	const uint8_t *p = from;
+	while (p < to && (p = memchr(p, signature[0], to - p)) != NULL) {
+		if (limit - p >= sizeof(signature) && memcmp(p, signature, sizeof(signature)) == 0)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/*
+ * The vector scanners compare byte 0 and byte 4 of the signature at 16 or
+ * 32 positions at once; the few candidates left are checked with memcmp.
+ */
+#ifdef HAVE_SCAN_SSE2
+static const uint8_t* scan_sse2(const uint8_t *from, const uint8_t *to, const uint8_t *limit) {
+	const __m128i m = _mm_set1_epi8(signature[0]);
+	const __m128i k = _mm_set1_epi8(signature[4]);
+	const uint8_t *p = from;
+
+	for (; p < to && limit - p >= 16 + 4 + 4; p += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) p);
+		__m128i b = _mm_loadu_si128((const __m128i*) (p + 4));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, m), _mm_cmpeq_epi8(b, k)));
+		while (mask) {
+			const uint8_t *hit = p + __builtin_ctz(mask);
+			if (hit >= to)
+				return NULL;
+			if (memcmp(hit, signature, sizeof(signature)) == 0)
+				return hit;
+			mask &= mask - 1;
+		}
+	}
+	return p < to ? scan_generic(p, to, limit) : NULL;
+}
+#endif
+
+#ifdef HAVE_SCAN_AVX2
+__attribute__((target("avx2")))
+static const uint8_t* scan_avx2(const uint8_t *from, const uint8_t *to, const uint8_t *limit) {
+	const __m256i m = _mm256_set1_epi8(signature[0]);
+	const __m256i k = _mm256_set1_epi8(signature[4]);
+	const uint8_t *p = from;
+
+	for (; p < to && limit - p >= 32 + 4 + 4; p += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) p);
+		__m256i b = _mm256_loadu_si256((const __m256i*) (p + 4));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, m), _mm256_cmpeq_epi8(b, k)));
+		while (mask) {
+			const uint8_t *hit = p + __builtin_ctz(mask);
+			if (hit >= to)
+				return NULL;
+			if (memcmp(hit, signature, sizeof(signature)) == 0)
+				return hit;
+			mask &= mask - 1;
+		}
+	}
+	return p < to ? scan_generic(p, to, limit) : NULL;
+}
+#endif
+
+__attribute__((constructor))
+static void carve_setup(void) {
+	scan = scan_generic;
+#ifdef HAVE_SCAN_SSE2
+	scan = scan_sse2;
+#endif
+#ifdef HAVE_SCAN_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+#endif
+}
+
+/*
+ * Stricter than check_marvel_firmware(): the bytes after a stray signature
+ * are arbitrary, so segments must also start behind the segment table and
+ * must not overlap. Returns the image size, or 0 if this is no image.
+ */
+static uint64_t check_candidate(const uint8_t *p, size_t avail) {
+	if (check_marvel_firmware(p, avail) != NULL)
+		return 0;
+
+	const struct MarvellHeader *hdr = (const struct MarvellHeader*) p;
+	const struct MarvellSegmentHeader *sh = (const struct MarvellSegmentHeader*) (p + sizeof(struct MarvellHeader));
+	uint64_t tablelen = sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * hdr->num_segments;
+	uint64_t size = tablelen;
+
+	if (hdr->num_segments == 0)
+		return 0;
+	for (int i = 0; i < hdr->num_segments; i++) {
+		uint64_t begin = sh[i].offset, end = begin + sh[i].size;
+		if (begin < tablelen || sh[i].size == 0)
+			return 0;
+		for (int j = 0; j < i; j++) {
+			if (begin < (uint64_t) sh[j].offset + sh[j].size && sh[j].offset < end)
+				return 0;
+		}
+		if (end > size)
+			size = end;
+	}
+	return size;
+}
+
+static uint32_t check_crcs(const uint8_t *p) {
+	const struct MarvellHeader *hdr = (const struct MarvellHeader*) p;
+	const struct MarvellSegmentHeader *sh = (const struct MarvellSegmentHeader*) (p + sizeof(struct MarvellHeader));
+	uint32_t bad = 0;
+
+	for (int i = 0; i < hdr->num_segments; i++) {
+		struct crc32_state st;
+		crc32_init(&st);
+		crc32_update(&st, p + sh[i].offset, sh[i].size);
+		if (crc32_final(&st) != sh[i].checksum)
+			bad |= 1u << i;
+	}
+	return bad;
+}
+
+static void add_image(struct carve_chunk *c, const struct MarvellCarvedImage *img) {
+	if (c->failed)
+		return;
+	if (c->count == c->cap) {
+		size_t cap = c->cap ? c->cap * 2 : 16;
+		struct MarvellCarvedImage *images = realloc(c->images, sizeof(struct MarvellCarvedImage) * cap);
+		if (!images) {
+			c->failed = 1;
+			return;
+		}
+		c->images = images;
+		c->cap = cap;
+	}
+	c->images[c->count++] = *img;
+}
+
+static void carve_task(void *arg) {
+	struct carve_chunk *c = arg;
+	const uint8_t *limit = c->buf + c->len;
+	const uint8_t *p = c->buf + c->start;
+	const uint8_t *to = c->buf + c->end;
+
+	while ((p = scan(p, to, limit)) != NULL) {
+		struct MarvellCarvedImage img;
+		img.offset = p - c->buf;
+		img.size = check_candidate(p, limit - p);
+		if (img.size) {
+			img.num_segments = ((const struct MarvellHeader*) p)->num_segments;
+			img.bad_segments = c->flags & MRVL_CARVE_VERIFY ? check_crcs(p) : 0;
+			if (!img.bad_segments || c->flags & MRVL_CARVE_ALL)
+				add_image(c, &img);
+		}
+		p++;
+	}
+}
+
+struct MarvellCarvedImage* carve_marvel_firmware(const uint8_t *buf, size_t len, struct threadpool *pool, int flags, size_t *count) {
+	size_t nchunks = (len + CARVE_CHUNK_SIZE - 1) / CARVE_CHUNK_SIZE;
+	struct carve_chunk *chunks = calloc(nchunks ? nchunks : 1, sizeof(struct carve_chunk));
+	struct taskgroup group = TASKGROUP_INIT;
+	if (!chunks)
+		return NULL;
+
+	for (size_t i = 0; i < nchunks; i++) {
+		struct carve_chunk *c = &chunks[i];
+		c->buf = buf;
+		c->len = len;
+		c->start = i * CARVE_CHUNK_SIZE;
+		c->end = c->start + CARVE_CHUNK_SIZE < len ? c->start + CARVE_CHUNK_SIZE : len;
+		c->flags = flags;
+		if (pool)
+			threadpool_submit(pool, &group, carve_task, c);
+		else
+			carve_task(c);
+	}
+	if (pool)
+		threadpool_wait(pool, &group);
+
+	size_t total = 0;
+	int failed = 0;
+	for (size_t i = 0; i < nchunks; i++) {
+		total += chunks[i].count;
+		failed |= chunks[i].failed;
+	}
+	struct MarvellCarvedImage *images = failed ? NULL : malloc(sizeof(struct MarvellCarvedImage) * (total ? total : 1));
+	if (!images) {
+		for (size_t i = 0; i < nchunks; i++)
+			free(chunks[i].images);
+		free(chunks);
+		return NULL;
+	}
+	*count = 0;
+	for (size_t i = 0; i < nchunks; i++) {
+		memcpy(images + *count, chunks[i].images, sizeof(struct MarvellCarvedImage) * chunks[i].count);
+		*count += chunks[i].count;
+		free(chunks[i].images);
+	}
+	free(chunks);
+	return images;
+}
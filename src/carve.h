@@ -0,0 +1,47 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+/*
+ * Carver for firmware images embedded in raw flash dumps.
+ *
+ * The dump is split into chunks that are scanned in parallel for the
+ * 8 byte signature "MRVL" 7B F1 9C 2E (SSE2/AVX2 where available). Every
+ * hit is validated like a firmware file whose first byte is at the hit:
+ * the segment table must lie within the dump, segments must not overlap
+ * the table or each other, and with MRVL_CARVE_VERIFY the CRCs must match.
+ */
+#define MRVL_CARVE_VERIFY     1           // check segment CRCs
+#define MRVL_CARVE_ALL        2           // also report images with bad CRCs
+
+struct MarvellCarvedImage {
+	uint64_t offset;                      // of the header in the dump
+	uint64_t size;                        // header up to the end of the last segment
+	uint32_t num_segments;
+	uint32_t bad_segments;                // bitmask of CRC mismatches
+};
+
+/*
+ * Returns a malloc'ed array of the images found, ordered by offset, and
+ * their number in *count, or NULL if out of memory. pool may be NULL to
+ * scan on the calling thread.
+ */
+extern struct MarvellCarvedImage* carve_marvel_firmware(const uint8_t *buf, size_t len, struct threadpool *pool, int flags, size_t *count);
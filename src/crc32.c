@@ -12,6 +12,23 @@
  * https://en.wikipedia.org/wiki/Computation_of_cyclic_redundancy_checks#CRC_variants
  */
 #include "crc32.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CRC32_PCLMUL 1
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC32_PMULL 1
+#endif
 
 static uint32_t poly8_lookup[256] =
 {
@@ -81,12 +98,479 @@ static uint32_t poly8_lookup[256] =
 	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
 };
 
-uint32_t crc32_byte(uint8_t *p, uint32_t bytelength)
+/*
+ * Slicing-by-N tables: crc32_tables[k][n] is the CRC of byte n followed by
+ * k zero bytes. crc32_tables[0] is poly8_lookup.
+ */
+static uint32_t crc32_tables[16][256];
+
+static const struct crc32_kernel *crc32_active;
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+/* Reference implementation: one byte per iteration. */
+uint32_t crc32_ref(uint32_t crc, const uint8_t *p, size_t len)
 {
-	uint32_t crc = 0;
-	while (bytelength-- != 0) {
+	while (len-- != 0) {
 		crc = poly8_lookup[((uint8_t) crc ^ *p)] ^ (crc >> 8);
 		p++;
 	}
 	return crc;
 }
+
+uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256]) crc32_tables;
+
+	while (len >= 8) {
+		uint32_t one = load_le32(p) ^ crc;
+		uint32_t two = load_le32(p + 4);
+		crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+		      t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+		      t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+		      t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+	return crc32_ref(crc, p, len);
+}
+
+uint32_t crc32_slice16(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256]) crc32_tables;
+
+	while (len >= 16) {
+		uint32_t w0 = load_le32(p) ^ crc;
+		uint32_t w1 = load_le32(p + 4);
+		uint32_t w2 = load_le32(p + 8);
+		uint32_t w3 = load_le32(p + 12);
+		crc = t[15][w0 & 0xff] ^ t[14][(w0 >> 8) & 0xff] ^
+		      t[13][(w0 >> 16) & 0xff] ^ t[12][w0 >> 24] ^
+		      t[11][w1 & 0xff] ^ t[10][(w1 >> 8) & 0xff] ^
+		      t[9][(w1 >> 16) & 0xff] ^ t[8][w1 >> 24] ^
+		      t[7][w2 & 0xff] ^ t[6][(w2 >> 8) & 0xff] ^
+		      t[5][(w2 >> 16) & 0xff] ^ t[4][w2 >> 24] ^
+		      t[3][w3 & 0xff] ^ t[2][(w3 >> 8) & 0xff] ^
+		      t[1][(w3 >> 16) & 0xff] ^ t[0][w3 >> 24];
+		p += 16;
+		len -= 16;
+	}
+	return crc32_slice8(crc, p, len);
+}
+
+/*
+ * Carry-less multiplication folding, after Gopal et al., "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel,
+ * 2009). The constants are x^n mod P(x) for the reflected polynomial
+ * 0xEDB88320. Since our variant has neither preset nor post-invert, the
+ * running crc value is folded in as is.
+ */
+static const uint64_t __attribute__((aligned(16))) clmul_k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t __attribute__((aligned(16))) clmul_k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t __attribute__((aligned(16))) clmul_k5k0[] = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t __attribute__((aligned(16))) clmul_poly[] = { 0x01db710641, 0x01f7011641 };
+
+#ifdef HAVE_CRC32_PCLMUL
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_blocks(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	/* len is a multiple of 16 and at least 64 */
+	x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *) clmul_k1k2);
+	buf += 64;
+	len -= 64;
+
+	// fold 4x128 bits in parallel
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	// fold 4x128 into 128 bits
+	x0 = _mm_load_si128((const __m128i *) clmul_k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// remaining 128-bit blocks
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *) buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	// fold 128 to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *) clmul_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i *) clmul_poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	if (len >= 64) {
+		size_t n = len & ~(size_t) 15;
+		crc = crc32_pclmul_blocks(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return crc32_slice8(crc, p, len);
+}
+
+static int crc32_pclmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#ifdef HAVE_CRC32_PMULL
+__attribute__((target("+crypto")))
+static inline uint64x2_t pmull_lo(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(a, 0), vgetq_lane_u64(b, 0)));
+}
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t pmull_hi(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(a, 1), vgetq_lane_u64(b, 1)));
+}
+
+/* a.lo * b.hi, as _mm_clmulepi64_si128(a, b, 0x10) */
+__attribute__((target("+crypto")))
+static inline uint64x2_t pmull_lo_hi(uint64x2_t a, uint64x2_t b)
+{
+	return vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(a, 0), vgetq_lane_u64(b, 1)));
+}
+
+static inline uint64x2_t shr_bytes(uint64x2_t a, int n)
+{
+	uint8x16_t z = vdupq_n_u8(0);
+	if (n == 8)
+		return vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(a), z, 8));
+	return vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(a), z, 4));
+}
+
+/* Same folding scheme as crc32_pclmul_blocks(). */
+__attribute__((target("+crypto")))
+static uint32_t crc32_pmull_blocks(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64x2_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	static const uint32_t __attribute__((aligned(16))) mask[] = { ~0u, 0, ~0u, 0 };
+
+	x1 = vld1q_u64((const uint64_t *) (buf + 0x00));
+	x2 = vld1q_u64((const uint64_t *) (buf + 0x10));
+	x3 = vld1q_u64((const uint64_t *) (buf + 0x20));
+	x4 = vld1q_u64((const uint64_t *) (buf + 0x30));
+	x1 = veorq_u64(x1, vreinterpretq_u64_u32(vsetq_lane_u32(crc, vdupq_n_u32(0), 0)));
+	x0 = vld1q_u64(clmul_k1k2);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = pmull_lo(x1, x0);
+		x6 = pmull_lo(x2, x0);
+		x7 = pmull_lo(x3, x0);
+		x8 = pmull_lo(x4, x0);
+		x1 = pmull_hi(x1, x0);
+		x2 = pmull_hi(x2, x0);
+		x3 = pmull_hi(x3, x0);
+		x4 = pmull_hi(x4, x0);
+		x1 = veorq_u64(veorq_u64(x1, x5), vld1q_u64((const uint64_t *) (buf + 0x00)));
+		x2 = veorq_u64(veorq_u64(x2, x6), vld1q_u64((const uint64_t *) (buf + 0x10)));
+		x3 = veorq_u64(veorq_u64(x3, x7), vld1q_u64((const uint64_t *) (buf + 0x20)));
+		x4 = veorq_u64(veorq_u64(x4, x8), vld1q_u64((const uint64_t *) (buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	x0 = vld1q_u64(clmul_k3k4);
+	x5 = pmull_lo(x1, x0);
+	x1 = veorq_u64(veorq_u64(pmull_hi(x1, x0), x2), x5);
+	x5 = pmull_lo(x1, x0);
+	x1 = veorq_u64(veorq_u64(pmull_hi(x1, x0), x3), x5);
+	x5 = pmull_lo(x1, x0);
+	x1 = veorq_u64(veorq_u64(pmull_hi(x1, x0), x4), x5);
+
+	while (len >= 16) {
+		x2 = vld1q_u64((const uint64_t *) buf);
+		x5 = pmull_lo(x1, x0);
+		x1 = veorq_u64(veorq_u64(pmull_hi(x1, x0), x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	x2 = pmull_lo_hi(x1, x0);
+	x3 = vreinterpretq_u64_u32(vld1q_u32(mask));
+	x1 = veorq_u64(shr_bytes(x1, 8), x2);
+	x0 = vld1q_u64(clmul_k5k0);
+	x2 = shr_bytes(x1, 4);
+	x1 = vandq_u64(x1, x3);
+	x1 = veorq_u64(pmull_lo(x1, x0), x2);
+
+	x0 = vld1q_u64(clmul_poly);
+	x2 = vandq_u64(x1, x3);
+	x2 = vandq_u64(pmull_lo_hi(x2, x0), x3);
+	x2 = pmull_lo(x2, x0);
+	x1 = veorq_u64(x1, x2);
+	return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+uint32_t crc32_pmull(uint32_t crc, const uint8_t *p, size_t len)
+{
+	if (len >= 64) {
+		size_t n = len & ~(size_t) 15;
+		crc = crc32_pmull_blocks(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return crc32_slice8(crc, p, len);
+}
+
+static int crc32_pmull_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+}
+#endif
+
+static int crc32_always_supported(void)
+{
+	return 1;
+}
+
+/* Ordered from slowest to fastest; crc32_setup() picks the last usable one. */
+const struct crc32_kernel crc32_kernels[] = {
+	{ "byte",    crc32_ref,     crc32_always_supported },
+	{ "slice8",  crc32_slice8,  crc32_always_supported },
+	{ "slice16", crc32_slice16, crc32_always_supported },
+#ifdef HAVE_CRC32_PCLMUL
+	{ "pclmul",  crc32_pclmul,  crc32_pclmul_supported },
+#endif
+#ifdef HAVE_CRC32_PMULL
+	{ "pmull",   crc32_pmull,   crc32_pmull_supported },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+/*
+ * GF(2) polynomial arithmetic modulo P(x), bit-reflected like the CRC
+ * itself, for crc32_combine(). After zlib's multmodp()/x2nmodp().
+ */
+#define CRC32_POLY 0xEDB88320
+
+/* x^(2^k) mod P(x), k = 0..31 */
+static uint32_t x2n_table[32];
+
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t) 1 << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^(n * 2^k) mod P(x) */
+static uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+	uint32_t p = (uint32_t) 1 << 31;
+
+	while (n) {
+		if (n & 1)
+			p = multmodp(x2n_table[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+__attribute__((constructor))
+static void crc32_setup(void)
+{
+	for (int n = 0; n < 256; n++)
+		crc32_tables[0][n] = poly8_lookup[n];
+	for (int k = 1; k < 16; k++) {
+		for (int n = 0; n < 256; n++) {
+			uint32_t c = crc32_tables[k - 1][n];
+			crc32_tables[k][n] = poly8_lookup[c & 0xff] ^ (c >> 8);
+		}
+	}
+
+	uint32_t p = (uint32_t) 1 << 30;
+	x2n_table[0] = p;
+	for (int n = 1; n < 32; n++)
+		x2n_table[n] = p = multmodp(p, p);
+
+	for (const struct crc32_kernel *k = crc32_kernels; k->name; k++) {
+		if (k->supported())
+			crc32_active = k;
+	}
+
+	// keep the automatic choice, but do not let a typo go unnoticed
+	const char *force = getenv("MRVL_CRC32_KERNEL");
+	if (force && *force && crc32_set_kernel(force) != 0)
+		fprintf(stderr, "warning: MRVL_CRC32_KERNEL=%s is unknown or not supported here, using %s\n",
+			force, crc32_active->name);
+}
+
+const struct crc32_kernel* crc32_get_kernel(void)
+{
+	return crc32_active;
+}
+
+int crc32_set_kernel(const char *name)
+{
+	for (const struct crc32_kernel *k = crc32_kernels; k->name; k++) {
+		if (strcmp(k->name, name) == 0) {
+			if (!k->supported())
+				return -1;
+			crc32_active = k;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Compare every usable kernel against the reference on all lengths 0..1024
+ * and all start alignments 0..15, with non-zero seeds. Also check that
+ * chunked updates and crc32_combine() agree with a single pass.
+ * Returns the number of mismatches.
+ */
+int crc32_selftest(void)
+{
+	static uint8_t buf[1024 + 16];
+	uint32_t x = 0x12345678;
+	int failures = 0;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 24;
+	}
+
+	for (const struct crc32_kernel *k = crc32_kernels; k->name; k++) {
+		if (!k->supported())
+			continue;
+		for (size_t align = 0; align < 16; align++) {
+			for (size_t len = 0; len <= 1024; len++) {
+				uint32_t seed = (uint32_t) (len * 0x9E3779B9u);
+				if (k->fn(seed, buf + align, len) != crc32_ref(seed, buf + align, len))
+					failures++;
+			}
+		}
+	}
+
+	uint32_t whole = crc32_ref(0, buf, 1024);
+	for (size_t split = 0; split <= 1024; split += 7) {
+		struct crc32_state st;
+		crc32_init(&st);
+		crc32_update(&st, buf, split);
+		crc32_update(&st, buf + split, 1024 - split);
+		if (crc32_final(&st) != whole)
+			failures++;
+
+		uint32_t a = crc32_ref(0, buf, split);
+		uint32_t b = crc32_ref(0, buf + split, 1024 - split);
+		if (crc32_combine(a, b, 1024 - split) != whole)
+			failures++;
+	}
+	return failures;
+}
+
+void crc32_init(struct crc32_state *st)
+{
+	st->crc = 0;
+	st->len = 0;
+}
+
+void crc32_update(struct crc32_state *st, const void *p, size_t len)
+{
+	MRVL_STATS_START(t);
+	st->crc = crc32_active->fn(st->crc, p, len);
+	st->len += len;
+	MRVL_STATS_STOP(t, MRVL_PHASE_CRC, len);
+}
+
+uint32_t crc32_final(const struct crc32_state *st)
+{
+	return st->crc;
+}
+
+/*
+ * Without preset and post-invert the CRC is linear, so
+ * crc(A || B) = crc(A) * x^(8 * len(B)) mod P(x) + crc(B).
+ */
+uint32_t crc32_combine(uint32_t crcA, uint32_t crcB, uint64_t lenB)
+{
+	return multmodp(x2nmodp(lenB, 3), crcA) ^ crcB;
+}
+
+uint32_t crc32_byte(uint8_t *p, uint32_t bytelength)
+{
+	MRVL_STATS_START(t);
+	uint32_t crc = crc32_active->fn(0, p, bytelength);
+	MRVL_STATS_STOP(t, MRVL_PHASE_CRC, bytelength);
+	return crc;
+}
@@ -1,4 +1,40 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
+/* A CRC kernel continues a running crc over len bytes at p. */
+typedef uint32_t (*crc32_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+struct crc32_kernel {
+	const char *name;
+	crc32_fn fn;
+	int (*supported)(void);
+};
+
+/* All compiled-in kernels, terminated by an entry with name == NULL. */
+extern const struct crc32_kernel crc32_kernels[];
+
+extern uint32_t crc32_ref(uint32_t crc, const uint8_t *p, size_t len);
+extern uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t len);
+extern uint32_t crc32_slice16(uint32_t crc, const uint8_t *p, size_t len);
+
+/* Kernel used by crc32_byte(); the fastest one the CPU supports, unless
+ * overridden by crc32_set_kernel() or the MRVL_CRC32_KERNEL variable. */
+extern const struct crc32_kernel* crc32_get_kernel(void);
+extern int crc32_set_kernel(const char *name);
+extern int crc32_selftest(void);
+
 extern uint32_t crc32_byte(uint8_t *p, uint32_t bytelength);
+
+/* Incremental interface, for data that arrives in pieces. */
+struct crc32_state {
+	uint32_t crc;
+	uint64_t len;                         // bytes consumed so far
+};
+
+extern void crc32_init(struct crc32_state *st);
+extern void crc32_update(struct crc32_state *st, const void *p, size_t len);
+extern uint32_t crc32_final(const struct crc32_state *st);
+
+/* CRC of A || B, given crc(A), crc(B) and the length of B. */
+extern uint32_t crc32_combine(uint32_t crcA, uint32_t crcB, uint64_t lenB);
@@ -0,0 +1,195 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "daemon.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static atomic_uint next_id;
+
+
+const char* mrvld_socket_path(char *buf, size_t len) {
+	const char *env = getenv("MRVLFWD_SOCKET"), *dir = getenv("XDG_RUNTIME_DIR");
+	if (env && *env)
+		snprintf(buf, len, "%s", env);
+	else if (dir && *dir)
+		snprintf(buf, len, "%s/mrvlfwd.sock", dir);
+	else
+		snprintf(buf, len, "/tmp/mrvlfwd-%u.sock", (unsigned) getuid());
+	return buf;
+}
+
+static int make_address(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/* A stale socket from a daemon that died is replaced, a live one is not. */
+int mrvld_listen(const char *path) {
+	struct sockaddr_un addr;
+	if (make_address(path, &addr) != 0)
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		if (errno != EADDRINUSE)
+			goto fail;
+		int live = mrvld_connect(path);
+		if (live >= 0 || errno != ECONNREFUSED) {
+			if (live >= 0)
+				close(live);
+			errno = EADDRINUSE;
+			goto fail;
+		}
+		unlink(path);
+		if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+			goto fail;
+	}
+	if (listen(sock, SOMAXCONN) != 0)
+		goto fail;
+	return sock;
+
+fail:;
+	int saved = errno;
+	close(sock);
+	errno = saved;
+	return -1;
+}
+
+int mrvld_connect(const char *path) {
+	struct sockaddr_un addr;
+	if (make_address(path, &addr) != 0)
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		int saved = errno;
+		close(sock);
+		errno = saved;
+		return -1;
+	}
+	// the socket may be in /tmp: never hand descriptors to another user's daemon
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 || cred.uid != getuid()) {
+		close(sock);
+		errno = EPERM;
+		return -1;
+	}
+	return sock;
+}
+
+int mrvld_send(int sock, const void *msg, size_t len, const int *fds, int nfds) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * MRVLD_MAX_FDS)];
+	} control;
+	struct iovec iov = { (void*) msg, len };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if (nfds > MRVLD_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (nfds > 0) {
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+	ssize_t n;
+	while ((n = sendmsg(sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	return n == (ssize_t) len ? 0 : -1;
+}
+
+ssize_t mrvld_recv(int sock, void *msg, size_t len, int flags, int *fds, int *nfds) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * MRVLD_MAX_FDS)];
+	} control;
+	struct iovec iov = { msg, len };
+	struct msghdr mh = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+	};
+	ssize_t n;
+
+	*nfds = 0;
+	while ((n = recvmsg(sock, &mh, flags | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	if (n < 0)
+		return -1;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds + *nfds, CMSG_DATA(cm), sizeof(int) * count);
+		*nfds += count;
+	}
+	// descriptors beyond the limit are dropped by the kernel (MSG_CTRUNC)
+	if (n > 0 && (n != (ssize_t) len || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))) {
+		for (int i = 0; i < *nfds; i++)
+			close(fds[i]);
+		*nfds = 0;
+		errno = EPROTO;
+		return -1;
+	}
+	return n;
+}
+
+int mrvld_call(int sock, uint16_t op, uint32_t ctime, const int *fds, int nfds, struct mrvld_response *resp) {
+	struct mrvld_request req = {
+		.magic = MRVLD_MAGIC, .version = MRVLD_VERSION, .op = op,
+		.id = atomic_fetch_add(&next_id, 1), .ctime = ctime,
+	};
+	int rfds[MRVLD_MAX_FDS], rnfds;
+	if (mrvld_send(sock, &req, sizeof(req), fds, nfds) != 0)
+		return -1;
+	ssize_t n = mrvld_recv(sock, resp, sizeof(*resp), 0, rfds, &rnfds);
+	for (int i = 0; i < rnfds; i++)
+		close(rfds[i]);
+	if (n == 0)
+		errno = ECONNRESET;
+	if (n <= 0)
+		return -1;
+	if (resp->magic != MRVLD_MAGIC || resp->version != MRVLD_VERSION || resp->id != req.id) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "marvel-88mw30x-firmware.h"
+
+/*
+ * Protocol of fwdaemon, a conversion server on a local SOCK_SEQPACKET
+ * socket.
+ *
+ * Every request is one message: a struct mrvld_request with the open
+ * files it works on attached as SCM_RIGHTS, so the daemon reads and
+ * writes them directly and no file data crosses the socket. Every request
+ * gets one struct mrvld_response with the same id. A connection may have
+ * several requests in flight; their responses may come in any order.
+ * Both sides are on the same host, so integers are in host byte order.
+ */
+#define MRVLD_MAGIC     0x4456524d        // "MRVD"
+#define MRVLD_VERSION   1
+#define MRVLD_MAX_FDS   2
+
+enum mrvld_op {
+	MRVLD_OP_PING = 0,                    // no files; for the latency floor
+	MRVLD_OP_INFO = 1,                    // image: tables and actual CRCs
+	MRVLD_OP_VERIFY = 2,                  // image: as INFO, MRVL_ERR_CHECKSUM on mismatch
+	MRVLD_OP_TO_ELF = 3,                  // image, output: firmware2elf
+	MRVLD_OP_FROM_ELF = 4,                // ELF, output: axf2firmware
+};
+
+struct mrvld_request {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t op;                          // enum mrvld_op
+	uint32_t id;                          // echoed in the response
+	uint32_t ctime;                       // MRVLD_OP_FROM_ELF
+};
+
+struct mrvld_response {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t op;
+	uint32_t id;
+	int32_t status;                       // enum mrvl_status
+	int32_t error;                        // errno, for MRVL_ERR_IO
+	uint32_t num_fds;                     // received with the request
+	uint64_t output_size;                 // conversions
+	struct MarvellHeader header;          // INFO, VERIFY and TO_ELF
+	struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS];
+	uint32_t checksums[MRVL_MAX_SEGMENTS]; // actual CRCs
+};
+
+/*
+ * Socket path: $MRVLFWD_SOCKET, else mrvlfwd.sock in $XDG_RUNTIME_DIR,
+ * else /tmp/mrvlfwd-<uid>.sock.
+ */
+extern const char* mrvld_socket_path(char *buf, size_t len);
+
+/*
+ * Both return a socket, or -1 with errno set. mrvld_connect() fails with
+ * EPERM if the daemon runs as another user.
+ */
+extern int mrvld_listen(const char *path);
+extern int mrvld_connect(const char *path);
+
+/*
+ * One message with up to MRVLD_MAX_FDS descriptors. mrvld_recv() stores
+ * the descriptors it receives, close-on-exec, in fds and their number in
+ * *nfds, and returns the message size, 0 at the end of the connection or
+ * -1 with errno set. A message of the wrong size is an error (EPROTO).
+ */
+extern int mrvld_send(int sock, const void *msg, size_t len, const int *fds, int nfds);
+extern ssize_t mrvld_recv(int sock, void *msg, size_t len, int flags, int *fds, int *nfds);
+
+/*
+ * Send a request and wait for its response, for clients with one request
+ * in flight per connection. Returns 0, or -1 with errno set.
+ */
+extern int mrvld_call(int sock, uint16_t op, uint32_t ctime, const int *fds, int nfds, struct mrvld_response *resp);
@@ -0,0 +1,376 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "decompress.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Producer buffers, and the requested pipe capacity. */
+#define IN_SIZE (128 * 1024)
+#define OUT_SIZE (128 * 1024)
+#define RING_SIZE (1024 * 1024)
+
+struct codec {
+	const char *name;
+	uint8_t magic[MRVL_CODEC_MAGIC_SIZE];
+	size_t magic_len;
+	int supported;
+	const char *missing;
+};
+
+static const struct codec codecs[] = {
+	[MRVL_CODEC_NONE] = { "none", { 0 }, 0, 1, NULL },
+	[MRVL_CODEC_GZIP] = { "gzip", { 0x1f, 0x8b }, 2,
+#ifdef HAVE_ZLIB
+		1,
+#else
+		0,
+#endif
+		"gzip input, but built without zlib" },
+	[MRVL_CODEC_XZ] = { "xz", { 0xfd, '7', 'z', 'X', 'Z', 0x00 }, 6,
+#ifdef HAVE_LZMA
+		1,
+#else
+		0,
+#endif
+		"xz input, but built without liblzma" },
+	[MRVL_CODEC_ZSTD] = { "zstd", { 0x28, 0xb5, 0x2f, 0xfd }, 4,
+#ifdef HAVE_ZSTD
+		1,
+#else
+		0,
+#endif
+		"zstd input, but built without libzstd" },
+};
+
+struct producer {
+	enum mrvl_codec codec;
+	int in;
+	int out;
+	uint8_t prefix[MRVL_CODEC_MAGIC_SIZE]; // bytes read for detection
+	size_t prefix_len;
+	const char *error;
+	uint8_t inbuf[IN_SIZE];
+	uint8_t outbuf[OUT_SIZE];
+};
+
+
+enum mrvl_codec mrvl_detect_codec(const uint8_t *buf, size_t len) {
+	for (int i = MRVL_CODEC_GZIP; i <= MRVL_CODEC_ZSTD; i++) {
+		if (len >= codecs[i].magic_len && memcmp(buf, codecs[i].magic, codecs[i].magic_len) == 0)
+			return i;
+	}
+	return MRVL_CODEC_NONE;
+}
+
+const char* mrvl_codec_name(enum mrvl_codec codec) {
+	return codecs[codec].name;
+}
+
+int mrvl_codec_supported(enum mrvl_codec codec) {
+	return codecs[codec].supported;
+}
+
+/* Input of the producer, starting with the bytes taken for detection. */
+static ssize_t producer_read(struct producer *p) {
+	if (p->prefix_len) {
+		ssize_t n = p->prefix_len;
+		memcpy(p->inbuf, p->prefix, n);
+		p->prefix_len = 0;
+		return n;
+	}
+	for (;;) {
+		ssize_t n = read(p->in, p->inbuf, IN_SIZE);
+		if (n >= 0 || errno != EINTR) {
+			if (n < 0)
+				p->error = strerror(errno);
+			return n;
+		}
+	}
+}
+
+/* Fails without an error message when the reader has gone. */
+static int producer_write(struct producer *p, size_t len) {
+	const uint8_t *buf = p->outbuf;
+	while (len > 0) {
+		ssize_t n = write(p->out, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int run_copy(struct producer *p) {
+	ssize_t n;
+	while ((n = producer_read(p)) > 0) {
+		memcpy(p->outbuf, p->inbuf, n);
+		if (producer_write(p, n) != 0)
+			return -1;
+	}
+	return n < 0 ? -1 : 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Concatenated gzip members, like gzip -d. */
+static int run_gzip(struct producer *p) {
+	z_stream zs;
+	int ret = Z_OK, status = 0, pending = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+		p->error = "cannot initialise zlib";
+		return -1;
+	}
+	for (;;) {
+		if (zs.avail_in == 0 && !pending) {
+			ssize_t n = producer_read(p);
+			if (n < 0 || n == 0) {
+				if (n == 0 && ret != Z_STREAM_END)
+					p->error = "truncated gzip data";
+				status = ret == Z_STREAM_END && n == 0 ? 0 : -1;
+				break;
+			}
+			zs.next_in = p->inbuf;
+			zs.avail_in = n;
+		}
+		if (ret == Z_STREAM_END)
+			inflateReset(&zs);
+		zs.next_out = p->outbuf;
+		zs.avail_out = OUT_SIZE;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			p->error = zs.msg ? zs.msg : "corrupt gzip data";
+			status = -1;
+			break;
+		}
+		pending = zs.avail_out == 0;
+		if (producer_write(p, OUT_SIZE - zs.avail_out) != 0) {
+			status = -1;
+			break;
+		}
+	}
+	inflateEnd(&zs);
+	return status;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int run_xz(struct producer *p) {
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	int status = 0;
+
+	if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		p->error = "cannot initialise liblzma";
+		return -1;
+	}
+	for (;;) {
+		if (strm.avail_in == 0 && action == LZMA_RUN) {
+			ssize_t n = producer_read(p);
+			if (n < 0) {
+				status = -1;
+				break;
+			}
+			if (n == 0)
+				action = LZMA_FINISH;
+			strm.next_in = p->inbuf;
+			strm.avail_in = n;
+		}
+		strm.next_out = p->outbuf;
+		strm.avail_out = OUT_SIZE;
+		lzma_ret ret = lzma_code(&strm, action);
+		if (producer_write(p, OUT_SIZE - strm.avail_out) != 0) {
+			status = -1;
+			break;
+		}
+		if (ret == LZMA_STREAM_END)
+			break;
+		if (ret != LZMA_OK) {
+			p->error = ret == LZMA_BUF_ERROR ? "truncated xz data" : "corrupt xz data";
+			status = -1;
+			break;
+		}
+	}
+	lzma_end(&strm);
+	return status;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int run_zstd(struct producer *p) {
+	ZSTD_DStream *ds = ZSTD_createDStream();
+	ZSTD_inBuffer in = { p->inbuf, 0, 0 };
+	size_t hint = 1;                      // 0 once a frame is complete
+	int status = 0, pending = 0;
+
+	if (!ds) {
+		p->error = "cannot initialise libzstd";
+		return -1;
+	}
+	ZSTD_initDStream(ds);
+	for (;;) {
+		if (in.pos == in.size && !pending) {
+			ssize_t n = producer_read(p);
+			if (n < 0 || n == 0) {
+				if (n == 0 && hint != 0)
+					p->error = "truncated zstd data";
+				status = n == 0 && hint == 0 ? 0 : -1;
+				break;
+			}
+			in.size = n;
+			in.pos = 0;
+		}
+		ZSTD_outBuffer out = { p->outbuf, OUT_SIZE, 0 };
+		hint = ZSTD_decompressStream(ds, &out, &in);
+		if (ZSTD_isError(hint)) {
+			p->error = ZSTD_getErrorName(hint);
+			status = -1;
+			break;
+		}
+		pending = out.pos == out.size;
+		if (producer_write(p, out.pos) != 0) {
+			status = -1;
+			break;
+		}
+	}
+	ZSTD_freeDStream(ds);
+	return status;
+}
+#endif
+
+static void* producer_main(void *arg) {
+	struct producer *p = arg;
+	int status = -1;
+
+	switch (p->codec) {
+		case MRVL_CODEC_NONE:
+			status = run_copy(p);
+			break;
+#ifdef HAVE_ZLIB
+		case MRVL_CODEC_GZIP:
+			status = run_gzip(p);
+			break;
+#endif
+#ifdef HAVE_LZMA
+		case MRVL_CODEC_XZ:
+			status = run_xz(p);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case MRVL_CODEC_ZSTD:
+			status = run_zstd(p);
+			break;
+#endif
+		default:
+			break;
+	}
+	if (status != 0 && p->error)
+		warnx("%s input: %s", mrvl_codec_name(p->codec), p->error);
+	close(p->out);
+	if (p->in != STDIN_FILENO)
+		close(p->in);
+	free(p);
+	return NULL;
+}
+
+int mrvl_decompress_fd(int fd, const char **errmsg) {
+	uint8_t magic[MRVL_CODEC_MAGIC_SIZE];
+	size_t len = 0;
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+
+	while (len < sizeof(magic)) {
+		ssize_t n = read(fd, magic + len, sizeof(magic) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			*errmsg = "cannot read input";
+			return -1;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	enum mrvl_codec codec = mrvl_detect_codec(magic, len);
+	if (codec == MRVL_CODEC_NONE && pos >= 0 && lseek(fd, pos, SEEK_SET) == pos)
+		return fd;
+	if (!codecs[codec].supported) {
+		*errmsg = codecs[codec].missing;
+		return -1;
+	}
+
+	// not seekable, or compressed: a producer thread feeds a pipe
+	struct producer *p = malloc(sizeof(struct producer));
+	int fds[2];
+	if (!p || pipe2(fds, O_CLOEXEC) != 0) {
+		free(p);
+		*errmsg = "cannot start decompression";
+		return -1;
+	}
+#ifdef F_SETPIPE_SZ
+	fcntl(fds[1], F_SETPIPE_SZ, RING_SIZE);
+#endif
+	p->codec = codec;
+	p->in = fd;
+	p->out = fds[1];
+	memcpy(p->prefix, magic, len);
+	p->prefix_len = len;
+	p->error = NULL;
+
+	// a reader that stops early makes write() fail with EPIPE, not kill us
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	int ret = pthread_create(&thread, &attr, producer_main, p);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		free(p);
+		*errmsg = "cannot start decompression";
+		return -1;
+	}
+	return fds[0];
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Transparent decompression of gzip, xz and zstd input, detected by magic.
+ * Each codec is optional at build time (HAVE_ZLIB, HAVE_LZMA, HAVE_ZSTD).
+ */
+enum mrvl_codec {
+	MRVL_CODEC_NONE,
+	MRVL_CODEC_GZIP,
+	MRVL_CODEC_XZ,
+	MRVL_CODEC_ZSTD,
+};
+
+/* Longest magic number of any codec. */
+#define MRVL_CODEC_MAGIC_SIZE 6
+
+extern enum mrvl_codec mrvl_detect_codec(const uint8_t *buf, size_t len);
+extern const char* mrvl_codec_name(enum mrvl_codec codec);
+extern int mrvl_codec_supported(enum mrvl_codec codec);
+
+/*
+ * Returns a descriptor with the decompressed contents of fd.
+ *
+ * Uncompressed, seekable input is returned as is. Otherwise a producer
+ * thread decompresses fd into a pipe, which serves as a bounded ring
+ * buffer: the caller parses and checksums the image while it is being
+ * decompressed. The thread owns fd from then on and closes it unless it is
+ * standard input; the caller closes the returned descriptor. A corrupt
+ * stream ends the pipe early, after a warning on stderr.
+ *
+ * Returns -1 and a message in *errmsg if the codec is not built in or the
+ * thread cannot be started.
+ */
+extern int mrvl_decompress_fd(int fd, const char **errmsg);
@@ -0,0 +1,536 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 500
+
+#include "delta.h"
+#include "crc32.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Matcher: the source image is indexed by a hash of the BLOCK bytes at
+ * every halfword-aligned address (the Thumb-2 instruction granularity),
+ * the target is scanned with a rolling hash of the same window. Before a
+ * lookup, the source position that continues the previous copy is tried,
+ * which is what an in-place edit needs. Matches are then extended byte by
+ * byte in both directions.
+ */
+#define BLOCK 16
+#define HASH_MUL 0x01000193u
+#define APPLY_BUFFER_SIZE (64 * 1024)
+
+#define OP_LITERAL 0
+#define OP_COPY    1
+
+struct bytebuf {
+	uint8_t *p;
+	size_t len;
+	size_t cap;
+	int failed;                           // out of memory, later appends are dropped
+};
+
+struct source_index {
+	const uint8_t *image;
+	size_t size;
+	uint32_t *slots;                      // source position + 1, 0 = empty
+	int bits;
+	uint32_t pow;                         // HASH_MUL^(BLOCK-1), for rolling
+};
+
+struct piece_job {
+	const struct source_index *idx;
+	const uint8_t *target;
+	size_t len;
+	uint32_t vaddr;                       // of target[0]
+	struct bytebuf ops;
+	struct MarvellDeltaStats stats;
+};
+
+
+static int buf_reserve(struct bytebuf *b, size_t n) {
+	if (b->failed)
+		return -1;
+	if (b->len + n <= b->cap)
+		return 0;
+	size_t cap = b->cap;
+	while (b->len + n > cap)
+		cap = cap ? cap * 2 : 4096;
+	uint8_t *p = realloc(b->p, cap);
+	if (!p) {
+		b->failed = 1;
+		return -1;
+	}
+	b->p = p;
+	b->cap = cap;
+	return 0;
+}
+
+static void buf_append(struct bytebuf *b, const void *p, size_t n) {
+	if (buf_reserve(b, n) != 0)
+		return;
+	memcpy(b->p + b->len, p, n);
+	b->len += n;
+}
+
+static void put_uleb(struct bytebuf *b, uint64_t v) {
+	if (buf_reserve(b, 10) != 0)
+		return;
+	do {
+		uint8_t byte = v & 0x7F;
+		v >>= 7;
+		b->p[b->len++] = byte | (v ? 0x80 : 0);
+	} while (v);
+}
+
+static void put_sleb(struct bytebuf *b, int64_t v) {
+	put_uleb(b, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static uint32_t hash_block(const uint8_t *p) {
+	uint32_t h = 0;
+	for (int i = 0; i < BLOCK; i++)
+		h = h * HASH_MUL + p[i];
+	return h;
+}
+
+static inline uint32_t hash_roll(const struct source_index *idx, uint32_t h, uint8_t out, uint8_t in) {
+	return (h - out * idx->pow) * HASH_MUL + in;
+}
+
+static inline uint32_t slot_of(const struct source_index *idx, uint32_t h) {
+	return (h * 0x9E3779B1u) >> (32 - idx->bits);
+}
+
+static int build_index(struct source_index *idx, const struct MarvellFirmware *source) {
+	size_t entries = 0;
+
+	idx->pow = 1;
+	for (int i = 1; i < BLOCK; i++)
+		idx->pow *= HASH_MUL;
+
+	idx->image = source->image;
+	idx->size = source->image_size;
+	for (int i = 0; i < source->header.num_segments; i++)
+		entries += source->seghdrs[i].size / 2;
+	for (idx->bits = 10; idx->bits < 26 && ((size_t) 1 << idx->bits) < 2 * entries; idx->bits++)
+		;
+	idx->slots = calloc((size_t) 1 << idx->bits, sizeof(uint32_t));
+	if (!idx->slots)
+		return -1;
+
+	for (int i = 0; i < source->header.num_segments; i++) {
+		const struct MarvellSegmentHeader *sh = &source->seghdrs[i];
+		const uint8_t *p = source->image + sh->offset;
+		if (sh->size < BLOCK)
+			continue;
+		uint32_t h = hash_block(p);
+		for (uint32_t k = 0;; k++) {
+			if (((sh->vaddr + k) & 1) == 0) {
+				uint32_t *slot = &idx->slots[slot_of(idx, h)];
+				if (*slot == 0)
+					*slot = sh->offset + k + 1;
+			}
+			if (k + BLOCK >= sh->size)
+				break;
+			h = hash_roll(idx, h, p[k], p[k + BLOCK]);
+		}
+	}
+	return 0;
+}
+
+static void emit_literal(struct piece_job *job, size_t from, size_t to) {
+	if (from == to || buf_reserve(&job->ops, 1) != 0)
+		return;
+	job->ops.p[job->ops.len++] = OP_LITERAL;
+	put_uleb(&job->ops, to - from);
+	buf_append(&job->ops, job->target + from, to - from);
+	job->stats.literal += to - from;
+	job->stats.literals++;
+}
+
+static void emit_copy(struct piece_job *job, size_t src, size_t len, size_t *prev_end) {
+	if (buf_reserve(&job->ops, 1) != 0)
+		return;
+	job->ops.p[job->ops.len++] = OP_COPY;
+	put_sleb(&job->ops, (int64_t) src - (int64_t) *prev_end);
+	put_uleb(&job->ops, len);
+	*prev_end = src + len;
+	job->stats.copied += len;
+	job->stats.copies++;
+}
+
+static void diff_piece_task(void *arg) {
+	struct piece_job *job = arg;
+	const struct source_index *idx = job->idx;
+	const uint8_t *src = idx->image, *tgt = job->target;
+	size_t len = job->len, t = 0, lit = 0, prev_end = 0;
+	size_t cont_s = 0, cont_t = 0;        // source position of cont_t, if have_cont
+	int have_cont = 0, have_hash = 0;
+	uint32_t h = 0;
+
+	while (t + BLOCK <= len) {
+		size_t s = 0;
+		int found = 0;
+
+		if (have_cont) {
+			s = cont_s + (t - cont_t);
+			found = s + BLOCK <= idx->size && memcmp(src + s, tgt + t, BLOCK) == 0;
+		}
+		if (!found && ((job->vaddr + t) & 1) == 0) {
+			if (!have_hash) {
+				h = hash_block(tgt + t);
+				have_hash = 1;
+			}
+			uint32_t slot = idx->slots[slot_of(idx, h)];
+			if (slot) {
+				s = slot - 1;
+				found = s + BLOCK <= idx->size && memcmp(src + s, tgt + t, BLOCK) == 0;
+			}
+		}
+
+		if (found) {
+			size_t back = 0, fwd = BLOCK;
+			while (t - back > lit && s - back > 0 && tgt[t - back - 1] == src[s - back - 1])
+				back++;
+			while (t + fwd < len && s + fwd < idx->size && tgt[t + fwd] == src[s + fwd])
+				fwd++;
+			emit_literal(job, lit, t - back);
+			emit_copy(job, s - back, back + fwd, &prev_end);
+			t += fwd;
+			lit = t;
+			cont_s = s + fwd;
+			cont_t = t;
+			have_cont = 1;
+			have_hash = 0;
+			continue;
+		}
+
+		if (have_hash && t + BLOCK < len)
+			h = hash_roll(idx, h, tgt[t], tgt[t + BLOCK]);
+		else
+			have_hash = 0;
+		t++;
+	}
+	emit_literal(job, lit, len);
+}
+
+static uint32_t crc_of(const uint8_t *p, size_t len) {
+	struct crc32_state st;
+	crc32_init(&st);
+	crc32_update(&st, p, len);
+	return crc32_final(&st);
+}
+
+/* Target bytes that no segment covers must be 0xFF, the delta does not store them. */
+static const char* check_target(const struct MarvellFirmware *target, size_t tablelen) {
+	const struct MarvellSegmentHeader *sh = target->seghdrs;
+	int n = target->header.num_segments;
+	size_t pos = tablelen;
+
+	for (int i = 0; i < n; i++) {
+		if (sh[i].offset < tablelen)
+			return "target segment overlaps the segment table";
+		for (int j = 0; j < i; j++) {
+			if (sh[i].offset < sh[j].offset + sh[j].size && sh[j].offset < sh[i].offset + sh[i].size)
+				return "target segments overlap";
+		}
+		if (crc_of(target->segments[i], sh[i].size) != sh[i].checksum)
+			return "target segment has a bad checksum";
+	}
+	// walk the gaps in file order
+	for (;;) {
+		size_t next = target->image_size;
+		int seg = -1;
+		for (int i = 0; i < n; i++) {
+			if (sh[i].size > 0 && sh[i].offset >= pos && sh[i].offset < next) {
+				next = sh[i].offset;
+				seg = i;
+			}
+		}
+		for (size_t k = pos; k < next; k++) {
+			if (target->image[k] != 0xFF)
+				return "target has data outside its segments";
+		}
+		if (seg < 0)
+			return NULL;
+		pos = sh[seg].offset + sh[seg].size;
+	}
+}
+
+uint8_t* mrvl_delta_create(const struct MarvellFirmware *source, const struct MarvellFirmware *target, struct threadpool *pool, size_t *size, struct MarvellDeltaStats *stats, const char **errmsg) {
+	size_t tablelen = sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * target->header.num_segments;
+
+	if (!source->image || !target->image) {
+		*errmsg = "images must be views of whole files";
+		return NULL;
+	}
+	if (source->image_size > UINT32_MAX || target->image_size > UINT32_MAX) {
+		*errmsg = "image too large";
+		return NULL;
+	}
+	if ((*errmsg = check_target(target, tablelen)) != NULL)
+		return NULL;
+
+	struct source_index idx;
+	if (build_index(&idx, source) != 0) {
+		*errmsg = "out of memory";
+		return NULL;
+	}
+
+	size_t njobs = 0;
+	for (int i = 0; i < target->header.num_segments; i++)
+		njobs += (target->seghdrs[i].size + MRVL_DELTA_PIECE_SIZE - 1) / MRVL_DELTA_PIECE_SIZE;
+	struct piece_job *jobs = calloc(njobs ? njobs : 1, sizeof(struct piece_job));
+	if (!jobs) {
+		free(idx.slots);
+		*errmsg = "out of memory";
+		return NULL;
+	}
+
+	struct taskgroup group = TASKGROUP_INIT;
+	size_t j = 0;
+	for (int i = 0; i < target->header.num_segments; i++) {
+		const struct MarvellSegmentHeader *sh = &target->seghdrs[i];
+		for (uint32_t off = 0; off < sh->size; off += MRVL_DELTA_PIECE_SIZE) {
+			struct piece_job *job = &jobs[j++];
+			job->idx = &idx;
+			job->target = target->segments[i] + off;
+			job->len = sh->size - off < MRVL_DELTA_PIECE_SIZE ? sh->size - off : MRVL_DELTA_PIECE_SIZE;
+			job->vaddr = sh->vaddr + off;
+			if (pool)
+				threadpool_submit(pool, &group, diff_piece_task, job);
+			else
+				diff_piece_task(job);
+		}
+	}
+	if (pool)
+		threadpool_wait(pool, &group);
+
+	struct MarvellDeltaHeader hdr;
+	memcpy(hdr.magic, "MRVD", 4);
+	hdr.version = MRVL_DELTA_VERSION;
+	hdr.source_size = source->image_size;
+	hdr.source_crc = crc_of(source->image, source->image_size);
+	hdr.target_size = target->image_size;
+	hdr.target_crc = crc_of(target->image, target->image_size);
+	hdr.table_size = tablelen;
+
+	struct bytebuf out = { NULL, 0, 0, 0 };
+	buf_append(&out, &hdr, sizeof(hdr));
+	buf_append(&out, target->image, tablelen);
+	memset(stats, 0, sizeof(*stats));
+	for (j = 0; j < njobs; j++) {
+		struct MarvellDeltaPiece piece;
+		piece.ops_size = jobs[j].ops.len;
+		piece.target_size = jobs[j].len;
+		buf_append(&out, &piece, sizeof(piece));
+		buf_append(&out, jobs[j].ops.p, jobs[j].ops.len);
+		out.failed |= jobs[j].ops.failed;
+		stats->copied += jobs[j].stats.copied;
+		stats->literal += jobs[j].stats.literal;
+		stats->copies += jobs[j].stats.copies;
+		stats->literals += jobs[j].stats.literals;
+		free(jobs[j].ops.p);
+	}
+	free(jobs);
+	free(idx.slots);
+	if (out.failed) {
+		free(out.p);
+		*errmsg = "out of memory";
+		return NULL;
+	}
+	*size = out.len;
+	return out.p;
+}
+
+
+/*
+ * Apply. The delta is read with stdio; ops_left counts down the bytes of
+ * the current piece, so a damaged delta cannot run into the next piece.
+ */
+struct reader {
+	FILE *f;
+	uint64_t ops_left;
+};
+
+static int get_byte(struct reader *r, uint8_t *b) {
+	int c;
+	if (r->ops_left == 0 || (c = getc(r->f)) == EOF)
+		return -1;
+	r->ops_left--;
+	*b = c;
+	return 0;
+}
+
+static int get_uleb(struct reader *r, uint64_t *v) {
+	uint8_t b;
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (get_byte(r, &b) != 0)
+			return -1;
+		*v |= (uint64_t) (b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if (n <= 0)
+			return -1;
+		buf = (const uint8_t*) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/* Rebuild one segment at offset; returns its CRC in *crc. */
+static const char* apply_segment(const struct MarvellFirmware *source, struct reader *r, uint8_t *buf, int fd, uint32_t offset, uint32_t size, uint32_t *crc) {
+	struct crc32_state st;
+	uint32_t done = 0;
+
+	crc32_init(&st);
+	while (done < size) {
+		struct MarvellDeltaPiece piece;
+		if (fread(&piece, sizeof(piece), 1, r->f) != 1)
+			return "truncated delta";
+		if (piece.target_size > size - done)
+			return "delta piece exceeds its segment";
+		r->ops_left = piece.ops_size;
+
+		uint64_t prev_end = 0, produced = 0;
+		while (produced < piece.target_size) {
+			uint8_t op;
+			uint64_t len, zz;
+			if (get_byte(r, &op) != 0 || get_uleb(r, op == OP_COPY ? &zz : &len) != 0)
+				return "truncated delta";
+			if (op == OP_COPY) {
+				uint64_t src = prev_end + (int64_t) ((zz >> 1) ^ -(zz & 1));
+				if (get_uleb(r, &len) != 0)
+					return "truncated delta";
+				if (len > piece.target_size - produced || src > source->image_size || len > source->image_size - src)
+					return "delta copies outside the source image";
+				crc32_update(&st, source->image + src, len);
+				if (pwrite_all(fd, source->image + src, len, (off_t) offset + done + produced) != 0)
+					return "cannot write target image";
+				prev_end = src + len;
+			} else if (op == OP_LITERAL) {
+				if (len > piece.target_size - produced || len > r->ops_left)
+					return "delta literal exceeds its piece";
+				for (uint64_t left = len; left > 0;) {
+					size_t n = left < APPLY_BUFFER_SIZE ? left : APPLY_BUFFER_SIZE;
+					if (fread(buf, n, 1, r->f) != 1)
+						return "truncated delta";
+					r->ops_left -= n;
+					crc32_update(&st, buf, n);
+					if (pwrite_all(fd, buf, n, (off_t) offset + done + produced + (len - left)) != 0)
+						return "cannot write target image";
+					left -= n;
+				}
+			} else {
+				return "unknown delta operation";
+			}
+			produced += len;
+		}
+		if (r->ops_left != 0)
+			return "delta piece has trailing data";
+		done += piece.target_size;
+	}
+	*crc = crc32_final(&st);
+	return NULL;
+}
+
+const char* mrvl_delta_apply(const struct MarvellFirmware *source, FILE *delta, int fd) {
+	struct MarvellDeltaHeader hdr;
+	uint8_t table[sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * MRVL_MAX_SEGMENTS];
+	uint32_t crcs[MRVL_MAX_SEGMENTS];
+	const char *msg = NULL;
+
+	if (!source->image)
+		return "source must be a view of a whole file";
+	if (fread(&hdr, sizeof(hdr), 1, delta) != 1 || memcmp(hdr.magic, "MRVD", 4) != 0)
+		return "not a firmware delta";
+	if (hdr.version != MRVL_DELTA_VERSION)
+		return "unsupported delta version";
+	if (hdr.source_size != source->image_size || hdr.source_crc != crc_of(source->image, source->image_size))
+		return "delta was made for a different source image";
+	if (hdr.table_size < sizeof(struct MarvellHeader) || hdr.table_size > sizeof(table) ||
+			fread(table, hdr.table_size, 1, delta) != 1)
+		return "bad target segment table";
+
+	// the table describes the target; check it like a firmware file
+	const struct MarvellHeader *th = (const struct MarvellHeader*) table;
+	const struct MarvellSegmentHeader *sh = (const struct MarvellSegmentHeader*) (table + sizeof(struct MarvellHeader));
+	if (th->num_segments > MRVL_MAX_SEGMENTS ||
+			hdr.table_size != sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * th->num_segments)
+		return "bad target segment table";
+	for (int i = 0; i < th->num_segments; i++) {
+		if (sh[i].offset < hdr.table_size || (uint64_t) sh[i].offset + sh[i].size > hdr.target_size)
+			return "bad target segment table";
+	}
+
+	uint8_t *buf = malloc(APPLY_BUFFER_SIZE);
+	if (!buf)
+		return "out of memory";
+	struct reader r = { delta, 0 };
+
+	if (pwrite_all(fd, table, hdr.table_size, 0) != 0)
+		msg = "cannot write target image";
+	for (int i = 0; !msg && i < th->num_segments; i++) {
+		msg = apply_segment(source, &r, buf, fd, sh[i].offset, sh[i].size, &crcs[i]);
+		if (!msg && crcs[i] != sh[i].checksum)
+			msg = "target segment checksum mismatch";
+	}
+	if (!msg && getc(delta) != EOF)
+		msg = "delta has trailing data";
+
+	// fill the gaps with 0xFF, and combine the CRC of the whole image in file order
+	uint32_t crc = crc_of(table, hdr.table_size);
+	uint64_t pos = hdr.table_size;
+	memset(buf, 0xFF, APPLY_BUFFER_SIZE);
+	while (!msg) {
+		uint64_t next = hdr.target_size;
+		int seg = -1;
+		for (int i = 0; i < th->num_segments; i++) {
+			if (sh[i].size > 0 && sh[i].offset >= pos && sh[i].offset < next) {
+				next = sh[i].offset;
+				seg = i;
+			}
+		}
+		for (; pos < next && !msg; ) {
+			size_t n = next - pos < APPLY_BUFFER_SIZE ? next - pos : APPLY_BUFFER_SIZE;
+			crc = crc32_combine(crc, crc_of(buf, n), n);
+			if (pwrite_all(fd, buf, n, pos) != 0)
+				msg = "cannot write target image";
+			pos += n;
+		}
+		if (seg < 0)
+			break;
+		crc = crc32_combine(crc, crcs[seg], sh[seg].size);
+		pos = (uint64_t) sh[seg].offset + sh[seg].size;
+	}
+	if (!msg && crc != hdr.target_crc)
+		msg = "target image checksum mismatch";
+
+	free(buf);
+	return msg;
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "marvel-88mw30x-firmware.h"
+#include "threadpool.h"
+
+/*
+ * Binary deltas between two firmware images, for OTA updates.
+ *
+ * A delta rebuilds the target image from the source image. It starts with
+ * a MarvellDeltaHeader and the target's header and segment table, copied
+ * verbatim. Then, for each target segment in order, the segment data is
+ * described in pieces of up to MRVL_DELTA_PIECE_SIZE bytes, so that
+ * pieces can be diffed in parallel. A piece is a MarvellDeltaPiece
+ * followed by ops_size bytes of operations:
+ *
+ *   0x00 len data[len]     literal bytes
+ *   0x01 off len           copy len bytes from the source image
+ *
+ * len is an unsigned LEB128 number, off a signed (zigzag) LEB128 distance
+ * from the end of the previous copy in the same piece, or from offset 0.
+ * Target bytes outside the table and the segments must be 0xFF.
+ */
+#define MRVL_DELTA_VERSION 1
+#define MRVL_DELTA_PIECE_SIZE (1024 * 1024)
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+MarvellDeltaHeader {
+	char magic[4];                        // "MRVD"
+	uint32_t version;
+	uint32_t source_size;
+	uint32_t source_crc;                  // CRC-32 of the whole source image
+	uint32_t target_size;
+	uint32_t target_crc;                  // CRC-32 of the whole target image
+	uint32_t table_size;                  // target header and segment headers
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+MarvellDeltaPiece {
+	uint32_t ops_size;
+	uint32_t target_size;                 // bytes this piece produces
+};
+
+struct MarvellDeltaStats {
+	uint64_t copied;                      // target bytes taken from the source
+	uint64_t literal;                     // target bytes stored in the delta
+	uint64_t copies;
+	uint64_t literals;
+};
+
+/*
+ * Both images must be views of whole files (mapped, buffered or viewed).
+ * Returns a malloc'ed delta and its size, or NULL and a message in *errmsg.
+ * pool may be NULL.
+ */
+extern uint8_t* mrvl_delta_create(const struct MarvellFirmware *source, const struct MarvellFirmware *target, struct threadpool *pool, size_t *size, struct MarvellDeltaStats *stats, const char **errmsg);
+
+/*
+ * Write the target image to fd, reading the delta sequentially; memory use
+ * does not depend on the image size. Segment and image CRCs are verified.
+ * Returns NULL on success, or an error message.
+ */
+extern const char* mrvl_delta_apply(const struct MarvellFirmware *source, FILE *delta, int fd);
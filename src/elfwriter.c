@@ -0,0 +1,181 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 500
+
+#include "elfwriter.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+/* Source of padding bytes; no alignment is larger than this. */
+static const uint8_t zeros[256];
+
+
+void elfw_init(struct elfw *w, uint16_t type, uint16_t machine, uint32_t flags) {
+	memset(w, 0, sizeof(*w));
+	w->type = type;
+	w->machine = machine;
+	w->flags = flags;
+	w->num_sections = 1;                  // SHN_UNDEF
+}
+
+int elfw_add_section(struct elfw *w, const struct elfw_section *s) {
+	if (w->num_sections == ELFW_MAX_SECTIONS || s->align > sizeof(zeros))
+		return -1;
+	w->sections[w->num_sections] = *s;
+	return w->num_sections++;
+}
+
+static size_t align_up(size_t off, size_t align) {
+	if (align <= 1)
+		return off;
+	return (off + align - 1) / align * align;
+}
+
+/* writev() that copes with short writes and more than IOV_MAX vectors. */
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fill in the headers and the vectors for the whole file, in file order.
+ * ehdr and shdrs must stay in place while iov is used.
+ */
+static int layout(struct elfw *w, struct elf32_ehdr_le *ehdr, struct elf32_shdr_le *shdrs, struct iovec *iov, int *iovcntp) {
+	int iovcnt = 0;
+	size_t off = sizeof(*ehdr);
+
+	memset(ehdr, 0, sizeof(*ehdr));
+	memset(shdrs, 0, sizeof(struct elf32_shdr_le) * ELFW_MAX_SECTIONS);
+	iov[iovcnt].iov_base = ehdr;
+	iov[iovcnt++].iov_len = sizeof(*ehdr);
+
+	for (int i = 1; i < w->num_sections; i++) {
+		struct elfw_section *s = &w->sections[i];
+		size_t start = align_up(off, s->align);
+		if (start > off) {
+			iov[iovcnt].iov_base = (void*) zeros;
+			iov[iovcnt++].iov_len = start - off;
+		}
+		if (s->size > 0) {
+			iov[iovcnt].iov_base = (void*) s->data;
+			iov[iovcnt++].iov_len = s->size;
+		}
+		off = start + s->size;
+
+		shdrs[i].sh_name = s->name;
+		shdrs[i].sh_type = s->type;
+		shdrs[i].sh_flags = s->flags;
+		shdrs[i].sh_addr = s->addr;
+		shdrs[i].sh_offset = start;
+		shdrs[i].sh_size = s->size;
+		shdrs[i].sh_link = s->link;
+		shdrs[i].sh_info = s->info;
+		shdrs[i].sh_addralign = s->align;
+		shdrs[i].sh_entsize = s->entsize;
+	}
+
+	size_t shoff = align_up(off, 4);
+	if (shoff > off) {
+		iov[iovcnt].iov_base = (void*) zeros;
+		iov[iovcnt++].iov_len = shoff - off;
+	}
+	iov[iovcnt].iov_base = shdrs;
+	iov[iovcnt++].iov_len = sizeof(struct elf32_shdr_le) * w->num_sections;
+	if (shoff > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_type = w->type;
+	ehdr->e_machine = w->machine;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_entry = w->entry;
+	ehdr->e_shoff = shoff;
+	ehdr->e_flags = w->flags;
+	ehdr->e_ehsize = sizeof(struct elf32_ehdr_le);
+	ehdr->e_shentsize = sizeof(struct elf32_shdr_le);
+	ehdr->e_shnum = w->num_sections;
+	ehdr->e_shstrndx = w->shstrndx;
+	*iovcntp = iovcnt;
+	return 0;
+}
+
+int elfw_write(struct elfw *w, int fd) {
+	struct elf32_ehdr_le ehdr;
+	struct elf32_shdr_le shdrs[ELFW_MAX_SECTIONS];
+	struct iovec iov[2 * ELFW_MAX_SECTIONS + 3];
+	int iovcnt;
+	MRVL_STATS_START(t);
+
+	if (layout(w, &ehdr, shdrs, iov, &iovcnt) != 0)
+		return -1;
+	if (writev_all(fd, iov, iovcnt) != 0)
+		return -1;
+	MRVL_STATS_STOP(t, MRVL_PHASE_ELF_WRITE, ehdr.e_shoff + sizeof(struct elf32_shdr_le) * ehdr.e_shnum);
+	return 0;
+}
+
+int elfw_write_buffer(struct elfw *w, uint8_t **buf, size_t *size) {
+	struct elf32_ehdr_le ehdr;
+	struct elf32_shdr_le shdrs[ELFW_MAX_SECTIONS];
+	struct iovec iov[2 * ELFW_MAX_SECTIONS + 3];
+	int iovcnt;
+	size_t total = 0;
+	MRVL_STATS_START(t);
+
+	if (layout(w, &ehdr, shdrs, iov, &iovcnt) != 0)
+		return -1;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	uint8_t *p = malloc(total);
+	if (!p)
+		return -1;
+	MRVL_STATS_ALLOC(total);
+	*buf = p;
+	*size = total;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_ELF_WRITE, total);
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <elf.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* On-disk ELF32 structures, little-endian regardless of the host. */
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+elf32_ehdr_le {
+	uint8_t  e_ident[EI_NIDENT];
+	uint16_t e_type;
+	uint16_t e_machine;
+	uint32_t e_version;
+	uint32_t e_entry;
+	uint32_t e_phoff;
+	uint32_t e_shoff;
+	uint32_t e_flags;
+	uint16_t e_ehsize;
+	uint16_t e_phentsize;
+	uint16_t e_phnum;
+	uint16_t e_shentsize;
+	uint16_t e_shnum;
+	uint16_t e_shstrndx;
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+elf32_shdr_le {
+	uint32_t sh_name;
+	uint32_t sh_type;
+	uint32_t sh_flags;
+	uint32_t sh_addr;
+	uint32_t sh_offset;
+	uint32_t sh_size;
+	uint32_t sh_link;
+	uint32_t sh_info;
+	uint32_t sh_addralign;
+	uint32_t sh_entsize;
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+elf32_phdr_le {
+	uint32_t p_type;
+	uint32_t p_offset;
+	uint32_t p_vaddr;
+	uint32_t p_paddr;
+	uint32_t p_filesz;
+	uint32_t p_memsz;
+	uint32_t p_flags;
+	uint32_t p_align;
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+elf32_rel_le {
+	uint32_t r_offset;
+	uint32_t r_info;
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+elf32_sym_le {
+	uint32_t st_name;
+	uint32_t st_value;
+	uint32_t st_size;
+	uint8_t  st_info;
+	uint8_t  st_other;
+	uint16_t st_shndx;
+};
+
+/*
+ * Minimal writer for little-endian ELF32 files with sections only.
+ *
+ * Section data is referenced, not copied: the file is laid out once and
+ * written with a single writev() straight from the callers' buffers.
+ * The layout matches what libelf produces for ELF_C_WRITE: sections in
+ * order after the ELF header, each aligned to sh_addralign, followed by
+ * the section header table.
+ */
+
+#define ELFW_MAX_SECTIONS 64
+
+struct elfw_section {
+	uint32_t name;                        // offset into the section name table
+	uint32_t type;
+	uint32_t flags;
+	uint32_t addr;
+	uint32_t link;
+	uint32_t info;
+	uint32_t align;
+	uint32_t entsize;
+	const void *data;
+	size_t size;
+};
+
+struct elfw {
+	uint16_t type;
+	uint16_t machine;
+	uint32_t entry;
+	uint32_t flags;
+	uint16_t shstrndx;
+	int num_sections;                     // including the null section
+	struct elfw_section sections[ELFW_MAX_SECTIONS];
+};
+
+extern void elfw_init(struct elfw *w, uint16_t type, uint16_t machine, uint32_t flags);
+
+/* Returns the index of the new section, or -1 if it cannot be added. */
+extern int elfw_add_section(struct elfw *w, const struct elfw_section *s);
+
+/* Lay out and write the file; returns 0, or -1 with errno set. */
+extern int elfw_write(struct elfw *w, int fd);
+
+/* The same, into a malloc'ed buffer. */
+extern int elfw_write_buffer(struct elfw *w, uint8_t **buf, size_t *size);
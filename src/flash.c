@@ -0,0 +1,134 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "flash.h"
+#include "crc32.h"
+
+#include <string.h>
+
+struct table_copy {
+	uint32_t offset;
+	const struct MarvellPartTable *table;
+	const struct MarvellPartEntry *entries;
+	int crc_ok;
+};
+
+
+const char* mrvl_part_type_name(int type) {
+	static const char *names[] = {
+		"boot2", "mcufw", "wififw", "ftfs", "psm", "user-app", "btfw",
+	};
+	if (type < 0 || type >= sizeof(names) / sizeof(names[0]))
+		return "unknown";
+	return names[type];
+}
+
+/* Standard CRC-32, with preset and final inversion. */
+static uint32_t crc32_std(const void *p, size_t len) {
+	return crc32_get_kernel()->fn(0xffffffff, p, len) ^ 0xffffffff;
+}
+
+/* Returns 0 if there is no usable table at offset. */
+static int read_table(const uint8_t *dump, size_t len, uint32_t offset, struct table_copy *t) {
+	if ((uint64_t) offset + sizeof(struct MarvellPartTable) > len)
+		return 0;
+	const struct MarvellPartTable *pt = (const struct MarvellPartTable*) (dump + offset);
+	if (memcmp(pt->magic, MRVL_PART_TABLE_MAGIC, 4) != 0 || pt->num_entries > MRVL_PART_MAX_ENTRIES)
+		return 0;
+	size_t entries = sizeof(struct MarvellPartEntry) * pt->num_entries;
+	if ((uint64_t) offset + sizeof(*pt) + entries + 4 > len)
+		return 0;
+
+	t->offset = offset;
+	t->table = pt;
+	t->entries = (const struct MarvellPartEntry*) (pt + 1);
+	const uint8_t *c = dump + offset + sizeof(*pt) + entries;
+	uint32_t entries_crc = c[0] | c[1] << 8 | c[2] << 16 | (uint32_t) c[3] << 24;
+	t->crc_ok = crc32_std(pt, offsetof(struct MarvellPartTable, crc)) == pt->crc &&
+		crc32_std(t->entries, entries) == entries_crc;
+	return 1;
+}
+
+/* Size of the MRVL image at the start of a partition, or 0. */
+static uint32_t image_size(const uint8_t *p, size_t len) {
+	if (check_marvel_firmware(p, len))
+		return 0;
+	const struct MarvellHeader *hdr = (const struct MarvellHeader*) p;
+	const struct MarvellSegmentHeader *sh = (const struct MarvellSegmentHeader*) (hdr + 1);
+	uint32_t end = sizeof(*hdr) + sizeof(*sh) * hdr->num_segments;
+	for (int i = 0; i < hdr->num_segments; i++) {
+		if (sh[i].offset + sh[i].size > end)
+			end = sh[i].offset + sh[i].size;
+	}
+	return end;
+}
+
+const char* mrvl_flash_index(const uint8_t *dump, size_t len, struct MarvellFlashIndex *idx) {
+	struct table_copy copies[2], *t = NULL;
+	int n = 0;
+
+	if (read_table(dump, len, MRVL_PART_TABLE_OFFSET0, &copies[n]))
+		n++;
+	if (read_table(dump, len, MRVL_PART_TABLE_OFFSET1, &copies[n]))
+		n++;
+	if (n == 0)
+		return "no partition table at 0x4000 or 0x5000";
+	// a valid copy beats a newer, damaged one
+	t = &copies[0];
+	if (n == 2 && (copies[1].crc_ok > t->crc_ok ||
+			(copies[1].crc_ok == t->crc_ok && copies[1].table->gen_level > t->table->gen_level)))
+		t = &copies[1];
+
+	memset(idx, 0, sizeof(*idx));
+	idx->table_offset = t->offset;
+	idx->gen_level = t->table->gen_level;
+	idx->table_crc_ok = t->crc_ok;
+	idx->count = t->table->num_entries;
+	for (int i = 0; i < idx->count; i++) {
+		const struct MarvellPartEntry *e = &t->entries[i];
+		struct MarvellFlashComponent *c = &idx->components[i];
+		c->offset = e->start;
+		c->size = e->size;
+		c->gen_level = e->gen_level;
+		c->type = e->type;
+		c->device = e->device;
+		memcpy(c->name, e->name, sizeof(e->name));
+		c->in_dump = e->device == 0 && (uint64_t) e->start + e->size <= len;
+		if (c->in_dump)
+			c->image_size = image_size(dump + c->offset, c->size);
+	}
+
+	// of two partitions of a type, the newer one is active
+	for (int i = 0; i < idx->count; i++) {
+		struct MarvellFlashComponent *c = &idx->components[i];
+		c->active = 1;
+		for (int j = 0; j < idx->count; j++) {
+			struct MarvellFlashComponent *o = &idx->components[j];
+			if (j != i && o->type == c->type && o->device == c->device &&
+					(o->gen_level > c->gen_level || (o->gen_level == c->gen_level && j < i)))
+				c->active = 0;
+		}
+	}
+	return NULL;
+}
+
+struct MarvellFirmware* mrvl_flash_firmware(const uint8_t *dump, const struct MarvellFlashComponent *c, const char **errmsg) {
+	if (!c->in_dump || !c->image_size) {
+		*errmsg = "component does not hold a firmware image";
+		return NULL;
+	}
+	return parse_marvel_firmware(dump + c->offset, c->image_size, NULL, errmsg);
+}
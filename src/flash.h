@@ -0,0 +1,105 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+
+/*
+ * Partition table of a whole-flash dump, as laid out by the Marvell SDK.
+ *
+ * boot2 is followed by two copies of the partition table, at 0x4000 and
+ * 0x5000. Each is a MarvellPartTable with the magic "WMPT", followed by
+ * its entries and a CRC-32 of the entries. Both CRCs are the standard
+ * (zlib) CRC-32, unlike the segment checksums. The valid copy with the
+ * higher generation is used.
+ *
+ * Components of the same type come in pairs for updates (e.g. two mcufw
+ * partitions); the one with the higher generation is the active one.
+ */
+#define MRVL_PART_TABLE_OFFSET0 0x4000
+#define MRVL_PART_TABLE_OFFSET1 0x5000
+#define MRVL_PART_TABLE_MAGIC   "WMPT"
+#define MRVL_PART_MAX_ENTRIES   32
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+MarvellPartTable {
+	char magic[4];                        // "WMPT"
+	uint16_t version;                     // 1
+	uint16_t num_entries;
+	uint32_t gen_level;
+	uint32_t crc;                         // of the fields above
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+MarvellPartEntry {
+	uint8_t type;                         // enum MarvellPartType
+	uint8_t device;                       // 0 is the internal flash
+	char name[8];                         // not necessarily terminated
+	uint8_t reserved[2];
+	uint32_t start;
+	uint32_t size;
+	uint32_t gen_level;
+};
+
+enum MarvellPartType {
+	MRVL_PART_BOOT2 = 0,
+	MRVL_PART_MCUFW = 1,                  // the app firmware, an MRVL image
+	MRVL_PART_WIFIFW = 2,
+	MRVL_PART_FTFS = 3,
+	MRVL_PART_PSM = 4,
+	MRVL_PART_USER_APP = 5,
+	MRVL_PART_BTFW = 6,
+};
+
+/* One component of the index, 32 bytes. */
+struct MarvellFlashComponent {
+	uint32_t offset;                      // in the dump
+	uint32_t size;                        // of the partition
+	uint32_t image_size;                  // of the MRVL image, 0 if there is none
+	uint32_t gen_level;
+	char name[9];
+	uint8_t type;
+	uint8_t device;
+	uint8_t active;
+	uint8_t in_dump;                      // partition lies within the dump
+	uint8_t reserved[3];
+};
+
+struct MarvellFlashIndex {
+	uint32_t table_offset;
+	uint32_t gen_level;
+	int table_crc_ok;                     // header and entry CRCs match
+	int count;
+	struct MarvellFlashComponent components[MRVL_PART_MAX_ENTRIES];
+};
+
+/*
+ * Build the index of a dump. Only the partition tables and the first
+ * bytes of each component are read, so with a mapped dump the cost does
+ * not depend on its size. Returns NULL or an error message.
+ */
+extern const char* mrvl_flash_index(const uint8_t *dump, size_t len, struct MarvellFlashIndex *idx);
+
+extern const char* mrvl_part_type_name(int type);
+
+/*
+ * Zero-copy view of the MRVL image of a component, see
+ * parse_marvel_firmware(). NULL if it holds none.
+ */
+extern struct MarvellFirmware* mrvl_flash_firmware(const uint8_t *dump, const struct MarvellFlashComponent *c, const char **errmsg);
@@ -0,0 +1,143 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 600
+
+#include "carve.h"
+#include "threadpool.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static void extract(const uint8_t *dump, const struct MarvellCarvedImage *img, const char *outdir) {
+	char path[4096];
+	MRVL_STATS_START(t);
+	snprintf(path, sizeof(path), "%s/fw-%08llx.bin", outdir, (unsigned long long) img->offset);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", path);
+
+	const uint8_t *p = dump + img->offset;
+	uint64_t left = img->size;
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0)
+			err(EXIT_FAILURE, "write %s failed", path);
+		p += n;
+		left -= n;
+	}
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "write %s failed", path);
+	MRVL_STATS_STOP(t, MRVL_PHASE_FW_WRITE, img->size);
+}
+
+static long parse_count(const char *option, const char *arg, long min, long max) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be a number in %ld..%ld: %s", option, min, max, arg);
+	return n;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-j threads] [-a] [-n] [-x outdir] flash-dump\n"
+		"  -a  also report images with CRC mismatches\n"
+		"  -n  skip the CRC check\n"
+		"  -x  extract every image to outdir/fw-<offset>.bin\n"
+		"  --stats[=perf]  print timings as JSON to stderr", prog);
+}
+
+int main(int argc, char** argv) {
+	const char *outdir = NULL;
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int threads = 0, flags = MRVL_CARVE_VERIFY, opt;
+
+	while ((opt = getopt_long(argc, argv, "j:anx:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = parse_count("-j", optarg, 0, 4096);
+				break;
+			case 'a':
+				flags |= MRVL_CARVE_ALL;
+				break;
+			case 'n':
+				flags &= ~MRVL_CARVE_VERIFY;
+				break;
+			case 'x':
+				outdir = optarg;
+				break;
+			case 's':
+				if (mrvl_stats_enable("fwcarve", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	const char *path = argv[optind];
+	MRVL_STATS_START(t);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", path);
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		err(EXIT_FAILURE, "stat %s failed", path);
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		errx(EXIT_FAILURE, "%s: not a regular, non-empty file", path);
+	const uint8_t *dump = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (dump == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap %s failed", path);
+	posix_madvise((void*) dump, st.st_size, POSIX_MADV_SEQUENTIAL);
+	close(fd);
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, st.st_size);
+
+	struct threadpool *pool = threadpool_new(threads);
+	if (!pool)
+		errx(EXIT_FAILURE, "cannot create thread pool");
+	size_t count;
+	struct MarvellCarvedImage *images = carve_marvel_firmware(dump, st.st_size, pool, flags, &count);
+	if (!images)
+		errx(EXIT_FAILURE, "out of memory");
+	threadpool_free(pool);
+
+	for (size_t i = 0; i < count; i++) {
+		const struct MarvellCarvedImage *img = &images[i];
+		printf("offset 0x%08llx  size %10llu  segments %u  crc %s\n",
+			(unsigned long long) img->offset, (unsigned long long) img->size, img->num_segments,
+			!(flags & MRVL_CARVE_VERIFY) ? "unchecked" : img->bad_segments ? "BAD" : "ok");
+		if (outdir)
+			extract(dump, img, outdir);
+	}
+
+	free(images);
+	munmap((void*) dump, st.st_size);
+	return count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,250 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "libmrvlfw.h"
+#include "daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+struct command {
+	const char *name;
+	enum mrvld_op op;
+	int nargs;                            // files: input, then output
+};
+
+static const struct command commands[] = {
+	{ "ping",     MRVLD_OP_PING,     0 },
+	{ "info",     MRVLD_OP_INFO,     1 },
+	{ "verify",   MRVLD_OP_VERIFY,   1 },
+	{ "to-elf",   MRVLD_OP_TO_ELF,   2 },
+	{ "from-elf", MRVLD_OP_FROM_ELF, 2 },
+	{ NULL, 0, 0 }
+};
+
+/* Load test: each thread has its own connection and output file. */
+struct load {
+	const char *socket;
+	const struct command *cmd;
+	char **args;
+	long requests;
+	atomic_long next;
+	atomic_long errors;
+	uint64_t *latency;                    // ns, per request
+};
+
+struct load_thread {
+	struct load *load;
+	int index;
+};
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Open the files of a request; returns their number, or -1. */
+static int open_files(const struct command *cmd, char **args, const char *output, int *fds) {
+	if (cmd->nargs > 0 && (fds[0] = open(args[0], O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if (cmd->nargs > 1 && (fds[1] = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+		close(fds[0]);
+		return -1;
+	}
+	return cmd->nargs;
+}
+
+static int call(int sock, const struct command *cmd, char **args, const char *output, struct mrvld_response *resp) {
+	int fds[MRVLD_MAX_FDS];
+	int nfds = open_files(cmd, args, output, fds);
+	if (nfds < 0)
+		return -1;
+	int res = mrvld_call(sock, cmd->op, (uint32_t) time(NULL), fds, nfds, resp);
+	for (int i = 0; i < nfds; i++)
+		close(fds[i]);
+	return res;
+}
+
+static void* load_thread(void *arg) {
+	struct load_thread *t = arg;
+	struct load *load = t->load;
+	struct mrvld_response resp;
+	char output[4096];
+	long i;
+
+	if (load->cmd->nargs > 1)
+		snprintf(output, sizeof(output), "%s.%d", load->args[1], t->index);
+	int sock = mrvld_connect(load->socket);
+	if (sock < 0)
+		err(EXIT_FAILURE, "cannot connect to %s", load->socket);
+	while ((i = atomic_fetch_add(&load->next, 1)) < load->requests) {
+		uint64_t start = now_ns();
+		if (call(sock, load->cmd, load->args, output, &resp) != 0 || resp.status != MRVL_OK)
+			atomic_fetch_add(&load->errors, 1);
+		load->latency[i] = now_ns() - start;
+	}
+	close(sock);
+	if (load->cmd->nargs > 1)
+		unlink(output);
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Latency is per request as the caller sees it: opening the files, the
+ * round trip and closing them. The JSON report goes to stdout.
+ */
+static int run_load(struct load *load, int connections) {
+	pthread_t threads[connections];
+	struct load_thread args[connections];
+	load->latency = calloc(load->requests, sizeof(uint64_t));
+	if (!load->latency)
+		errx(EXIT_FAILURE, "out of memory");
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < connections; i++) {
+		args[i] = (struct load_thread) { load, i };
+		if (pthread_create(&threads[i], NULL, load_thread, &args[i]) != 0)
+			errx(EXIT_FAILURE, "cannot start thread");
+	}
+	for (int i = 0; i < connections; i++)
+		pthread_join(threads[i], NULL);
+	double wall = (now_ns() - start) / 1e9;
+
+	uint64_t *l = load->latency, sum = 0;
+	long n = load->requests;
+	qsort(l, n, sizeof(uint64_t), compare_u64);
+	for (long i = 0; i < n; i++)
+		sum += l[i];
+	printf("{\"op\":\"%s\",\"requests\":%ld,\"connections\":%d,\"errors\":%ld,"
+		"\"wall_s\":%.3f,\"requests_per_s\":%.0f,\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,"
+		"\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+		load->cmd->name, n, connections, atomic_load(&load->errors), wall, n / wall,
+		l[0] / 1e3, sum / 1e3 / n, l[n / 2] / 1e3, l[n * 90 / 100] / 1e3, l[n * 99 / 100] / 1e3,
+		l[n * 999 / 1000] / 1e3, l[n - 1] / 1e3);
+	free(load->latency);
+	return atomic_load(&load->errors) ? EXIT_FAILURE : 0;
+}
+
+static void print_response(const struct command *cmd, const struct mrvld_response *resp) {
+	if (resp->status != MRVL_OK && resp->status != MRVL_ERR_CHECKSUM)
+		return;
+	if (cmd->op == MRVLD_OP_PING) {
+		printf("pong\n");
+		return;
+	}
+	if (cmd->op == MRVLD_OP_INFO || cmd->op == MRVLD_OP_VERIFY) {
+		printf("ctime %u, %u segments, ELF version %08x\n",
+			resp->header.ctime, resp->header.num_segments, resp->header.elf_version);
+		for (uint32_t i = 0; i < resp->header.num_segments && i < MRVL_MAX_SEGMENTS; i++) {
+			const struct MarvellSegmentHeader *sh = &resp->seghdrs[i];
+			printf("segment %u: offset %8x size %8x vaddr %8x checksum %08x actual %08x %s\n",
+				i, sh->offset, sh->size, sh->vaddr, sh->checksum, resp->checksums[i],
+				resp->checksums[i] == sh->checksum ? "ok" : "BAD");
+		}
+	}
+	if (cmd->nargs > 1)
+		printf("wrote %llu bytes\n", (unsigned long long) resp->output_size);
+}
+
+static long parse_count(const char *option, const char *arg, long min, long max) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be a number in %ld..%ld: %s", option, min, max, arg);
+	return n;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-s socket] [-n requests [-c connections]] command [files]\n"
+		"  ping\n"
+		"  info|verify firmware-file\n"
+		"  to-elf firmware-file output-elf\n"
+		"  from-elf input-axf output-firmware\n"
+		"  -n  load test: send the request n times and print latencies as JSON;\n"
+		"      outputs go to output.0, output.1, ... and are removed\n"
+		"  -c  concurrent connections, default 1", prog);
+}
+
+int main(int argc, char** argv) {
+	char pathbuf[256];
+	const char *path = NULL;
+	long requests = 0;
+	int connections = 1, opt;
+
+	while ((opt = getopt(argc, argv, "+s:n:c:")) != -1) {
+		switch (opt) {
+			case 's':
+				path = optarg;
+				break;
+			case 'n':
+				requests = parse_count("-n", optarg, 0, LONG_MAX);
+				break;
+			case 'c':
+				connections = parse_count("-c", optarg, 1, 4096);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+	const struct command *cmd = commands;
+	while (cmd->name && strcmp(cmd->name, argv[optind]) != 0)
+		cmd++;
+	if (!cmd->name || argc - optind - 1 != cmd->nargs)
+		usage(argv[0]);
+	char **args = argv + optind + 1;
+	if (!path)
+		path = mrvld_socket_path(pathbuf, sizeof(pathbuf));
+
+	if (requests > 0) {
+		struct load load = { .socket = path, .cmd = cmd, .args = args, .requests = requests };
+		return run_load(&load, connections);
+	}
+
+	struct mrvld_response resp;
+	int sock = mrvld_connect(path);
+	if (sock < 0)
+		err(EXIT_FAILURE, "cannot connect to %s", path);
+	if (call(sock, cmd, args, cmd->nargs > 1 ? args[1] : NULL, &resp) != 0)
+		err(EXIT_FAILURE, "%s", cmd->name);
+	close(sock);
+	print_response(cmd, &resp);
+	if (resp.status != MRVL_OK) {
+		if (resp.status == MRVL_ERR_IO)
+			errx(EXIT_FAILURE, "%s: %s", mrvl_strerror(resp.status), strerror(resp.error));
+		errx(EXIT_FAILURE, "%s", mrvl_strerror(resp.status));
+	}
+	return 0;
+}
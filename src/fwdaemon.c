@@ -0,0 +1,363 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "libmrvlfw.h"
+#include "daemon.h"
+#include "decompress.h"
+#include "threadpool.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* Requests queued or running at once; reading more waits for one to finish. */
+#define MAX_IN_FLIGHT 256
+#define MAX_CONNECTIONS 1024
+/* Requests read from one connection before the others get a turn. */
+#define MAX_BURST 16
+
+struct connection {
+	int fd;
+	atomic_int refs;                      // the poll loop's, and one per request
+};
+
+struct request {
+	struct connection *conn;
+	struct mrvld_request req;
+	int fds[MRVLD_MAX_FDS];
+	int nfds;
+	uint64_t started;                     // for MRVL_PHASE_JOB
+};
+
+/* Per worker thread, kept warm from one request to the next. */
+struct worker {
+	struct MarvellArena arena;
+	uint8_t *buf;                         // inputs that cannot be mapped
+	size_t cap;
+};
+
+static struct threadpool *pool;
+static struct worker *workers;          // [0] for the main thread
+static struct taskgroup requests = TASKGROUP_INIT;
+static sem_t in_flight;
+static volatile sig_atomic_t stop;
+
+
+static void release(struct connection *conn) {
+	if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+		close(conn->fd);
+		free(conn);
+	}
+}
+
+/* Map a regular file, or read anything else into the worker's buffer. */
+static int map_input(struct worker *w, int fd, const uint8_t **buf, size_t *len, int *mapped) {
+	struct stat st;
+	MRVL_STATS_START(t);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			*buf = p;
+			*len = st.st_size;
+			*mapped = 1;
+			MRVL_STATS_STOP(t, MRVL_PHASE_READ, *len);
+			return MRVL_OK;
+		}
+	}
+
+	*mapped = 0;
+	*len = 0;
+	for (;;) {
+		if (*len == w->cap) {
+			size_t cap = w->cap ? w->cap * 2 : 1024 * 1024;
+			uint8_t *p = realloc(w->buf, cap);
+			if (!p)
+				return MRVL_ERR_NOMEM;
+			w->buf = p;
+			w->cap = cap;
+			MRVL_STATS_ALLOC(cap);
+		}
+		ssize_t n = read(fd, w->buf + *len, w->cap - *len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return MRVL_ERR_IO;
+		if (n == 0)
+			break;
+		*len += n;
+	}
+	*buf = w->buf;
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, *len);
+	return MRVL_OK;
+}
+
+static void describe(const struct MarvellFirmware *fw, struct mrvld_response *resp) {
+	resp->header = fw->header;
+	memcpy(resp->seghdrs, fw->seghdrs, sizeof(struct MarvellSegmentHeader) * fw->header.num_segments);
+}
+
+static uint64_t output_size(int fd) {
+	struct stat st;
+	return fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+static int io_error(int error) {
+	errno = error;
+	return MRVL_ERR_IO;
+}
+
+static int handle(struct worker *w, struct request *r, struct mrvld_response *resp) {
+	static const int needs[] = { 0, 1, 1, 2, 2 };
+	const struct mrvld_request *req = &r->req;
+	const uint8_t *buf;
+	const char *msg;
+	size_t len;
+	int mapped, status;
+
+	if (req->magic != MRVLD_MAGIC || req->version != MRVLD_VERSION)
+		return io_error(EPROTO);
+	if (req->op > MRVLD_OP_FROM_ELF)
+		return io_error(EOPNOTSUPP);
+	if (r->nfds != needs[req->op])
+		return io_error(EBADF);
+	if (req->op == MRVLD_OP_PING)
+		return MRVL_OK;
+
+	// compressed images are decompressed by a thread that owns the descriptor
+	int in = r->fds[0];
+	if (req->op != MRVLD_OP_FROM_ELF) {
+		if ((in = mrvl_decompress_fd(r->fds[0], &msg)) < 0)
+			return MRVL_ERR_FORMAT;
+		r->fds[0] = in;
+	}
+	if ((status = map_input(w, in, &buf, &len, &mapped)) != MRVL_OK)
+		return status;
+
+	struct MarvellFirmware *fw = NULL;
+	switch (req->op) {
+		case MRVLD_OP_INFO:
+		case MRVLD_OP_VERIFY:
+			if ((status = mrvl_parse(buf, len, &w->arena, &fw)) != MRVL_OK)
+				break;
+			describe(fw, resp);
+			status = mrvl_verify(fw, resp->checksums);
+			if (req->op == MRVLD_OP_INFO && status == MRVL_ERR_CHECKSUM)
+				status = MRVL_OK;
+			break;
+		case MRVLD_OP_TO_ELF:
+			if ((status = mrvl_parse(buf, len, &w->arena, &fw)) != MRVL_OK)
+				break;
+			describe(fw, resp);
+			if ((status = mrvl_to_elf_fd(fw, r->fds[1])) == MRVL_OK)
+				resp->output_size = output_size(r->fds[1]);
+			break;
+		case MRVLD_OP_FROM_ELF:
+			if ((status = mrvl_from_elf_fd(buf, len, req->ctime, r->fds[1])) == MRVL_OK)
+				resp->output_size = output_size(r->fds[1]);
+			break;
+	}
+	int saved = errno;
+	if (fw)
+		free_mrvl_firmware(fw);
+	if (mapped)
+		munmap((void*) buf, len);
+	errno = saved;
+	return status;
+}
+
+static void request_task(void *arg) {
+	struct request *r = arg;
+	struct worker *w = &workers[threadpool_worker() + 1];
+	struct mrvld_response resp;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.magic = MRVLD_MAGIC;
+	resp.version = MRVLD_VERSION;
+	resp.op = r->req.op;
+	resp.id = r->req.id;
+	resp.num_fds = r->nfds;
+	errno = 0;
+	resp.status = handle(w, r, &resp);
+	if (resp.status == MRVL_ERR_IO)
+		resp.error = errno;
+	mrvl_arena_reset(&w->arena);
+	for (int i = 0; i < r->nfds; i++)
+		close(r->fds[i]);
+
+	// a client that went away only loses its answer
+	mrvld_send(r->conn->fd, &resp, sizeof(resp), NULL, 0);
+	MRVL_STATS_STOP(r->started, MRVL_PHASE_JOB, resp.output_size);
+	release(r->conn);
+	free(r);
+	sem_post(&in_flight);
+}
+
+/* Returns 0 when the connection is done with. */
+static int read_requests(struct connection *conn) {
+	for (int i = 0; i < MAX_BURST; i++) {
+		struct request *r = malloc(sizeof(*r));
+		if (!r)
+			errx(EXIT_FAILURE, "out of memory");
+		ssize_t n = mrvld_recv(conn->fd, &r->req, sizeof(r->req), MSG_DONTWAIT, r->fds, &r->nfds);
+		if (n <= 0) {
+			free(r);
+			return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+		while (sem_wait(&in_flight) != 0)
+			;
+		r->conn = conn;
+		atomic_fetch_add(&conn->refs, 1);
+		MRVL_STATS_STAMP(r->started);
+		threadpool_submit(pool, &requests, request_task, r);
+	}
+	return 1;
+}
+
+static void on_signal(int sig) {
+	stop = 1;
+}
+
+static long parse_count(const char *option, const char *arg, long min, long max) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be a number in %ld..%ld: %s", option, min, max, arg);
+	return n;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-j threads] [-s socket] [--stats[=perf]]\n"
+		"  -j  worker threads, default one per CPU\n"
+		"  -s  socket path, default $MRVLFWD_SOCKET, $XDG_RUNTIME_DIR/mrvlfwd.sock\n"
+		"      or /tmp/mrvlfwd-<uid>.sock", prog);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+	char pathbuf[256];
+	const char *path = NULL;
+	int threads = 0, opt;
+
+	while ((opt = getopt_long(argc, argv, "j:s:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = parse_count("-j", optarg, 0, 4096);
+				break;
+			case 's':
+				path = optarg;
+				break;
+			case 'S':
+				if (mrvl_stats_enable("fwdaemon", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+	if (!path)
+		path = mrvld_socket_path(pathbuf, sizeof(pathbuf));
+
+	int sock = mrvld_listen(path);
+	if (sock < 0)
+		err(EXIT_FAILURE, "cannot listen on %s", path);
+	// no SA_RESTART, so that poll() returns
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// a client may hand over a pipe nobody reads; fail that request, not the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	pool = threadpool_new(threads);
+	if (!pool)
+		errx(EXIT_FAILURE, "cannot create thread pool");
+	int nworkers = threadpool_size(pool) + 1;
+	workers = calloc(nworkers, sizeof(struct worker));
+	if (!workers)
+		errx(EXIT_FAILURE, "out of memory");
+	for (int i = 0; i < nworkers; i++)
+		mrvl_arena_init(&workers[i].arena);
+	sem_init(&in_flight, 0, MAX_IN_FLIGHT);
+	fprintf(stderr, "fwdaemon: listening on %s with %d threads\n", path, threadpool_size(pool));
+
+	static struct pollfd pfds[1 + MAX_CONNECTIONS];
+	static struct connection *conns[MAX_CONNECTIONS];
+	int nconns = 0;
+	while (!stop) {
+		pfds[0] = (struct pollfd) { sock, POLLIN, 0 };
+		for (int i = 0; i < nconns; i++)
+			pfds[1 + i] = (struct pollfd) { conns[i]->fd, POLLIN, 0 };
+		if (poll(pfds, 1 + nconns, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll failed");
+		}
+
+		// back to front, so that a closed connection can be replaced by the last
+		for (int i = nconns - 1; i >= 0; i--) {
+			if (!pfds[1 + i].revents || read_requests(conns[i]))
+				continue;
+			release(conns[i]);
+			conns[i] = conns[--nconns];
+		}
+		if (pfds[0].revents & POLLIN) {
+			int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
+			struct connection *conn = malloc(sizeof(*conn));
+			if (!conn || nconns == MAX_CONNECTIONS) {
+				warnx("too many connections");
+				close(fd);
+				free(conn);
+				continue;
+			}
+			conn->fd = fd;
+			atomic_init(&conn->refs, 1);
+			conns[nconns++] = conn;
+		}
+	}
+
+	close(sock);
+	unlink(path);
+	threadpool_wait(pool, &requests);
+	for (int i = 0; i < nconns; i++)
+		release(conns[i]);
+	threadpool_free(pool);
+	for (int i = 0; i < nworkers; i++) {
+		mrvl_arena_free(&workers[i].arena);
+		free(workers[i].buf);
+	}
+	free(workers);
+	return 0;
+}
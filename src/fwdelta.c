@@ -0,0 +1,139 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "delta.h"
+#include "threadpool.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+
+static struct MarvellFirmware* open_firmware(const char *path) {
+	char msg[256];
+	struct MarvellFirmware *fw = load_marvel_firmware(path, NULL, msg, sizeof(msg));
+	if (!fw)
+		errx(EXIT_FAILURE, "%s", msg);
+	return fw;
+}
+
+static int diff(const char *source_path, const char *target_path, const char *delta_path, int threads) {
+	MRVL_STATS_START(t);
+	struct MarvellFirmware *source = open_firmware(source_path);
+	struct MarvellFirmware *target = open_firmware(target_path);
+	struct threadpool *pool = threadpool_new(threads);
+	if (!pool)
+		errx(EXIT_FAILURE, "cannot create thread pool");
+	struct MarvellDeltaStats stats;
+	const char *msg;
+	size_t size;
+
+	uint8_t *delta = mrvl_delta_create(source, target, pool, &size, &stats, &msg);
+	threadpool_free(pool);
+	if (!delta)
+		errx(EXIT_FAILURE, "%s: %s", target_path, msg);
+
+	FILE *f = fopen(delta_path, "wb");
+	if (!f)
+		err(EXIT_FAILURE, "open %s failed", delta_path);
+	if (fwrite(delta, size, 1, f) != 1 || fclose(f) != 0)
+		err(EXIT_FAILURE, "cannot write %s", delta_path);
+
+	printf("target:  %zu bytes\n", target->image_size);
+	printf("delta:   %zu bytes (%.2f%%)\n", size, 100.0 * size / target->image_size);
+	printf("copied:  %llu bytes in %llu copies\n", (unsigned long long) stats.copied, (unsigned long long) stats.copies);
+	printf("literal: %llu bytes in %llu runs\n", (unsigned long long) stats.literal, (unsigned long long) stats.literals);
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, target->image_size);
+
+	free(delta);
+	free_mrvl_firmware(target);
+	free_mrvl_firmware(source);
+	return 0;
+}
+
+static int apply(const char *source_path, const char *delta_path, const char *output) {
+	MRVL_STATS_START(t);
+	struct MarvellFirmware *source = open_firmware(source_path);
+	FILE *delta = strcmp(delta_path, "-") == 0 ? stdin : fopen(delta_path, "rb");
+	if (!delta)
+		err(EXIT_FAILURE, "open %s failed", delta_path);
+	int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", output);
+
+	const char *msg = mrvl_delta_apply(source, delta, fd);
+	if (close(fd) != 0 && !msg)
+		msg = "cannot write target image";
+	if (msg) {
+		unlink(output);
+		errx(EXIT_FAILURE, "%s: %s", delta_path, msg);
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, 0);
+
+	if (delta != stdin)
+		fclose(delta);
+	free_mrvl_firmware(source);
+	return 0;
+}
+
+static long parse_count(const char *option, const char *arg, long min, long max) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be a number in %ld..%ld: %s", option, min, max, arg);
+	return n;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-j threads] diff source-firmware target-firmware delta\n"
+		"       %s apply source-firmware delta|- output-firmware\n"
+		"--stats[=perf] prints timings as JSON to stderr", prog, prog);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int threads = 0, opt;
+
+	while ((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = parse_count("-j", optarg, 0, 4096);
+				break;
+			case 's':
+				if (mrvl_stats_enable("fwdelta", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
+		usage(argv[0]);
+
+	if (strcmp(argv[optind], "diff") == 0)
+		return diff(argv[optind + 1], argv[optind + 2], argv[optind + 3], threads);
+	if (strcmp(argv[optind], "apply") == 0)
+		return apply(argv[optind + 1], argv[optind + 2], argv[optind + 3]);
+	usage(argv[0]);
+}
@@ -14,26 +14,92 @@
  * You should have received a copy of the GNU General Public License 
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
-#include "marvel-88mw30x-firmware.h"
+#include "libmrvlfw.h"
 #include "crc32.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "decompress.h"
+#include "profile.h"
+#include "reader.h"
+#include "xref.h"
+#include "strscan.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <memory.h>
 #include <err.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <getopt.h>
+#include <unistd.h>
 
-int main(int argc, char** argv) {
-	if (argc != 2) {
-		errx(EXIT_FAILURE, "usage: %s firmware-file", argv[0]);
-	}
+/* Segments larger than this are checksummed in parallel pieces. */
+#define CRC_CHUNK_SIZE (4 * 1024 * 1024)
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_JSONL,
+	FORMAT_CSV,
+};
+
+struct image_job;
+
+struct segment_profile {
+	struct image_job *job;
+	int segment;
+	struct mrvl_segment_profile prof;
+};
+
+struct crc_chunk {
+	struct image_job *job;
+	int segment;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t crc;
+};
+
+struct image_job {
+	const char *path;
+	struct MarvellFirmware *fw;
+	char error[256];
+	struct crc_chunk *chunks;
+	int num_chunks;
+	uint32_t checksum[MRVL_MAX_SEGMENTS];
+	struct segment_profile *profiles;     // with --profile
+	int loaded;                           // with --reader: read or failed
+	struct taskgroup done;
+	uint64_t started;                     // for MRVL_PHASE_JOB
+};
 
-	FILE *fin = fopen(argv[1], "rb");
-	assert(fin != NULL);
-	struct MarvellFirmware *fw = read_marvel_firmware(fin);
-	fclose(fin);
+static struct threadpool *pool;
+static struct mrvl_profiler *profiler;   // with --profile
+static struct mrvl_reader *reader;       // with --reader
+
+
+static void profile_or_die(const uint8_t *p, uint32_t len, struct mrvl_segment_profile *prof) {
+	if (mrvl_profile_segment(profiler, p, len, pool, prof) != 0)
+		errx(EXIT_FAILURE, "failed to allocate the profile");
+}
+
+static void print_profile_text(const struct mrvl_segment_profile *prof) {
+	printf("  Entropy:           %.3f bits/byte, windows %.3f..%.3f\n",
+		prof->entropy, prof->min_entropy, prof->max_entropy);
+	printf("  Content:           %s (chi2 %.1f)\n", mrvl_content_name(prof->content), prof->chi2);
+	printf("  Longest 0xFF run:  %u at +%x\n", prof->ff_run, prof->ff_run_offset);
+	printf("  Longest 0x00 run:  %u at +%x\n", prof->zero_run, prof->zero_run_offset);
+	printf("  Histogram:");
+	for (int k = 0; k < 256; k++)
+		printf("%s%u", k % 16 ? " " : "\n    ", prof->histogram[k]);
+	printf("\n  Windows:           offset    size      entropy  0xFF run  0x00 run  content\n");
+	for (uint32_t i = 0; i < prof->num_windows; i++) {
+		const struct mrvl_window *w = &prof->windows[i];
+		printf("                     %8x  %8x  %7.3f  %8u  %8u  %s\n", w->offset, w->size, w->entropy,
+			w->ff_run, w->zero_run, mrvl_content_name(w->content));
+	}
+}
 
+static void print_text(struct MarvellFirmware *fw) {
 	printf("MRVL\n");
 	printf("ctime:        %u\n", fw->header.ctime);
 	printf("num_segments: %d\n", fw->header.num_segments);
@@ -48,10 +114,568 @@ int main(int argc, char** argv) {
 
 		uint32_t checksum = crc32_byte(fw->segments[i], sh->size);
 		printf("  Checksum (actual): %08x\n", checksum);
+
+		if (profiler) {
+			struct mrvl_segment_profile prof;
+			profile_or_die(fw->segments[i], sh->size, &prof);
+			print_profile_text(&prof);
+			mrvl_profile_free(&prof);
+		}
+	}
+}
+
+/* All references, or those to address; a Thumb pointer to it has bit 0 set. */
+static void print_xrefs(struct MarvellFirmware *fw, int all, uint32_t address) {
+	struct mrvl_xrefs x;
+	if (mrvl_xref_scan(fw, pool, &x) != 0)
+		errx(EXIT_FAILURE, "failed to allocate the cross-references");
+	printf("references:   %u\n", x.count);
+	if (all) {
+		for (uint32_t i = 0; i < x.count; i++)
+			printf("  %08x -> %08x\n", x.refs[i].from, x.refs[i].to);
+	} else {
+		uint32_t count;
+		const uint32_t *idx = mrvl_xrefs_to(&x, address & ~1u, 2, &count);
+		printf("references to %08x: %u\n", address, count);
+		for (uint32_t i = 0; i < count; i++)
+			printf("  %08x -> %08x\n", x.refs[idx[i]].from, x.refs[idx[i]].to);
+	}
+	mrvl_xref_free(&x);
+}
+
+/* One line per string: address, a or u (UTF-16LE), and the text quoted. */
+static void print_strings(struct MarvellFirmware *fw, unsigned min_len) {
+	struct mrvl_strings st;
+	if (mrvl_strings_scan(fw, min_len, MRVL_STRING_ASCII | MRVL_STRING_UTF16LE, pool, &st) != 0)
+		errx(EXIT_FAILURE, "failed to allocate the strings");
+	printf("strings:      %u\n", st.count);
+	for (uint32_t i = 0; i < st.count; i++) {
+		const struct mrvl_string *str = &st.strings[i];
+		const uint8_t *text = fw->segments[str->segment] + (str->vaddr - fw->seghdrs[str->segment].vaddr);
+		int step = str->encoding == MRVL_STRING_UTF16LE ? 2 : 1;
+		printf("  %08x %c \"", str->vaddr, step == 2 ? 'u' : 'a');
+		for (uint32_t k = 0; k < str->size; k += step) {
+			switch (text[k]) {
+				case '\t': fputs("\\t", stdout); break;
+				case '\n': fputs("\\n", stdout); break;
+				case '\r': fputs("\\r", stdout); break;
+				case '"':  fputs("\\\"", stdout); break;
+				case '\\': fputs("\\\\", stdout); break;
+				default:   putchar(text[k]);
+			}
+		}
+		printf("\"\n");
 	}
+	mrvl_strings_free(&st);
+}
+
+static void crc_chunk_task(void *arg) {
+	struct crc_chunk *c = arg;
+	struct crc32_state st;
+	crc32_init(&st);
+	crc32_update(&st, c->job->fw->segments[c->segment] + c->offset, c->length);
+	c->crc = crc32_final(&st);
+}
+
+static void profile_task(void *arg) {
+	struct segment_profile *sp = arg;
+	profile_or_die(sp->job->fw->segments[sp->segment], sp->job->fw->seghdrs[sp->segment].size, &sp->prof);
+}
 
-	free_mrvl_firmware(fw);
+/* Fan out the segments of a loaded image as CRC chunks and profiles. */
+static void submit_segments(struct image_job *job) {
+	struct MarvellFirmware *fw = job->fw;
+	int n = 0;
+	for (int i = 0; i < fw->header.num_segments; i++)
+		n += fw->seghdrs[i].size / CRC_CHUNK_SIZE + 1;
+	job->chunks = malloc(sizeof(struct crc_chunk) * n);
+	if (!job->chunks)
+		errx(EXIT_FAILURE, "failed to allocate CRC chunks");
+
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		uint32_t offset = 0, size = fw->seghdrs[i].size;
+		do {
+			struct crc_chunk *c = &job->chunks[job->num_chunks++];
+			c->job = job;
+			c->segment = i;
+			c->offset = offset;
+			c->length = size - offset < CRC_CHUNK_SIZE ? size - offset : CRC_CHUNK_SIZE;
+			offset += c->length;
+			threadpool_submit(pool, &job->done, crc_chunk_task, c);
+		} while (offset < size);
+	}
+
+	if (!profiler)
+		return;
+	job->profiles = calloc(fw->header.num_segments, sizeof(struct segment_profile));
+	if (!job->profiles)
+		errx(EXIT_FAILURE, "failed to allocate profiles");
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		job->profiles[i].job = job;
+		job->profiles[i].segment = i;
+		threadpool_submit(pool, &job->done, profile_task, &job->profiles[i]);
+	}
+}
+
+static void load_task(void *arg) {
+	struct image_job *job = arg;
+	job->fw = load_marvel_firmware(job->path, NULL, job->error, sizeof(job->error));
+	if (job->fw)
+		submit_segments(job);
+}
+
+/* Called by mrvl_reader_poll() on the main thread; compressed input is mapped as usual. */
+static void read_done(struct mrvl_read *rd) {
+	struct image_job *job = rd->arg;
+	job->loaded = 1;
+	if (rd->unsupported) {
+		threadpool_submit(pool, &job->done, load_task, job);
+	} else if (rd->fw) {
+		job->fw = rd->fw;
+		submit_segments(job);
+	} else {
+		snprintf(job->error, sizeof(job->error), "%s: %s", job->path, rd->error);
+	}
+}
+
+static void print_reader_stats(void) {
+	struct mrvl_reader_stats st;
+	mrvl_reader_stats(reader, &st);
+	double s = st.seconds > 0 ? st.seconds : 1e-9;
+	fprintf(stderr, "{\"reader\":\"%s\",\"queue_depth\":%u,\"images\":%llu,\"ops\":%llu,"
+		"\"reads\":%llu,\"bytes\":%llu,\"seconds\":%.3f,\"iops\":%.0f,\"mb_per_s\":%.1f}\n",
+		mrvl_reader_name(reader), mrvl_reader_depth(reader), (unsigned long long) st.images,
+		(unsigned long long) st.ops, (unsigned long long) st.reads, (unsigned long long) st.bytes,
+		st.seconds, st.ops / s, st.bytes / s / 1e6);
+}
+
+/* Combine chunk CRCs in order. */
+static void finish_job(struct image_job *job) {
+	memset(job->checksum, 0, sizeof(job->checksum));
+	for (int i = 0; i < job->num_chunks; i++) {
+		struct crc_chunk *c = &job->chunks[i];
+		job->checksum[c->segment] = crc32_combine(job->checksum[c->segment], c->crc, c->length);
+	}
+}
+
+static void print_json_string(const char *s) {
+	putchar('"');
+	for (; *s; s++) {
+		unsigned char ch = *s;
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20)
+			printf("\\u%04x", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+static void print_csv_string(const char *s) {
+	if (!strpbrk(s, ",\"\r\n")) {
+		fputs(s, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
 
+static void print_profile_json(const struct mrvl_segment_profile *prof) {
+	printf(",\"profile\":{\"entropy\":%.4f,\"chi2\":%.1f,\"content\":\"%s\",\"min_entropy\":%.4f,\"max_entropy\":%.4f,"
+		"\"ff_run\":%u,\"ff_run_offset\":%u,\"zero_run\":%u,\"zero_run_offset\":%u,\"histogram\":[",
+		prof->entropy, prof->chi2, mrvl_content_name(prof->content), prof->min_entropy, prof->max_entropy,
+		prof->ff_run, prof->ff_run_offset, prof->zero_run, prof->zero_run_offset);
+	for (int k = 0; k < 256; k++)
+		printf("%s%u", k ? "," : "", prof->histogram[k]);
+	// windows as [offset, size, entropy, ff_run, zero_run, content]
+	printf("],\"windows\":[");
+	for (uint32_t i = 0; i < prof->num_windows; i++) {
+		const struct mrvl_window *w = &prof->windows[i];
+		printf("%s[%u,%u,%.4f,%u,%u,\"%s\"]", i ? "," : "", w->offset, w->size, w->entropy,
+			w->ff_run, w->zero_run, mrvl_content_name(w->content));
+	}
+	printf("]}");
+}
+
+static int job_valid(struct image_job *job) {
+	if (!job->fw)
+		return 0;
+	for (int i = 0; i < job->fw->header.num_segments; i++) {
+		if (job->checksum[i] != job->fw->seghdrs[i].checksum)
+			return 0;
+	}
+	return 1;
+}
+
+static void print_jsonl(struct image_job *job) {
+	struct MarvellFirmware *fw = job->fw;
+	printf("{\"file\":");
+	print_json_string(job->path);
+	if (!fw) {
+		printf(",\"error\":");
+		print_json_string(job->error);
+		printf(",\"valid\":false}\n");
+		return;
+	}
+	printf(",\"ctime\":%u,\"num_segments\":%u,\"elf_version\":\"%08x\",\"segments\":[",
+		fw->header.ctime, fw->header.num_segments, fw->header.elf_version);
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		struct MarvellSegmentHeader *sh = &fw->seghdrs[i];
+		printf("%s{\"offset\":%u,\"size\":%u,\"vaddr\":%u,\"checksum\":\"%08x\",\"actual\":\"%08x\"",
+			i ? "," : "", sh->offset, sh->size, sh->vaddr, sh->checksum, job->checksum[i]);
+		if (job->profiles)
+			print_profile_json(&job->profiles[i].prof);
+		printf("}");
+	}
+	printf("],\"valid\":%s}\n", job_valid(job) ? "true" : "false");
+}
+
+static void print_csv_header(void) {
+	printf("file,error,valid,ctime,num_segments,elf_version");
+	for (int i = 0; i < MRVL_MAX_SEGMENTS; i++) {
+		printf(",seg%d_offset,seg%d_size,seg%d_vaddr,seg%d_checksum,seg%d_actual", i, i, i, i, i);
+		if (profiler)
+			printf(",seg%d_entropy,seg%d_content,seg%d_ff_run,seg%d_zero_run", i, i, i, i);
+	}
+	printf("\n");
+}
+
+static void print_csv(struct image_job *job) {
+	struct MarvellFirmware *fw = job->fw;
+	print_csv_string(job->path);
+	putchar(',');
+	if (!fw) {
+		print_csv_string(job->error);
+		printf(",0,,,");
+		for (int i = 0; i < MRVL_MAX_SEGMENTS; i++)
+			printf(profiler ? ",,,,,,,,," : ",,,,,");
+		printf("\n");
+		return;
+	}
+	printf(",%d,%u,%u,%08x", job_valid(job), fw->header.ctime, fw->header.num_segments, fw->header.elf_version);
+	for (int i = 0; i < MRVL_MAX_SEGMENTS; i++) {
+		if (i < fw->header.num_segments) {
+			struct MarvellSegmentHeader *sh = &fw->seghdrs[i];
+			printf(",%u,%u,%u,%08x,%08x", sh->offset, sh->size, sh->vaddr, sh->checksum, job->checksum[i]);
+			if (job->profiles) {
+				struct mrvl_segment_profile *prof = &job->profiles[i].prof;
+				printf(",%.4f,%s,%u,%u", prof->entropy, mrvl_content_name(prof->content), prof->ff_run, prof->zero_run);
+			}
+		} else {
+			printf(profiler ? ",,,,,,,,," : ",,,,,");
+		}
+	}
+	printf("\n");
+}
+
+static char** read_manifest(const char *path, int *count) {
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (!f)
+		err(EXIT_FAILURE, "open %s failed", path);
+
+	char **paths = NULL, *line = NULL;
+	size_t cap = 0, linecap = 0;
+	ssize_t len;
+	*count = 0;
+	while ((len = getline(&line, &linecap, f)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (*count == cap) {
+			cap = cap ? cap * 2 : 1024;
+			paths = realloc(paths, sizeof(char*) * cap);
+			assert(paths);
+		}
+		paths[(*count)++] = strdup(line);
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return paths;
+}
+
+/*
+ * Records are printed in input order. At most `window` images are in
+ * flight, so memory use does not grow with the number of inputs.
+ */
+static int run_batch(char **paths, int count, enum output_format format, int threads) {
+	struct image_job *jobs = calloc(count, sizeof(struct image_job));
+	assert(jobs || count == 0);
+	pool = threadpool_new(threads);
+	if (!pool)
+		errx(EXIT_FAILURE, "cannot create thread pool");
+	int window = 4 * threadpool_size(pool);
+	int submitted = 0, failures = 0;
+	if (reader && window < (int) mrvl_reader_depth(reader))
+		window = mrvl_reader_depth(reader);
+
+	if (format == FORMAT_CSV)
+		print_csv_header();
+	for (int i = 0; i < count; i++) {
+		for (; submitted < count && submitted < i + window; submitted++) {
+			jobs[submitted].path = paths[submitted];
+			MRVL_STATS_STAMP(jobs[submitted].started);
+			if (reader)
+				mrvl_reader_add(reader, paths[submitted], read_done, &jobs[submitted]);
+			else
+				threadpool_submit(pool, &jobs[submitted].done, load_task, &jobs[submitted]);
+		}
+		struct image_job *job = &jobs[i];
+		// keep the queue full while the CRCs of earlier images are computed
+		do {
+			if (reader && mrvl_reader_poll(reader, !job->loaded) < 0)
+				err(EXIT_FAILURE, "reader failed");
+		} while (reader && !job->loaded);
+		threadpool_wait(pool, &job->done);
+		finish_job(job);
+		MRVL_STATS_STOP(job->started, MRVL_PHASE_JOB, job->fw ? job->fw->image_size : 0);
+		if (format == FORMAT_CSV)
+			print_csv(job);
+		else
+			print_jsonl(job);
+		if (!job_valid(job))
+			failures++;
+		if (job->profiles) {
+			for (int k = 0; k < job->fw->header.num_segments; k++)
+				mrvl_profile_free(&job->profiles[k].prof);
+			free(job->profiles);
+		}
+		if (job->fw)
+			free_mrvl_firmware(job->fw);
+		free(job->chunks);
+	}
+
+	threadpool_free(pool);
+	free(jobs);
+	if (reader) {
+		print_reader_stats();
+		mrvl_reader_free(reader);
+	}
+	return failures ? EXIT_FAILURE : 0;
+}
+
+static int selftest(void) {
+	int failures = crc32_selftest();
+	for (const struct crc32_kernel *k = crc32_kernels; k->name; k++)
+		printf("crc32 %-8s %s\n", k->name, k->supported() ? "available" : "unsupported");
+	printf("crc32 active:   %s\n", crc32_get_kernel()->name);
+	printf("crc32 selftest: %s\n", failures ? "FAILED" : "ok");
+	return failures ? EXIT_FAILURE : 0;
+}
+
+/* Exit status 0 only for a complete image with matching checksums. */
+static int verify_stream(const char *path) {
+	struct MarvellHeader hdr;
+	struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS];
+	uint32_t checksums[MRVL_MAX_SEGMENTS];
+	const char *msg;
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", path);
+	if ((fd = mrvl_decompress_fd(fd, &msg)) < 0)
+		errx(EXIT_FAILURE, "%s: %s", path, msg);
+
+	MRVL_STATS_START(t);
+	int status = mrvl_verify_stream(fd, &hdr, seghdrs, checksums);
+	if (status == MRVL_ERR_IO)
+		err(EXIT_FAILURE, "cannot read %s", path);
+	if (status != MRVL_OK && status != MRVL_ERR_CHECKSUM)
+		errx(EXIT_FAILURE, "%s: %s", path, mrvl_strerror(status));
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, 0);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	for (int i = 0; i < hdr.num_segments; i++) {
+		struct MarvellSegmentHeader *sh = &seghdrs[i];
+		printf("segment %d: offset %8x size %8x vaddr %8x checksum %08x actual %08x %s\n",
+			i, sh->offset, sh->size, sh->vaddr, sh->checksum, checksums[i],
+			checksums[i] == sh->checksum ? "ok" : "BAD");
+	}
+	if (status != MRVL_OK)
+		errx(EXIT_FAILURE, "%s: %s", path, mrvl_strerror(status));
 	return 0;
 }
 
+/* A decimal option argument in min..max, or exit. */
+static long parse_count(const char *option, const char *arg, long min, long max) {
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (!*arg || *end || n < min || n > max)
+		errx(EXIT_FAILURE, "%s must be a number in %ld..%ld: %s", option, min, max, arg);
+	return n;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s firmware-file\n"
+		"       %s [-j threads] [-f jsonl|csv] [-m manifest|-] [firmware-file...]\n"
+		"       %s --verify firmware-file|-\n"
+		"       %s --selftest\n"
+		"--profile[=window[,step]] adds entropy, byte histogram and 0xFF/0x00 runs per segment\n"
+		"--xrefs[=address] lists the words that hold segment addresses, or those pointing to address\n"
+		"--strings[=min] lists the ASCII and UTF-16LE strings of at least min characters, default %d\n"
+		"--reader[=uring|pread] [--queue-depth=n] reads the batch asynchronously, n operations\n"
+		"    in flight (default %d), and prints IOPS and bandwidth as JSON to stderr\n"
+		"--stats[=perf] prints timings as JSON to stderr", prog, prog, prog, prog, MRVL_STRINGS_MIN_LEN, MRVL_READER_DEPTH);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "format",   required_argument, NULL, 'f' },
+		{ "jobs",     required_argument, NULL, 'j' },
+		{ "manifest", required_argument, NULL, 'm' },
+		{ "selftest", no_argument,       NULL, 'S' },
+		{ "verify",   required_argument, NULL, 'V' },
+		{ "stats",    optional_argument, NULL, 's' },
+		{ "profile",  optional_argument, NULL, 'p' },
+		{ "reader",   optional_argument, NULL, 'r' },
+		{ "queue-depth", required_argument, NULL, 'q' },
+		{ "xrefs",    optional_argument, NULL, 'x' },
+		{ "strings",  optional_argument, NULL, 't' },
+		{ NULL, 0, NULL, 0 }
+	};
+	enum mrvl_reader_backend backend = MRVL_READER_AUTO;
+	unsigned depth = 0;
+	enum output_format format = FORMAT_TEXT;
+	const char *manifest = NULL, *verify = NULL;
+	int threads = 0, batch = 0, use_reader = 0, xrefs = 0, opt;
+	uint32_t xref_address = 0;
+	unsigned strings_min = 0;
+	int strings = 0;
+
+	while ((opt = getopt_long(argc, argv, "f:j:m:q:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'f':
+				if (strcmp(optarg, "jsonl") == 0 || strcmp(optarg, "json") == 0)
+					format = FORMAT_JSONL;
+				else if (strcmp(optarg, "csv") == 0)
+					format = FORMAT_CSV;
+				else
+					errx(EXIT_FAILURE, "unknown format: %s", optarg);
+				batch = 1;
+				break;
+			case 'j':
+				threads = parse_count("-j", optarg, 0, 4096);
+				batch = 1;
+				break;
+			case 'm':
+				manifest = optarg;
+				batch = 1;
+				break;
+			case 'S':
+				return selftest();
+			case 'V':
+				verify = optarg;
+				break;
+			case 'p': {
+				unsigned long window = 0, step = 0;
+				const char *msg;
+				char *end = NULL;
+				if (optarg) {
+					window = strtoul(optarg, &end, 0);
+					if (*end == ',')
+						step = strtoul(end + 1, &end, 0);
+				}
+				if ((end && *end) || window > UINT32_MAX || step > UINT32_MAX)
+					errx(EXIT_FAILURE, "invalid --profile: %s", optarg);
+				if (!(profiler = mrvl_profiler_new(window, step, &msg)))
+					errx(EXIT_FAILURE, "--profile: %s", msg);
+				break;
+			}
+			case 'r':
+				if (!optarg || strcmp(optarg, "auto") == 0)
+					backend = MRVL_READER_AUTO;
+				else if (strcmp(optarg, "uring") == 0 || strcmp(optarg, "io_uring") == 0)
+					backend = MRVL_READER_URING;
+				else if (strcmp(optarg, "pread") == 0)
+					backend = MRVL_READER_PREAD;
+				else
+					errx(EXIT_FAILURE, "unknown reader: %s", optarg);
+				use_reader = batch = 1;
+				break;
+			case 'q':
+				depth = parse_count("--queue-depth", optarg, 1, MRVL_READER_MAX_DEPTH);
+				use_reader = batch = 1;
+				break;
+			case 'x': {
+				char *end = NULL;
+				xrefs = 1;
+				if (optarg) {
+					unsigned long address = strtoul(optarg, &end, 16);
+					if (*end || address > UINT32_MAX)
+						errx(EXIT_FAILURE, "invalid --xrefs address: %s", optarg);
+					xref_address = address;
+					xrefs = 2;
+				}
+				break;
+			}
+			case 't': {
+				unsigned long min = MRVL_STRINGS_MIN_LEN;
+				char *end = NULL;
+				if (optarg)
+					min = strtoul(optarg, &end, 0);
+				if ((end && *end) || min < 1 || min > 0xffff)
+					errx(EXIT_FAILURE, "invalid --strings: %s", optarg);
+				strings_min = min;
+				strings = 1;
+				break;
+			}
+			case 's':
+				if (mrvl_stats_enable("fwinfo", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	int nfiles = argc - optind;
+	if (verify) {
+		if (batch || nfiles > 0 || profiler || xrefs || strings)
+			usage(argv[0]);
+		return verify_stream(verify);
+	}
+	if (nfiles > 1)
+		batch = 1;
+	if (!batch) {
+		if (nfiles != 1)
+			usage(argv[0]);
+		MRVL_STATS_START(t);
+		char msg[256];
+		struct MarvellFirmware *fw = load_marvel_firmware(argv[optind], NULL, msg, sizeof(msg));
+		if (!fw)
+			errx(EXIT_FAILURE, "%s", msg);
+		print_text(fw);
+		if (xrefs)
+			print_xrefs(fw, xrefs == 1, xref_address);
+		if (strings)
+			print_strings(fw, strings_min);
+		MRVL_STATS_STOP(t, MRVL_PHASE_JOB, fw->image_size);
+		free_mrvl_firmware(fw);
+		return 0;
+	}
+
+	if (xrefs || strings)
+		errx(EXIT_FAILURE, "--xrefs and --strings take a single firmware file");
+	if (format == FORMAT_TEXT)
+		format = FORMAT_JSONL;
+	char **paths = argv + optind;
+	int count = nfiles;
+	if (manifest) {
+		if (nfiles > 0)
+			errx(EXIT_FAILURE, "either a manifest or file names, not both");
+		paths = read_manifest(manifest, &count);
+	}
+	if (use_reader) {
+		const char *msg;
+		if (!(reader = mrvl_reader_new(backend, depth, &msg)))
+			errx(EXIT_FAILURE, "--reader: %s", msg);
+	}
+	return run_batch(paths, count, format, threads);
+}
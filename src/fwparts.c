@@ -0,0 +1,158 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 600
+
+#include "flash.h"
+#include "libmrvlfw.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static void list(const struct MarvellFlashIndex *idx) {
+	printf("partition table at 0x%04x, generation %u, crc %s\n",
+		idx->table_offset, idx->gen_level, idx->table_crc_ok ? "ok" : "BAD");
+	printf(" #  type      name      device  offset      size        gen  active  content\n");
+	for (int i = 0; i < idx->count; i++) {
+		const struct MarvellFlashComponent *c = &idx->components[i];
+		printf("%2d  %-8s  %-8s  %6u  0x%08x  0x%08x  %3u  %-6s  ", i, mrvl_part_type_name(c->type),
+			c->name, c->device, c->offset, c->size, c->gen_level, c->active ? "yes" : "no");
+		if (!c->in_dump)
+			printf("not in dump\n");
+		else if (c->image_size)
+			printf("MRVL image, %u bytes\n", c->image_size);
+		else
+			printf("-\n");
+	}
+}
+
+static void extract(const uint8_t *dump, const struct MarvellFlashComponent *c, const char *output) {
+	int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", output);
+
+	// an MRVL image without the erased rest of its partition
+	const uint8_t *p = dump + c->offset;
+	size_t left = c->image_size ? c->image_size : c->size;
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0)
+			err(EXIT_FAILURE, "write %s failed", output);
+		p += n;
+		left -= n;
+	}
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "write %s failed", output);
+}
+
+static void to_elf(const uint8_t *dump, const struct MarvellFlashComponent *c, const char *output) {
+	const char *msg;
+	struct MarvellFirmware *fw = mrvl_flash_firmware(dump, c, &msg);
+	if (!fw)
+		errx(EXIT_FAILURE, "%s: %s", c->name, msg);
+	int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", output);
+	int status = mrvl_to_elf_fd(fw, fd);
+	if (status == MRVL_ERR_IO || close(fd) != 0)
+		err(EXIT_FAILURE, "write %s failed", output);
+	if (status != MRVL_OK)
+		errx(EXIT_FAILURE, "%s: %s", c->name, mrvl_strerror(status));
+	free_mrvl_firmware(fw);
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s flash-dump\n"
+		"       %s -x component -o output flash-dump\n"
+		"       %s -e component -o output-elf flash-dump\n"
+		"  -x  extract a component, by number or name; MRVL images without padding\n"
+		"  -e  convert the MRVL image of a component to ELF", prog, prog, prog);
+}
+
+int main(int argc, char** argv) {
+	const char *component = NULL, *output = NULL;
+	int elf = 0, opt;
+
+	while ((opt = getopt(argc, argv, "x:e:o:")) != -1) {
+		switch (opt) {
+			case 'x':
+			case 'e':
+				component = optarg;
+				elf = opt == 'e';
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || !component != !output)
+		usage(argv[0]);
+
+	const char *path = argv[optind];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", path);
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		err(EXIT_FAILURE, "stat %s failed", path);
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		errx(EXIT_FAILURE, "%s: not a regular, non-empty file", path);
+	// pages are only read when touched: the tables, and what is extracted
+	const uint8_t *dump = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (dump == MAP_FAILED)
+		err(EXIT_FAILURE, "mmap %s failed", path);
+	posix_madvise((void*) dump, st.st_size, POSIX_MADV_RANDOM);
+	close(fd);
+
+	struct MarvellFlashIndex idx;
+	const char *msg = mrvl_flash_index(dump, st.st_size, &idx);
+	if (msg)
+		errx(EXIT_FAILURE, "%s: %s", path, msg);
+	if (!component) {
+		list(&idx);
+		return 0;
+	}
+
+	// a number, or the name of the active component with that name
+	const struct MarvellFlashComponent *c = NULL;
+	char *end;
+	long n = strtol(component, &end, 10);
+	if (*end == '\0' && n >= 0 && n < idx.count)
+		c = &idx.components[n];
+	for (int i = 0; !c && i < idx.count; i++) {
+		if (idx.components[i].active && strcmp(idx.components[i].name, component) == 0)
+			c = &idx.components[i];
+	}
+	if (!c)
+		errx(EXIT_FAILURE, "no component %s", component);
+	if (!c->in_dump)
+		errx(EXIT_FAILURE, "component %s is not in the dump", component);
+	if (elf)
+		to_elf(dump, c, output);
+	else
+		extract(dump, c, output);
+	munmap((void*) dump, st.st_size);
+	return 0;
+}
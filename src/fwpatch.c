@@ -0,0 +1,118 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "patch.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+
+static uint8_t* read_patch(const char *path, size_t *len) {
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if (!f)
+		err(EXIT_FAILURE, "open %s failed", path);
+
+	size_t cap = 64 * 1024, n;
+	uint8_t *buf = malloc(cap);
+	*len = 0;
+	while (buf && (n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+		*len += n;
+		if (*len == cap)
+			buf = realloc(buf, cap *= 2);
+	}
+	if (!buf)
+		errx(EXIT_FAILURE, "out of memory");
+	if (ferror(f))
+		err(EXIT_FAILURE, "cannot read %s", path);
+	if (f != stdin)
+		fclose(f);
+	return buf;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s firmware vaddr patch-file|-\n"
+		"       %s -s segment firmware patch-file|-\n"
+		"  -s  replace the whole segment, which may change its size\n"
+		"  --stats[=perf]  print timings as JSON to stderr", prog, prog);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int segment = -1, opt;
+
+	while ((opt = getopt_long(argc, argv, "s:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 's': {
+				char *end;
+				unsigned long n = strtoul(optarg, &end, 0);
+				if (!*optarg || *end || n >= MRVL_MAX_SEGMENTS)
+					errx(EXIT_FAILURE, "invalid segment: %s", optarg);
+				segment = n;
+				break;
+			}
+			case 'S':
+				if (mrvl_stats_enable("fwpatch", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != (segment < 0 ? 3 : 2))
+		usage(argv[0]);
+
+	const char *path = argv[optind];
+	size_t len;
+	uint8_t *data = read_patch(argv[argc - 1], &len);
+	int fd = open(path, O_RDWR);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", path);
+
+	struct MarvellPatchResult res;
+	const char *msg;
+	MRVL_STATS_START(t);
+	if (segment < 0) {
+		char *end;
+		unsigned long vaddr = strtoul(argv[optind + 1], &end, 0);
+		if (*end || vaddr > UINT32_MAX)
+			errx(EXIT_FAILURE, "invalid address: %s", argv[optind + 1]);
+		msg = mrvl_patch_range(fd, vaddr, data, len, &res);
+	} else {
+		msg = mrvl_patch_segment(fd, segment, data, len, &res);
+	}
+	if (msg)
+		errx(EXIT_FAILURE, "%s: %s", path, msg);
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "cannot write %s", path);
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, len);
+
+	printf("segment %d: checksum %08x -> %08x\n", res.segment, res.old_checksum, res.checksum);
+	printf("read %llu bytes, wrote %llu bytes", (unsigned long long) res.bytes_read, (unsigned long long) res.bytes_written);
+	if (res.relocated)
+		printf(", moved %d segment%s", res.relocated, res.relocated > 1 ? "s" : "");
+	printf("\n");
+	free(data);
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "libmrvlfw.h"
+#include "store.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+
+struct verify_totals {
+	uint32_t images;
+	uint32_t bad;
+};
+
+
+static int import(struct mrvl_store *s, const char *name, char **files, int count) {
+	struct mrvl_store_import st;
+	uint64_t bytes = 0, new_bytes = 0;
+	char errbuf[512];
+	int failures = 0;
+
+	for (int i = 0; i < count; i++) {
+		MRVL_STATS_START(t);
+		struct MarvellFirmware *fw = load_marvel_firmware(files[i], NULL, errbuf, sizeof(errbuf));
+		if (!fw) {
+			warnx("%s", errbuf);
+			failures++;
+			continue;
+		}
+		char *copy = strdup(files[i]);
+		const char *n = name ? name : basename(copy);
+		const char *msg = mrvl_store_import(s, n, fw, &st);
+		if (msg) {
+			warnx("%s: %s", files[i], msg);
+			failures++;
+		} else {
+			printf("%s: %llu bytes, %u chunks, %u new (%llu bytes), %u of %u segments known\n",
+				n, (unsigned long long) st.bytes, st.chunks, st.new_chunks,
+				(unsigned long long) st.new_bytes, st.known_segments, st.segments);
+			bytes += st.bytes;
+			new_bytes += st.new_bytes;
+		}
+		MRVL_STATS_STOP(t, MRVL_PHASE_JOB, fw->image_size);
+		free(copy);
+		free_mrvl_firmware(fw);
+	}
+	if (count > 1)
+		printf("imported %llu bytes, %llu new\n", (unsigned long long) bytes, (unsigned long long) new_bytes);
+	return failures ? EXIT_FAILURE : 0;
+}
+
+static int export(struct mrvl_store *s, const char *name, const char *output) {
+	int stdout_ = strcmp(output, "-") == 0;
+	int fd = stdout_ ? STDOUT_FILENO : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s failed", output);
+	const char *msg = mrvl_store_export(s, name, fd);
+	if (!stdout_ && close(fd) != 0 && !msg)
+		msg = "cannot write image";
+	if (msg) {
+		if (!stdout_)
+			unlink(output);
+		errx(EXIT_FAILURE, "%s: %s", name, msg);
+	}
+	return 0;
+}
+
+static void print_image(const char *name, const struct MarvellHeader *hdr, uint64_t size, void *arg) {
+	printf("%-32s %10llu bytes  ctime %10u  %u segments\n", name,
+		(unsigned long long) size, hdr->ctime, hdr->num_segments);
+}
+
+static void print_check(const struct mrvl_store_check *check, void *arg) {
+	struct verify_totals *totals = arg;
+	int bad = check->damaged;
+	for (uint32_t i = 0; i < check->header.num_segments; i++) {
+		if (check->checksums[i] != check->seghdrs[i].checksum) {
+			printf("%s: segment %u checksum %08x actual %08x BAD\n",
+				check->name, i, check->seghdrs[i].checksum, check->checksums[i]);
+			bad = 1;
+		}
+	}
+	if (check->damaged)
+		printf("%s: damaged in the store\n", check->name);
+	totals->images++;
+	totals->bad += bad;
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-d store] [--stats[=perf]] command\n"
+		"  import [-n name] firmware-file...   add images, named after the file by default\n"
+		"  export name output-file|-           rebuild an image bit for bit\n"
+		"  list                                images with size, ctime and segments\n"
+		"  stats                               images, pack size and dedup ratio\n"
+		"  verify                              check every chunk and image CRC\n"
+		"  -d  store directory, default $MRVLFW_STORE_DIR", prog);
+}
+
+int main(int argc, char** argv) {
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *dir = getenv("MRVLFW_STORE_DIR"), *name = NULL, *msg;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "+d:", longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'd':
+				dir = optarg;
+				break;
+			case 'S':
+				if (mrvl_stats_enable("fwstore", optarg) != 0)
+					errx(EXIT_FAILURE, "unknown --stats option, or built without STATS=1");
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc || !dir || !*dir)
+		usage(argv[0]);
+	const char *cmd = argv[optind];
+	optind++;
+
+	if (strcmp(cmd, "import") == 0) {
+		while ((opt = getopt(argc, argv, "n:")) != -1) {
+			if (opt != 'n')
+				usage(argv[0]);
+			name = optarg;
+		}
+		if (optind >= argc || (name && argc - optind != 1))
+			usage(argv[0]);
+		struct mrvl_store *s = mrvl_store_open(dir, 1, 1, &msg);
+		if (!s)
+			errx(EXIT_FAILURE, "%s: %s", dir, msg);
+		int res = import(s, name, argv + optind, argc - optind);
+		mrvl_store_close(s);
+		return res;
+	}
+
+	struct mrvl_store *s = mrvl_store_open(dir, 0, 0, &msg);
+	if (!s)
+		errx(EXIT_FAILURE, "%s: %s", dir, msg);
+	int nargs = argc - optind, res = 0;
+	if (strcmp(cmd, "export") == 0 && nargs == 2) {
+		res = export(s, argv[optind], argv[optind + 1]);
+	} else if (strcmp(cmd, "list") == 0 && nargs == 0) {
+		if ((msg = mrvl_store_list(s, print_image, NULL)))
+			errx(EXIT_FAILURE, "%s: %s", dir, msg);
+	} else if (strcmp(cmd, "stats") == 0 && nargs == 0) {
+		struct mrvl_store_stats st;
+		if ((msg = mrvl_store_stats(s, &st)))
+			errx(EXIT_FAILURE, "%s: %s", dir, msg);
+		printf("store:     %s\n", dir);
+		printf("images:    %u\n", st.images);
+		printf("bytes:     %llu\n", (unsigned long long) st.image_bytes);
+		printf("pack:      %llu\n", (unsigned long long) st.pack_bytes);
+		printf("chunks:    %u\n", st.chunks);
+		printf("segments:  %u\n", st.segments);
+		printf("dedup:     %.1fx\n", st.pack_bytes ? (double) st.image_bytes / st.pack_bytes : 0.0);
+	} else if (strcmp(cmd, "verify") == 0 && nargs == 0) {
+		struct verify_totals totals = { 0, 0 };
+		uint32_t bad_chunks;
+		if ((msg = mrvl_store_verify(s, print_check, &totals, &bad_chunks)))
+			errx(EXIT_FAILURE, "%s: %s", dir, msg);
+		printf("%u images, %u bad, %u corrupt chunks\n", totals.images, totals.bad, bad_chunks);
+		res = totals.bad || bad_chunks ? EXIT_FAILURE : 0;
+	} else {
+		usage(argv[0]);
+	}
+	mrvl_store_close(s);
+	return res;
+}
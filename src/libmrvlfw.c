@@ -0,0 +1,672 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 500
+
+#include "libmrvlfw.h"
+#include "crc32.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Segment data is copied and checksummed in pieces of this size. */
+#define COPY_CHUNK_SIZE (128 * 1024)
+
+/* Buffer size of mrvl_verify_stream(). */
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+/* Characters of a string in its symbol name. */
+#define SYMBOL_TEXT_LEN 32
+
+/* .ARM.attributes section as found in Marvelll IOT SDK samples.
+	Attribute Section: aeabi
+	File Attributes
+		Tag_CPU_name: "Cortex-M4"
+		Tag_CPU_arch: v7E-M
+		Tag_CPU_arch_profile: Microcontroller
+		Tag_THUMB_ISA_use: Thumb-2
+		Tag_FP_arch: VFPv4-D16
+		Tag_ABI_PCS_wchar_t: 4
+		Tag_ABI_FP_denormal: Needed
+		Tag_ABI_FP_exceptions: Needed
+		Tag_ABI_FP_number_model: IEEE 754
+		Tag_ABI_align_needed: 8-byte
+		Tag_ABI_enum_size: small
+		Tag_ABI_HardFP_use: SP only
+		Tag_ABI_optimization_goals: Aggressive Size
+		Tag_CPU_unaligned_access: v6
+*/
+static const uint8_t _arm_attributes[] = {
+	0x41, 0x34, 0x00, 0x00, 0x00, 0x61, 0x65, 0x61, 0x62, 0x69,
+	0x00, 0x01, 0x2A, 0x00, 0x00, 0x00, 0x05, 0x43, 0x6F, 0x72,
+	0x74, 0x65, 0x78, 0x2D, 0x4D, 0x34, 0x00, 0x06, 0x0D, 0x07,
+	0x4D, 0x09, 0x02, 0x0A, 0x06, 0x12, 0x04, 0x14, 0x01, 0x15,
+	0x01, 0x17, 0x03, 0x18, 0x01, 0x1A, 0x01, 0x1B, 0x01, 0x1E,
+	0x04, 0x22, 0x01 };
+
+struct elf_load {
+	uint32_t offset;
+	uint32_t filesz;
+	uint32_t vaddr;
+};
+
+
+const char* mrvl_strerror(int status) {
+	switch (status) {
+		case MRVL_OK:            return "success";
+		case MRVL_ERR_NOMEM:     return "out of memory";
+		case MRVL_ERR_FORMAT:    return "not a valid firmware image";
+		case MRVL_ERR_CHECKSUM:  return "segment checksum mismatch";
+		case MRVL_ERR_NOT_ELF:   return "not a 32-bit little-endian ELF file";
+		case MRVL_ERR_ELF:       return "ELF program headers exceed file size";
+		case MRVL_ERR_SEGMENTS:  return "ELF contains no loadable segments, or more than the maximum allowed";
+		case MRVL_ERR_IO:        return "I/O error";
+		case MRVL_ERR_ORDER:     return "segment data overlaps or is not in segment table order";
+		case MRVL_ERR_TRUNCATED: return "unexpected end of input";
+	}
+	return "unknown error";
+}
+
+int mrvl_parse(const uint8_t *buf, size_t len, struct MarvellArena *arena, struct MarvellFirmware **fw) {
+	const char *msg;
+	*fw = parse_marvel_firmware(buf, len, arena, &msg);
+	if (*fw)
+		return MRVL_OK;
+	return check_marvel_firmware(buf, len) ? MRVL_ERR_FORMAT : MRVL_ERR_NOMEM;
+}
+
+int mrvl_verify(const struct MarvellFirmware *fw, uint32_t checksums[MRVL_MAX_SEGMENTS]) {
+	int status = MRVL_OK;
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		struct crc32_state st;
+		crc32_init(&st);
+		crc32_update(&st, fw->segments[i], fw->seghdrs[i].size);
+		uint32_t crc = crc32_final(&st);
+		if (checksums)
+			checksums[i] = crc;
+		if (crc != fw->seghdrs[i].checksum)
+			status = MRVL_ERR_CHECKSUM;
+	}
+	return status;
+}
+
+/* Like read(), but only returns less than len at end of input. */
+static ssize_t read_full(int fd, void *buf, size_t len) {
+	size_t done = 0;
+	MRVL_STATS_START(t);
+	while (done < len) {
+		ssize_t n = read(fd, (uint8_t*) buf + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, done);
+	return done;
+}
+
+/* Read len bytes into buf, in pieces, checksumming them if crc is not NULL. */
+static int consume(int fd, uint8_t *buf, uint64_t len, struct crc32_state *crc) {
+	while (len > 0) {
+		size_t n = len < STREAM_BUFFER_SIZE ? len : STREAM_BUFFER_SIZE;
+		ssize_t got = read_full(fd, buf, n);
+		if (got < 0)
+			return MRVL_ERR_IO;
+		if (got < n)
+			return MRVL_ERR_TRUNCATED;
+		if (crc)
+			crc32_update(crc, buf, n);
+		len -= n;
+	}
+	return MRVL_OK;
+}
+
+int mrvl_verify_stream(int fd, struct MarvellHeader *hdr, struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS], uint32_t checksums[MRVL_MAX_SEGMENTS]) {
+	uint8_t buf[STREAM_BUFFER_SIZE];
+	ssize_t n;
+
+	memset(hdr, 0, sizeof(*hdr));
+	if ((n = read_full(fd, hdr, sizeof(*hdr))) < 0)
+		return MRVL_ERR_IO;
+	if (n < sizeof(*hdr))
+		return MRVL_ERR_TRUNCATED;
+	if (memcmp(hdr->mrvl, "MRVL", 4) != 0 || hdr->unknown1 != MRVL_HEADER_MAGIC2 ||
+			hdr->num_segments > MRVL_MAX_SEGMENTS)
+		return MRVL_ERR_FORMAT;
+
+	size_t table = sizeof(struct MarvellSegmentHeader) * hdr->num_segments;
+	if ((n = read_full(fd, seghdrs, table)) < 0)
+		return MRVL_ERR_IO;
+	if (n < table)
+		return MRVL_ERR_TRUNCATED;
+	for (int i = 0; i < hdr->num_segments; i++) {
+		if (seghdrs[i].type != 2)
+			return MRVL_ERR_FORMAT;
+	}
+
+	// single pass over the data, seeking forward by reading
+	uint64_t pos = sizeof(*hdr) + table;
+	int status = MRVL_OK;
+	for (int i = 0; i < hdr->num_segments; i++) {
+		struct crc32_state crc;
+		if (seghdrs[i].offset < pos)
+			return MRVL_ERR_ORDER;
+		int s = consume(fd, buf, seghdrs[i].offset - pos, NULL);
+		if (s != MRVL_OK)
+			return s;
+		crc32_init(&crc);
+		s = consume(fd, buf, seghdrs[i].size, &crc);
+		if (s != MRVL_OK)
+			return s;
+		checksums[i] = crc32_final(&crc);
+		if (checksums[i] != seghdrs[i].checksum)
+			status = MRVL_ERR_CHECKSUM;
+		pos = (uint64_t) seghdrs[i].offset + seghdrs[i].size;
+	}
+
+	// drain, so that a writer on the other end of a pipe does not fail
+	while ((n = read_full(fd, buf, sizeof(buf))) == sizeof(buf))
+		;
+	if (n < 0)
+		return MRVL_ERR_IO;
+	return status;
+}
+
+
+/* One R_ARM_ABS32 without symbol for every reference from a segment. */
+static int add_rel_sections(const struct MarvellFirmware *fw, const char **segnames, struct mrvl_elf_layout *out) {
+	uint32_t count, total = 0;
+	char name[64];
+
+	if (mrvl_xref_scan(fw, NULL, &out->xrefs) != 0)
+		return MRVL_ERR_NOMEM;
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		mrvl_xrefs_from(&out->xrefs, fw->seghdrs[i].vaddr, fw->seghdrs[i].size, &count);
+		total += count;
+	}
+	if (!(out->rels = malloc(sizeof(struct elf32_rel_le) * (total ? total : 1))))
+		return MRVL_ERR_NOMEM;
+
+	struct elf32_rel_le *rel = out->rels;
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		const struct mrvl_xref *refs = mrvl_xrefs_from(&out->xrefs, fw->seghdrs[i].vaddr, fw->seghdrs[i].size, &count);
+		if (count == 0)
+			continue;
+		struct elfw_section *s = &out->sections[out->num_sections++];
+		snprintf(name, sizeof(name), ".rel%s", segnames[i]);
+		s->name = strtab_add(&out->names, name);
+		s->type = SHT_REL;
+		s->flags = SHF_INFO_LINK;
+		s->info = i + 1;                  // the segment's section
+		s->align = 4;
+		s->entsize = sizeof(struct elf32_rel_le);
+		s->data = rel;
+		s->size = sizeof(struct elf32_rel_le) * count;
+		for (uint32_t k = 0; k < count; k++, rel++) {
+			rel->r_offset = refs[k].from;
+			rel->r_info = ELF32_R_INFO(0, R_ARM_ABS32);
+		}
+	}
+	return MRVL_OK;
+}
+
+/*
+ * A local STT_OBJECT for every string, named like Ghidra's labels: s_ or
+ * u_ (UTF-16) and the first characters, with _ for anything but letters
+ * and digits. Equal names share their bytes in .strtab.
+ */
+static int add_symbols(const struct MarvellFirmware *fw, unsigned min_len, struct mrvl_elf_layout *out) {
+	char name[2 + SYMBOL_TEXT_LEN + 1];
+
+	if (mrvl_strings_scan(fw, min_len, MRVL_STRING_ASCII | MRVL_STRING_UTF16LE, NULL, &out->strings) != 0)
+		return MRVL_ERR_NOMEM;
+	if (!(out->syms = malloc(sizeof(struct elf32_sym_le) * (out->strings.count + 1))))
+		return MRVL_ERR_NOMEM;
+	if (strtab_init(&out->symnames, 1) != 0)
+		return MRVL_ERR_NOMEM;
+	memset(&out->syms[0], 0, sizeof(struct elf32_sym_le));
+	for (uint32_t i = 0; i < out->strings.count; i++) {
+		const struct mrvl_string *str = &out->strings.strings[i];
+		const uint8_t *text = fw->segments[str->segment] + (str->vaddr - fw->seghdrs[str->segment].vaddr);
+		int step = str->encoding == MRVL_STRING_UTF16LE ? 2 : 1;
+		size_t n = 0;
+		name[n++] = step == 2 ? 'u' : 's';
+		name[n++] = '_';
+		for (uint32_t k = 0; k < str->size && n < sizeof(name) - 1; k += step) {
+			uint8_t c = text[k];
+			name[n++] = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ? c : '_';
+		}
+		name[n] = '\0';
+
+		struct elf32_sym_le *sym = &out->syms[i + 1];
+		sym->st_name = strtab_add(&out->symnames, name);
+		sym->st_value = str->vaddr;
+		sym->st_size = str->size;
+		sym->st_info = ELF32_ST_INFO(STB_LOCAL, STT_OBJECT);
+		sym->st_other = STV_DEFAULT;
+		sym->st_shndx = str->segment + 1; // the segment's section
+	}
+	if (strtab_finalize(&out->symnames) != 0)
+		return MRVL_ERR_NOMEM;
+	for (uint32_t i = 1; i <= out->strings.count; i++)
+		out->syms[i].st_name = strtab_offset(&out->symnames, out->syms[i].st_name);
+
+	struct elfw_section *s = &out->sections[out->num_sections++];
+	s->name = strtab_add(&out->names, ".symtab");
+	s->type = SHT_SYMTAB;
+	s->link = out->num_sections + 1;      // .strtab, next
+	s->info = out->strings.count + 1;     // all symbols are local
+	s->align = 4;
+	s->entsize = sizeof(struct elf32_sym_le);
+	s->data = out->syms;
+	s->size = sizeof(struct elf32_sym_le) * (out->strings.count + 1);
+	int symtab = out->num_sections;
+
+	s = &out->sections[out->num_sections++];
+	s->name = strtab_add(&out->names, ".strtab");
+	s->type = SHT_STRTAB;
+	s->align = 1;
+	s->data = out->symnames.buf;
+	s->size = out->symnames.buflen;
+
+	for (int i = 0; i < out->num_sections; i++) {
+		if (out->sections[i].type == SHT_REL)
+			out->sections[i].link = symtab;
+	}
+	return MRVL_OK;
+}
+
+int mrvl_elf_layout(const struct MarvellFirmware *fw, struct mrvl_elf_layout *out) {
+	return mrvl_elf_layout_opts(fw, 0, out);
+}
+
+int mrvl_elf_layout_opts(const struct MarvellFirmware *fw, unsigned options, struct mrvl_elf_layout *out) {
+	const char *segnames[MRVL_MAX_SEGMENTS];
+	memset(out, 0, sizeof(*out));
+	if (strtab_init(&out->names, 0) != 0) {
+		mrvl_elf_layout_free(out);
+		return MRVL_ERR_NOMEM;
+	}
+
+	// Copy firmware segments
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		struct elfw_section *s = &out->sections[out->num_sections++];
+		s->align = 1;
+		s->data = fw->segments[i];
+		s->size = fw->seghdrs[i].size;
+		s->type = SHT_PROGBITS;
+		s->flags = SHF_ALLOC;
+		s->entsize = 0;
+		s->addr = fw->seghdrs[i].vaddr;
+
+		// assumptions based on very few samples
+		switch (i) {
+			case 0:
+				s->align = 8;
+				segnames[i] = ".init";
+				s->flags = SHF_ALLOC | SHF_EXECINSTR;
+				break;
+			case 1:
+				s->align = 16;
+				segnames[i] = ".text";
+				s->flags = SHF_ALLOC | SHF_EXECINSTR;
+				break;
+			case 2:
+				segnames[i] = ".data";
+				//s->flags = SHF_ALLOC | SHF_WRITE;
+				s->flags = SHF_ALLOC | SHF_WRITE | SHF_EXECINSTR;
+				break;
+			default:
+				// unknown segment
+				segnames[i] = ".text";
+		}
+		s->name = strtab_add(&out->names, segnames[i]);
+	}
+
+	if (options & MRVL_ELF_XREFS) {
+		int status = add_rel_sections(fw, segnames, out);
+		if (status != MRVL_OK) {
+			mrvl_elf_layout_free(out);
+			return status;
+		}
+	}
+
+	// assumption about entry point, as observed from samples
+	if (fw->header.num_segments >= 2) {
+		out->entry = fw->seghdrs[1].vaddr + 1;
+	}
+
+	// .ARM.attributes
+	struct elfw_section *s = &out->sections[out->num_sections++];
+	s->align = 1;
+	s->data = _arm_attributes;
+	s->size = sizeof(_arm_attributes);
+	s->name = strtab_add(&out->names, ".ARM.attributes");
+	s->type = SHT_ARM_ATTRIBUTES;
+	s->flags = 0;
+	s->entsize = 0;
+
+	if (options & MRVL_ELF_STRINGS) {
+		int status = add_symbols(fw, options >> 16, out);
+		if (status != MRVL_OK) {
+			mrvl_elf_layout_free(out);
+			return status;
+		}
+	}
+
+	// add sechdr string section
+	s = &out->sections[out->num_sections++];
+	s->align = 1;
+	s->name = strtab_add(&out->names, ".shstrtab");
+	s->type = SHT_STRTAB;
+	s->flags = SHF_STRINGS | SHF_ALLOC;
+	s->entsize = 0;
+	out->shstrndx = out->num_sections;
+
+	// names so far are handles, turn them into offsets
+	if (strtab_finalize(&out->names) != 0) {
+		mrvl_elf_layout_free(out);
+		return MRVL_ERR_NOMEM;
+	}
+	for (int i = 0; i < out->num_sections; i++)
+		out->sections[i].name = strtab_offset(&out->names, out->sections[i].name);
+	s->data = out->names.buf;
+	s->size = out->names.buflen;
+	return MRVL_OK;
+}
+
+void mrvl_elf_layout_free(struct mrvl_elf_layout *out) {
+	strtab_free(&out->names);
+	mrvl_xref_free(&out->xrefs);
+	free(out->rels);
+	out->rels = NULL;
+	strtab_free(&out->symnames);
+	mrvl_strings_free(&out->strings);
+	free(out->syms);
+	out->syms = NULL;
+}
+
+static int elf_writer(const struct mrvl_elf_layout *layout, struct elfw *w) {
+	elfw_init(w, ET_EXEC, EM_ARM, EF_ARM_EABI_VER5 | EF_ARM_ABI_FLOAT_SOFT);
+	w->entry = layout->entry;
+	for (int i = 0; i < layout->num_sections; i++) {
+		if (elfw_add_section(w, &layout->sections[i]) < 0)
+			return MRVL_ERR_FORMAT;
+	}
+	w->shstrndx = layout->shstrndx;
+	return MRVL_OK;
+}
+
+int mrvl_to_elf(const struct MarvellFirmware *fw, uint8_t **elf, size_t *elf_size) {
+	return mrvl_to_elf_opts(fw, 0, elf, elf_size);
+}
+
+int mrvl_to_elf_fd(const struct MarvellFirmware *fw, int fd) {
+	return mrvl_to_elf_fd_opts(fw, 0, fd);
+}
+
+int mrvl_to_elf_opts(const struct MarvellFirmware *fw, unsigned options, uint8_t **elf, size_t *elf_size) {
+	struct mrvl_elf_layout layout;
+	struct elfw w;
+	int status = mrvl_elf_layout_opts(fw, options, &layout);
+	if (status != MRVL_OK)
+		return status;
+	status = elf_writer(&layout, &w);
+	if (status == MRVL_OK && elfw_write_buffer(&w, elf, elf_size) != 0)
+		status = MRVL_ERR_NOMEM;
+	mrvl_elf_layout_free(&layout);
+	return status;
+}
+
+/* One writev() straight from the firmware. */
+int mrvl_to_elf_fd_opts(const struct MarvellFirmware *fw, unsigned options, int fd) {
+	struct mrvl_elf_layout layout;
+	struct elfw w;
+	int status = mrvl_elf_layout_opts(fw, options, &layout);
+	if (status != MRVL_OK)
+		return status;
+	status = elf_writer(&layout, &w);
+	if (status == MRVL_OK && elfw_write(&w, fd) != 0)
+		status = MRVL_ERR_IO;
+	mrvl_elf_layout_free(&layout);
+	return status;
+}
+
+
+/* Collect the PT_LOAD program headers that carry file data. */
+static int elf_loads(const uint8_t *elf, size_t len, struct elf_load *loads, uint32_t *count, uint32_t *version) {
+	const struct elf32_ehdr_le *eh = (const struct elf32_ehdr_le*) elf;
+	if (len < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+			eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_ident[EI_DATA] != ELFDATA2LSB)
+		return MRVL_ERR_NOT_ELF;
+	if (eh->e_phnum == PN_XNUM)
+		return MRVL_ERR_ELF;
+	if (eh->e_phnum > 0 && (eh->e_phentsize != sizeof(struct elf32_phdr_le) ||
+			(uint64_t) eh->e_phoff + sizeof(struct elf32_phdr_le) * eh->e_phnum > len))
+		return MRVL_ERR_ELF;
+
+	*count = 0;
+	*version = eh->e_version;
+	const struct elf32_phdr_le *ph = (const struct elf32_phdr_le*) (elf + eh->e_phoff);
+	for (int i = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_type != PT_LOAD || ph[i].p_filesz == 0)
+			continue;
+		if (*count == MRVL_MAX_SEGMENTS)
+			return MRVL_ERR_SEGMENTS;
+		if ((uint64_t) ph[i].p_offset + ph[i].p_filesz > len)
+			return MRVL_ERR_ELF;
+		loads[*count].offset = ph[i].p_offset;
+		loads[*count].filesz = ph[i].p_filesz;
+		loads[*count].vaddr = ph[i].p_vaddr;
+		(*count)++;
+	}
+	return *count ? MRVL_OK : MRVL_ERR_SEGMENTS;
+}
+
+/* Header and segment table of the image built from loads, except the checksums. */
+static size_t image_table(uint8_t *table, const struct elf_load *loads, uint32_t count, uint32_t ctime, uint32_t version) {
+	struct MarvellHeader hdr;
+	struct MarvellSegmentHeader *sh = (struct MarvellSegmentHeader*) (table + sizeof(hdr));
+	uint32_t offset = sizeof(hdr) + sizeof(struct MarvellSegmentHeader) * count;
+
+	memcpy(hdr.mrvl, "MRVL", 4);
+	hdr.unknown1 = MRVL_HEADER_MAGIC2;
+	hdr.ctime = ctime;
+	hdr.num_segments = count;
+	hdr.elf_version = version;
+	memcpy(table, &hdr, sizeof(hdr));
+	for (uint32_t i = 0; i < count; i++) {
+		sh[i].type = 2; // seems to be constant
+		sh[i].offset = offset;
+		sh[i].size = (loads[i].filesz + 3) & 0xfffffffc;
+		sh[i].vaddr = loads[i].vaddr;
+		sh[i].checksum = 0;
+		offset += sh[i].size;
+	}
+	return offset;
+}
+
+int mrvl_from_elf(const uint8_t *elf, size_t len, uint32_t ctime, uint8_t **image, size_t *image_size) {
+	size_t cap = 0;
+	*image = NULL;
+	return mrvl_from_elf_into(elf, len, ctime, image, &cap, image_size);
+}
+
+int mrvl_from_elf_into(const uint8_t *elf, size_t len, uint32_t ctime, uint8_t **buf, size_t *cap, size_t *image_size) {
+	struct elf_load loads[MRVL_MAX_SEGMENTS];
+	uint8_t table[sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * MRVL_MAX_SEGMENTS];
+	uint32_t count, version;
+
+	int status = elf_loads(elf, len, loads, &count, &version);
+	if (status != MRVL_OK)
+		return status;
+	size_t total = image_table(table, loads, count, ctime, version);
+	if (total > *cap) {
+		uint8_t *grown = realloc(*buf, total);
+		if (!grown)
+			return MRVL_ERR_NOMEM;
+		*buf = grown;
+		*cap = total;
+		MRVL_STATS_ALLOC(total);
+	}
+	uint8_t *p = *buf;
+
+	struct MarvellSegmentHeader *sh = (struct MarvellSegmentHeader*) (table + sizeof(struct MarvellHeader));
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t *dst = p + sh[i].offset;
+		memcpy(dst, elf + loads[i].offset, loads[i].filesz);
+		memset(dst + loads[i].filesz, 0xFF, sh[i].size - loads[i].filesz);
+		sh[i].checksum = crc32_byte(dst, sh[i].size);
+	}
+	memcpy(p, table, sh[0].offset);
+	*image_size = total;
+	return MRVL_OK;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	MRVL_STATS_START(t);
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pwrite(fd, (const uint8_t*) buf + done, len - done, offset + done);
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_FW_WRITE, len);
+	return 0;
+}
+
+/*
+ * Copy one segment from the ELF image to the firmware file at offset,
+ * checksumming each chunk while it is in cache. The last chunk carries the
+ * 0xFF padding up to the next 4 byte boundary.
+ */
+static int copy_segment(int fd, off_t offset, const uint8_t *src, size_t filesz, uint32_t *checksum) {
+	struct crc32_state crc;
+	uint8_t tail[4];
+	size_t done = 0;
+
+	crc32_init(&crc);
+	while (filesz - done >= 4) {
+		size_t n = filesz - done;
+		if (n > COPY_CHUNK_SIZE)
+			n = COPY_CHUNK_SIZE;
+		n &= ~(size_t) 3;
+		crc32_update(&crc, src + done, n);
+		if (pwrite_all(fd, src + done, n, offset + done) != 0)
+			return MRVL_ERR_IO;
+		done += n;
+	}
+	if (done < filesz) {
+		memset(tail, 0xFF, sizeof(tail));
+		memcpy(tail, src + done, filesz - done);
+		crc32_update(&crc, tail, sizeof(tail));
+		if (pwrite_all(fd, tail, sizeof(tail), offset + done) != 0)
+			return MRVL_ERR_IO;
+	}
+	*checksum = crc32_final(&crc);
+	return MRVL_OK;
+}
+
+/* Segment data in one pass, then the header with the checksums. */
+int mrvl_from_elf_fd(const uint8_t *elf, size_t len, uint32_t ctime, int fd) {
+	struct elf_load loads[MRVL_MAX_SEGMENTS];
+	uint8_t table[sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * MRVL_MAX_SEGMENTS];
+	uint32_t count, version;
+
+	int status = elf_loads(elf, len, loads, &count, &version);
+	if (status != MRVL_OK)
+		return status;
+	image_table(table, loads, count, ctime, version);
+
+	struct MarvellSegmentHeader *sh = (struct MarvellSegmentHeader*) (table + sizeof(struct MarvellHeader));
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t checksum;
+		status = copy_segment(fd, sh[i].offset, elf + loads[i].offset, loads[i].filesz, &checksum);
+		if (status != MRVL_OK)
+			return status;
+		sh[i].checksum = checksum;
+	}
+	return pwrite_all(fd, table, sh[0].offset, 0) == 0 ? MRVL_OK : MRVL_ERR_IO;
+}
+
+
+struct batch_task {
+	enum mrvl_op op;
+	struct mrvl_job *job;
+};
+
+static void batch_job(enum mrvl_op op, struct mrvl_job *job) {
+	struct MarvellFirmware *fw = NULL;
+	MRVL_STATS_START(t);
+
+	job->output = NULL;
+	job->output_size = 0;
+	switch (op) {
+		case MRVL_OP_VERIFY:
+		case MRVL_OP_TO_ELF:
+			job->status = mrvl_parse(job->input, job->input_size, NULL, &fw);
+			if (job->status != MRVL_OK)
+				break;
+			if (op == MRVL_OP_VERIFY)
+				job->status = mrvl_verify(fw, job->checksums);
+			else
+				job->status = mrvl_to_elf(fw, &job->output, &job->output_size);
+			free_mrvl_firmware(fw);
+			break;
+		case MRVL_OP_FROM_ELF:
+			job->status = mrvl_from_elf(job->input, job->input_size, job->ctime, &job->output, &job->output_size);
+			break;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_JOB, job->input_size);
+}
+
+static void batch_task_fn(void *arg) {
+	struct batch_task *t = arg;
+	batch_job(t->op, t->job);
+}
+
+size_t mrvl_batch(enum mrvl_op op, struct mrvl_job *jobs, size_t count, struct threadpool *pool) {
+	struct batch_task *tasks = pool ? malloc(sizeof(struct batch_task) * (count ? count : 1)) : NULL;
+	struct taskgroup group = TASKGROUP_INIT;
+	size_t failed = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (tasks) {
+			tasks[i].op = op;
+			tasks[i].job = &jobs[i];
+			threadpool_submit(pool, &group, batch_task_fn, &tasks[i]);
+		} else {
+			batch_job(op, &jobs[i]);
+		}
+	}
+	if (tasks) {
+		threadpool_wait(pool, &group);
+		free(tasks);
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (jobs[i].status != MRVL_OK)
+			failed++;
+	}
+	return failed;
+}
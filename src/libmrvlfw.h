@@ -0,0 +1,144 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+#include "elfwriter.h"
+#include "strtab.h"
+#include "threadpool.h"
+#include "xref.h"
+#include "strscan.h"
+
+/*
+ * libmrvlfw: firmware parsing, verification and conversion on memory
+ * buffers, for programs that handle many images in one process.
+ *
+ * Every call returns MRVL_OK or a negative mrvl_status and keeps no global
+ * state, so calls may run concurrently on different images. Output
+ * buffers are malloc'ed and owned by the caller. No libelf is needed.
+ */
+enum mrvl_status {
+	MRVL_OK = 0,
+	MRVL_ERR_NOMEM = -1,
+	MRVL_ERR_FORMAT = -2,                 // not a valid firmware image
+	MRVL_ERR_CHECKSUM = -3,               // a segment CRC does not match
+	MRVL_ERR_NOT_ELF = -4,                // not a 32-bit little-endian ELF file
+	MRVL_ERR_ELF = -5,                    // program headers outside the file
+	MRVL_ERR_SEGMENTS = -6,               // no loadable segment, or too many
+	MRVL_ERR_IO = -7,                     // errno has the details
+	MRVL_ERR_ORDER = -8,                  // segment data overlaps or goes backwards
+	MRVL_ERR_TRUNCATED = -9,              // input ends inside the image
+};
+
+extern const char* mrvl_strerror(int status);
+
+/*
+ * Parse an image in memory, see parse_marvel_firmware(). *fw points into
+ * buf; release it with free_mrvl_firmware().
+ */
+extern int mrvl_parse(const uint8_t *buf, size_t len, struct MarvellArena *arena, struct MarvellFirmware **fw);
+
+/* Check the segment CRCs; checksums, if not NULL, receives the actual ones. */
+extern int mrvl_verify(const struct MarvellFirmware *fw, uint32_t checksums[MRVL_MAX_SEGMENTS]);
+
+/*
+ * Verify an image read sequentially from fd, e.g. a pipe, in a single pass
+ * through a fixed buffer: memory use does not depend on the image size.
+ * Segment data must follow the segment table in table order, without
+ * overlaps. hdr, seghdrs and checksums receive the tables and actual CRCs
+ * as far as they were read. Trailing data after the last segment is read
+ * and ignored.
+ */
+extern int mrvl_verify_stream(int fd, struct MarvellHeader *hdr, struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS], uint32_t checksums[MRVL_MAX_SEGMENTS]);
+
+/*
+ * Section layout of the ELF file made from a firmware: one section per
+ * segment, .ARM.attributes and .shstrtab. Section data points into the
+ * firmware, which must outlive the layout.
+ *
+ * With MRVL_ELF_XREFS, every segment with cross-references (see xref.h)
+ * gets a .rel section of R_ARM_ABS32 relocations without symbol, one per
+ * word that holds an address: the target is the word itself, so tools
+ * that apply them change nothing, and disassemblers learn which words are
+ * pointers.
+ *
+ * With MRVL_ELF_STRINGS, .symtab and .strtab get a local STT_OBJECT symbol
+ * for every ASCII and UTF-16LE string (see strscan.h) of at least
+ * MRVL_ELF_STRING_MIN(n) characters, default MRVL_STRINGS_MIN_LEN.
+ */
+enum mrvl_elf_option {
+	MRVL_ELF_XREFS = 1 << 0,
+	MRVL_ELF_STRINGS = 1 << 1,
+};
+
+#define MRVL_ELF_STRING_MIN(n) ((unsigned) (n) << 16)
+
+struct mrvl_elf_layout {
+	uint32_t entry;
+	int num_sections;
+	struct elfw_section sections[2 * MRVL_MAX_SEGMENTS + 4];
+	int shstrndx;                         // index into sections[], 1-based like ELF
+	struct strtab names;
+	struct mrvl_xrefs xrefs;              // with MRVL_ELF_XREFS
+	struct elf32_rel_le *rels;            // data of the .rel sections
+	struct mrvl_strings strings;          // with MRVL_ELF_STRINGS
+	struct elf32_sym_le *syms;            // .symtab
+	struct strtab symnames;               // .strtab
+};
+
+extern int mrvl_elf_layout(const struct MarvellFirmware *fw, struct mrvl_elf_layout *out);
+extern int mrvl_elf_layout_opts(const struct MarvellFirmware *fw, unsigned options, struct mrvl_elf_layout *out);
+extern void mrvl_elf_layout_free(struct mrvl_elf_layout *out);
+
+/* Firmware to ELF, into a buffer or straight to a file. */
+extern int mrvl_to_elf(const struct MarvellFirmware *fw, uint8_t **elf, size_t *elf_size);
+extern int mrvl_to_elf_fd(const struct MarvellFirmware *fw, int fd);
+extern int mrvl_to_elf_opts(const struct MarvellFirmware *fw, unsigned options, uint8_t **elf, size_t *elf_size);
+extern int mrvl_to_elf_fd_opts(const struct MarvellFirmware *fw, unsigned options, int fd);
+
+/*
+ * ELF (AXF) to firmware: one segment per PT_LOAD program header with file
+ * data, padded to 4 bytes with 0xFF. The _fd variant streams the segments
+ * to a file with pwrite() and checksums them on the way. The _into variant
+ * builds the image in *buf of *cap bytes and grows it with realloc() when
+ * it is too small, so that one buffer can serve many conversions.
+ */
+extern int mrvl_from_elf(const uint8_t *elf, size_t len, uint32_t ctime, uint8_t **image, size_t *image_size);
+extern int mrvl_from_elf_into(const uint8_t *elf, size_t len, uint32_t ctime, uint8_t **buf, size_t *cap, size_t *image_size);
+extern int mrvl_from_elf_fd(const uint8_t *elf, size_t len, uint32_t ctime, int fd);
+
+/* Batch interface: one call for many images, spread over a thread pool. */
+enum mrvl_op {
+	MRVL_OP_VERIFY,
+	MRVL_OP_TO_ELF,
+	MRVL_OP_FROM_ELF,
+};
+
+struct mrvl_job {
+	const uint8_t *input;
+	size_t input_size;
+	uint32_t ctime;                       // MRVL_OP_FROM_ELF only
+	int status;                           // out
+	uint32_t checksums[MRVL_MAX_SEGMENTS]; // out, MRVL_OP_VERIFY
+	uint8_t *output;                      // out, malloc'ed, conversions only
+	size_t output_size;
+};
+
+/* pool may be NULL to run on the calling thread. Returns the number of failed jobs. */
+extern size_t mrvl_batch(enum mrvl_op op, struct mrvl_job *jobs, size_t count, struct threadpool *pool);
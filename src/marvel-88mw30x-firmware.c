@@ -15,83 +15,361 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include "marvel-88mw30x-firmware.h"
+#include "stats.h"
+#include "decompress.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
-#include <err.h>
 #include <fcntl.h>
-#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static const char magic1[4] = {'M', 'R', 'V', 'L'};
-static const uint32_t magic2 = 0x2E9CF17B;
+static const uint32_t magic2 = MRVL_HEADER_MAGIC2;
 static const uint32_t segment_magic = 2;
 
 
-struct MarvellFirmware* new_mrvl_firmware() {
-	struct MarvellFirmware *fw = malloc(sizeof(struct MarvellFirmware));
-	if (!fw)
-		errx(EXIT_FAILURE, "failed to allocate MarvellFirmware*");
-	fw->seghdrs = NULL;
-	fw->segments = NULL;
+/*
+ * Arena: a list of blocks with bump allocation. Resetting keeps the largest
+ * block, so a batch of similarly sized images runs without further mallocs.
+ */
+struct MarvellArenaBlock {
+	struct MarvellArenaBlock *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(16)));
+};
+
+void mrvl_arena_init(struct MarvellArena *a) {
+	memset(a, 0, sizeof(*a));
+}
+
+void* mrvl_arena_alloc(struct MarvellArena *a, size_t n) {
+	n = (n + 15) & ~(size_t) 15;
+	struct MarvellArenaBlock *b = a->head;
+	if (!b || b->size - b->used < n) {
+		size_t size = b ? b->size * 2 : 64 * 1024;
+		if (size < n)
+			size = n;
+		b = malloc(sizeof(struct MarvellArenaBlock) + size);
+		if (!b)
+			return NULL;
+		MRVL_STATS_ALLOC(sizeof(struct MarvellArenaBlock) + size);
+		b->next = a->head;
+		b->size = size;
+		b->used = 0;
+		a->head = b;
+		a->allocations++;
+	}
+	void *p = b->data + b->used;
+	b->used += n;
+	a->in_use += n;
+	if (a->in_use > a->peak)
+		a->peak = a->in_use;
+	return p;
+}
+
+void mrvl_arena_reset(struct MarvellArena *a) {
+	struct MarvellArenaBlock *keep = NULL;
+	for (struct MarvellArenaBlock *b = a->head; b; b = b->next) {
+		if (!keep || b->size > keep->size)
+			keep = b;
+	}
+	struct MarvellArenaBlock *b = a->head;
+	while (b) {
+		struct MarvellArenaBlock *next = b->next;
+		if (b != keep)
+			free(b);
+		b = next;
+	}
+	if (keep) {
+		keep->next = NULL;
+		keep->used = 0;
+	}
+	a->head = keep;
+	a->in_use = 0;
+}
+
+void mrvl_arena_free(struct MarvellArena *a) {
+	struct MarvellArenaBlock *b = a->head;
+	while (b) {
+		struct MarvellArenaBlock *next = b->next;
+		free(b);
+		b = next;
+	}
+	a->head = NULL;
+	a->in_use = 0;
+}
+
+static void* alloc_in(struct MarvellArena *arena, size_t n) {
+	if (arena)
+		return mrvl_arena_alloc(arena, n);
+	MRVL_STATS_ALLOC(n);
+	return malloc(n);
+}
+
+/*
+ * Layout of a MarvellFirmware built in memory, in a single allocation:
+ *   struct MarvellFirmware
+ *   uint8_t *segments[num_segments]
+ *   struct MarvellSegmentHeader seghdrs[num_segments]
+ *   segment data, each segment starting on a 4 byte boundary
+ */
+struct MarvellFirmware* new_mrvl_firmware(struct MarvellArena *arena, uint32_t num_segments, const uint32_t *segment_sizes) {
+	if (num_segments > MRVL_MAX_SEGMENTS)
+		return NULL;
+
+	size_t hdrlen = sizeof(struct MarvellFirmware) + 
+		(sizeof(uint8_t*) + sizeof(struct MarvellSegmentHeader)) * num_segments;
+	hdrlen = (hdrlen + 3) & ~(size_t) 3;
+	size_t total = hdrlen;
+	for (int i = 0; segment_sizes && i < num_segments; i++)
+		total += ((size_t) segment_sizes[i] + 3) & ~(size_t) 3;
+
+	uint8_t *block = alloc_in(arena, total);
+	if (!block)
+		return NULL;
+	struct MarvellFirmware *fw = (struct MarvellFirmware*) block;
+	fw->segments = (uint8_t**) (fw + 1);
+	fw->seghdrs = (struct MarvellSegmentHeader*) (fw->segments + num_segments);
+	memset(fw->seghdrs, 0, sizeof(struct MarvellSegmentHeader) * num_segments);
+	uint8_t *data = block + hdrlen;
+	for (int i = 0; i < num_segments; i++) {
+		fw->segments[i] = segment_sizes ? data : NULL;
+		if (segment_sizes) {
+			fw->seghdrs[i].size = segment_sizes[i];
+			data += ((size_t) segment_sizes[i] + 3) & ~(size_t) 3;
+		}
+	}
+	fw->image = NULL;
+	fw->image_size = 0;
+	fw->backing = MRVL_BACKING_HEAP;
+	fw->arena = arena;
 
 	memcpy(fw->header.mrvl, magic1, sizeof(magic1));
 	fw->header.unknown1 = magic2;
 	fw->header.ctime = 0;
-	fw->header.num_segments = 0;
+	fw->header.num_segments = num_segments;
 	fw->header.elf_version = 0;
 	return fw;
 }
 
 void free_mrvl_firmware(struct MarvellFirmware* fw) {
-	if (fw->seghdrs) {
-		free(fw->seghdrs);
-	}
-	if (fw->segments) {
-		for (int i = 0; i < fw->header.num_segments; i++) {
-			if (fw->segments[i]) {
-				free (fw->segments[i]);
-			}
-		}
-		free(fw->segments);
+	switch (fw->backing) {
+		case MRVL_BACKING_MMAP:
+			munmap((void*) fw->image, fw->image_size);
+			break;
+		case MRVL_BACKING_BUFFER:
+			free((void*) fw->image);
+			break;
+		case MRVL_BACKING_HEAP:
+		case MRVL_BACKING_VIEW:
+			break;
 	}
+	if (!fw->arena)
+		free(fw);
 }
 
-void read_marvel_header(FILE *f, struct MarvellHeader* hdr) {
-	size_t res = fread(hdr, sizeof(struct MarvellHeader), 1, f);
-	assert(res == 1);
+static const char* read_marvel_header(FILE *f, struct MarvellHeader* hdr) {
+	if (fread(hdr, sizeof(struct MarvellHeader), 1, f) != 1)
+		return "truncated firmware header";
 	if (memcmp(hdr->mrvl, magic1, sizeof(magic1)) != 0)
-		errx(EXIT_FAILURE, "magic1 does not match");
+		return "magic1 does not match";
 	if (hdr->unknown1 != magic2)
-		errx(EXIT_FAILURE, "magic2 does not match");
+		return "magic2 does not match";
+	if (hdr->num_segments > MRVL_MAX_SEGMENTS)
+		return "too many segments";
+	return NULL;
 }
 
-struct MarvellFirmware* read_marvel_firmware(FILE* f) {
-	struct MarvellFirmware *fw = new_mrvl_firmware();
-	read_marvel_header(f, &fw->header);
+struct MarvellFirmware* read_marvel_firmware(FILE* f, struct MarvellArena *arena, const char **errmsg) {
+	struct MarvellHeader hdr;
+	struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS];
+	uint32_t sizes[MRVL_MAX_SEGMENTS];
+	uint64_t bytes = 0;
+	MRVL_STATS_START(t);
 
-	fw->seghdrs = malloc(sizeof(struct MarvellSegmentHeader) * fw->header.num_segments);
-	assert(fw->seghdrs);
-	fw->segments = malloc(sizeof(void*) * fw->header.num_segments);
-	assert(fw->segments);
+	if ((*errmsg = read_marvel_header(f, &hdr)) != NULL)
+		return NULL;
+	if (fread(seghdrs, sizeof(struct MarvellSegmentHeader), hdr.num_segments, f) != hdr.num_segments) {
+		*errmsg = "truncated segment headers";
+		return NULL;
+	}
+	for (int i = 0; i < hdr.num_segments; i++) {
+		if (seghdrs[i].type != segment_magic) {
+			*errmsg = "unexpected segment type";
+			return NULL;
+		}
+		sizes[i] = seghdrs[i].size;
+	}
 
-	size_t res = fread(fw->seghdrs, sizeof(struct MarvellSegmentHeader), fw->header.num_segments, f);
-	if (res != fw->header.num_segments)
-		errx(EXIT_FAILURE, "could not read %d segment headers", fw->header.num_segments);
+	struct MarvellFirmware *fw = new_mrvl_firmware(arena, hdr.num_segments, sizes);
+	if (!fw) {
+		*errmsg = "out of memory";
+		return NULL;
+	}
+	fw->header = hdr;
+	memcpy(fw->seghdrs, seghdrs, sizeof(struct MarvellSegmentHeader) * hdr.num_segments);
 
 	for (int i = 0; i < fw->header.num_segments; i++) {
-		struct MarvellSegmentHeader *sh = &(fw->seghdrs[i]);
-		if (sh->type != segment_magic)
-			errx(EXIT_FAILURE, "segment_header[0] unexpected, %d != %d", sh->type, segment_magic);
+		if (fw->seghdrs[i].size == 0)
+			continue;
+		if (fseek(f, fw->seghdrs[i].offset, SEEK_SET) != 0 ||
+				fread(fw->segments[i], fw->seghdrs[i].size, 1, f) != 1) {
+			free_mrvl_firmware(fw);
+			*errmsg = "segment exceeds file size";
+			return NULL;
+		}
+		bytes += fw->seghdrs[i].size;
 	}
 
-	for (int i = 0; i < fw->header.num_segments; i++) {
-		fw->segments[i]= malloc(fw->seghdrs[i].size);
-		assert(fw->segments[i]);
-		fseek(f, fw->seghdrs[i].offset, SEEK_SET);
-		size_t res = fread(fw->segments[i], fw->seghdrs[i].size, 1, f);
-		assert (res == 1);
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, bytes);
+	return fw;
+}
+
+const char* check_marvel_firmware(const uint8_t *buf, size_t len) {
+	const struct MarvellHeader *hdr = (const struct MarvellHeader*) buf;
+	if (len < sizeof(struct MarvellHeader))
+		return "truncated firmware header";
+	if (memcmp(hdr->mrvl, magic1, sizeof(magic1)) != 0)
+		return "magic1 does not match";
+	if (hdr->unknown1 != magic2)
+		return "magic2 does not match";
+	if (hdr->num_segments > MRVL_MAX_SEGMENTS)
+		return "too many segments";
+
+	size_t tablelen = sizeof(struct MarvellHeader) + 
+		sizeof(struct MarvellSegmentHeader) * hdr->num_segments;
+	if (len < tablelen)
+		return "truncated segment headers";
+
+	const struct MarvellSegmentHeader *sh = (const struct MarvellSegmentHeader*) (buf + sizeof(struct MarvellHeader));
+	for (int i = 0; i < hdr->num_segments; i++) {
+		if (sh[i].type != segment_magic)
+			return "unexpected segment type";
+		if ((uint64_t) sh[i].offset + sh[i].size > len)
+			return "segment exceeds file size";
+	}
+	return NULL;
+}
+
+/* One allocation: the MarvellFirmware followed by its segments[] array. */
+static struct MarvellFirmware* view_image(const uint8_t *buf, size_t len, enum MarvellBacking backing, struct MarvellArena *arena, const char **errmsg) {
+	MRVL_STATS_START(t);
+	const char *msg = check_marvel_firmware(buf, len);
+	if (msg) {
+		*errmsg = msg;
+		return NULL;
+	}
+
+	const struct MarvellHeader *hdr = (const struct MarvellHeader*) buf;
+	struct MarvellFirmware *fw = alloc_in(arena, sizeof(struct MarvellFirmware) + sizeof(uint8_t*) * hdr->num_segments);
+	if (!fw) {
+		*errmsg = "out of memory";
+		return NULL;
+	}
+	fw->header = *hdr;
+	fw->seghdrs = (struct MarvellSegmentHeader*) (buf + sizeof(struct MarvellHeader));
+	fw->segments = (uint8_t**) (fw + 1);
+	for (int i = 0; i < fw->header.num_segments; i++)
+		fw->segments[i] = (uint8_t*) buf + fw->seghdrs[i].offset;
+	fw->image = buf;
+	fw->image_size = len;
+	fw->backing = backing;
+	fw->arena = arena;
+	MRVL_STATS_STOP(t, MRVL_PHASE_PARSE, sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * hdr->num_segments);
+	return fw;
+}
+
+struct MarvellFirmware* parse_marvel_firmware(const uint8_t *buf, size_t len, struct MarvellArena *arena, const char **errmsg) {
+	return view_image(buf, len, MRVL_BACKING_VIEW, arena, errmsg);
+}
+
+/* Returns NULL with *errmsg == NULL if fd is not mappable. */
+static struct MarvellFirmware* map_image(int fd, struct MarvellArena *arena, const char **errmsg) {
+	struct stat st;
+	MRVL_STATS_START(t);
+	*errmsg = NULL;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return NULL;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	madvise(map, st.st_size, MADV_WILLNEED);
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, st.st_size);
+	struct MarvellFirmware *fw = view_image(map, st.st_size, MRVL_BACKING_MMAP, arena, errmsg);
+	if (!fw)
+		munmap(map, st.st_size);
+	return fw;
+}
+
+/* Fallback for pipes and other unmappable inputs. */
+static struct MarvellFirmware* slurp_image(int fd, struct MarvellArena *arena, const char **errmsg) {
+	size_t cap = 64 * 1024, len = 0;
+	MRVL_STATS_START(t);
+	uint8_t *buf = malloc(cap);
+	MRVL_STATS_ALLOC(cap);
+	for (;;) {
+		if (buf && len == cap) {
+			uint8_t *p = realloc(buf, cap * 2);
+			if (!p)
+				free(buf);
+			buf = p;
+			cap *= 2;
+			MRVL_STATS_ALLOC(cap);
+		}
+		if (!buf) {
+			*errmsg = "out of memory";
+			return NULL;
+		}
+		ssize_t n = read(fd, buf + len, cap - len);
+		if (n < 0) {
+			free(buf);
+			*errmsg = "cannot read firmware";
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_READ, len);
+	struct MarvellFirmware *fw = view_image(buf, len, MRVL_BACKING_BUFFER, arena, errmsg);
+	if (!fw)
+		free(buf);
+	return fw;
+}
+
+struct MarvellFirmware* load_marvel_firmware_fd(int fd, struct MarvellArena *arena, const char **errmsg) {
+	// compressed input arrives through a pipe and is slurped
+	int in = mrvl_decompress_fd(fd, errmsg);
+	if (in < 0) {
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return NULL;
 	}
 
+	struct MarvellFirmware *fw = map_image(in, arena, errmsg);
+	if (!fw && !*errmsg)
+		fw = slurp_image(in, arena, errmsg);
+	if (in != STDIN_FILENO)
+		close(in);
 	return fw;
 }
 
+struct MarvellFirmware* load_marvel_firmware(const char *path, struct MarvellArena *arena, char *errbuf, size_t errlen) {
+	const char *msg = NULL;
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0) {
+		snprintf(errbuf, errlen, "open %s failed: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct MarvellFirmware *fw = load_marvel_firmware_fd(fd, arena, &msg);
+	if (!fw)
+		snprintf(errbuf, errlen, "%s: %s", path, msg);
+	return fw;
+}
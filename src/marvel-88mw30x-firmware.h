@@ -15,9 +15,15 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#define MRVLFW_VERSION "0.2.0"
+
+#define MRVL_MAX_SEGMENTS 9
+#define MRVL_HEADER_MAGIC2 0x2E9CF17B     // MarvellHeader.unknown1
+
 struct __attribute__((packed, scalar_storage_order("little-endian"))) 
 MarvellHeader {
 	char mrvl[4];                         // "MRVL"
@@ -36,14 +42,74 @@ MarvellSegmentHeader {
 	uint32_t checksum;                    // CRC32(segment data)
 };
 
+/*
+ * Bump allocator for batch processing. Everything allocated from it is
+ * released at once by mrvl_arena_reset(), which keeps the memory for reuse.
+ */
+struct MarvellArena {
+	struct MarvellArenaBlock *head;
+	size_t in_use;                        // bytes handed out since the last reset
+	size_t peak;                          // high-water mark of in_use
+	size_t allocations;                   // number of blocks malloc'ed so far
+};
+
+/* Where seghdrs and segments[] of a MarvellFirmware live. */
+enum MarvellBacking {
+	MRVL_BACKING_HEAP = 0,                // same allocation as the MarvellFirmware
+	MRVL_BACKING_MMAP,                    // views into a private mapping of the file
+	MRVL_BACKING_BUFFER,                  // views into a malloc'ed copy of the input
+	MRVL_BACKING_VIEW,                    // views into caller-owned memory
+};
+
 struct
 MarvellFirmware {
 	struct MarvellHeader header;
 	struct MarvellSegmentHeader *seghdrs;
 	uint8_t **segments;
+	const uint8_t *image;                 // whole file, unless MRVL_BACKING_HEAP
+	size_t image_size;
+	enum MarvellBacking backing;
+	struct MarvellArena *arena;           // owner of this struct, or NULL if malloc'ed
 };
 
 
-extern struct MarvellFirmware* new_mrvl_firmware();
-extern struct MarvellFirmware* read_marvel_firmware(FILE* f);
+/* mrvl_arena_alloc() returns NULL if out of memory. */
+extern void mrvl_arena_init(struct MarvellArena *a);
+extern void* mrvl_arena_alloc(struct MarvellArena *a, size_t n);
+extern void mrvl_arena_reset(struct MarvellArena *a);
+extern void mrvl_arena_free(struct MarvellArena *a);
+
+/*
+ * Each firmware is one contiguous block: the struct, segments[], seghdrs[]
+ * and, if segment_sizes is given, the segment data. With arena == NULL the
+ * block is malloc'ed and free_mrvl_firmware() releases it; otherwise it
+ * lives until the arena is reset and free_mrvl_firmware() only releases
+ * the file mapping or input buffer, if any. Returns NULL if out of memory
+ * or num_segments exceeds MRVL_MAX_SEGMENTS.
+ */
+extern struct MarvellFirmware* new_mrvl_firmware(struct MarvellArena *arena, uint32_t num_segments, const uint32_t *segment_sizes);
+
+/* Copies the image from f into one block; returns NULL and a message on error. */
+extern struct MarvellFirmware* read_marvel_firmware(FILE* f, struct MarvellArena *arena, const char **errmsg);
 extern void free_mrvl_firmware(struct MarvellFirmware* fw);
+
+/*
+ * Validate the header and segment table of an in-memory image.
+ * Returns NULL if every segment lies within the image, or an error message.
+ */
+extern const char* check_marvel_firmware(const uint8_t *buf, size_t len);
+
+/*
+ * Zero-copy readers. The header is copied, seghdrs and segments[] point
+ * into the image and must be treated as read-only. All offsets are checked
+ * against the image size.
+ *
+ * parse_marvel_firmware() views an image in memory. load_marvel_firmware()
+ * maps path, or reads it into a single buffer if it is not mappable; "-"
+ * is standard input. load_marvel_firmware_fd() does the same for an open
+ * file and closes it, unless it is standard input. All return NULL and a
+ * message on error; none of them exits.
+ */
+extern struct MarvellFirmware* parse_marvel_firmware(const uint8_t *buf, size_t len, struct MarvellArena *arena, const char **errmsg);
+extern struct MarvellFirmware* load_marvel_firmware(const char *path, struct MarvellArena *arena, char *errbuf, size_t errlen);
+extern struct MarvellFirmware* load_marvel_firmware_fd(int fd, struct MarvellArena *arena, const char **errmsg);
@@ -0,0 +1,289 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Generator for synthetic firmware images (MRVL) and AXF files, for
+ * benchmarks and experiments. The output is fully determined by the
+ * arguments, so generated inputs can be compared between releases.
+ */
+#define _XOPEN_SOURCE 500
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "marvel-88mw30x-firmware.h"
+#include "elfwriter.h"
+#include "crc32.h"
+
+#define FILL_CHUNK_SIZE (1024 * 1024)
+
+enum fill {
+	FILL_RANDOM,
+	FILL_ZERO,
+	FILL_FF,
+	FILL_INC,
+	FILL_TEXT,
+};
+
+struct segment_spec {
+	uint64_t size;
+	uint32_t vaddr;
+	int has_vaddr;
+	enum fill fill;
+};
+
+static const uint32_t default_vaddrs[] = { 0x00100000, 0x1F000000, 0x20000000 };
+
+static const char *fill_names[] = { "random", "zero", "ff", "inc", "text" };
+
+
+static uint64_t parse_size(const char *s, char **end) {
+	uint64_t v = strtoull(s, end, 0);
+	switch (**end) {
+		case 'k': case 'K': v <<= 10; (*end)++; break;
+		case 'm': case 'M': v <<= 20; (*end)++; break;
+		case 'g': case 'G': v <<= 30; (*end)++; break;
+	}
+	return v;
+}
+
+/* size[@vaddr][:fill] */
+static void parse_segment(const char *arg, struct segment_spec *spec) {
+	char *end;
+	memset(spec, 0, sizeof(*spec));
+	spec->size = parse_size(arg, &end);
+	if (*end == '@') {
+		spec->vaddr = strtoul(end + 1, &end, 0);
+		spec->has_vaddr = 1;
+	}
+	if (*end == ':') {
+		end++;
+		int i;
+		for (i = 0; i < sizeof(fill_names) / sizeof(fill_names[0]); i++) {
+			if (strcmp(end, fill_names[i]) == 0)
+				break;
+		}
+		if (i == sizeof(fill_names) / sizeof(fill_names[0]))
+			errx(EXIT_FAILURE, "unknown fill pattern: %s", end);
+		spec->fill = i;
+		end += strlen(end);
+	}
+	if (*end != '\0' || spec->size == 0 || spec->size > UINT32_MAX - 3)
+		errx(EXIT_FAILURE, "bad segment specification: %s", arg);
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* Fill buf with the bytes at position pos.. of a segment. */
+static void fill_chunk(uint8_t *buf, size_t len, uint64_t pos, enum fill fill, uint64_t *rng) {
+	static const char words[] = "Marvell 88MW30x firmware: wlan_init() failed, retrying...\n";
+	switch (fill) {
+		case FILL_RANDOM:
+			for (size_t i = 0; i < len; i += 8) {
+				uint64_t r = xorshift64(rng);
+				memcpy(buf + i, &r, len - i < 8 ? len - i : 8);
+			}
+			break;
+		case FILL_ZERO:
+			memset(buf, 0, len);
+			break;
+		case FILL_FF:
+			memset(buf, 0xFF, len);
+			break;
+		case FILL_INC:
+			for (size_t i = 0; i < len; i++)
+				buf[i] = (uint8_t) (pos + i);
+			break;
+		case FILL_TEXT:
+			for (size_t i = 0; i < len; i++)
+				buf[i] = words[(pos + i) % (sizeof(words) - 1)];
+			break;
+	}
+}
+
+static void pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if (n < 0)
+			err(EXIT_FAILURE, "write failed");
+		buf = (const uint8_t*) buf + n;
+		len -= n;
+		offset += n;
+	}
+}
+
+/* Write size bytes of the pattern at offset, padded to pad_to with 0xFF; returns the CRC. */
+static uint32_t write_segment(int fd, off_t offset, const struct segment_spec *spec, uint64_t pad_to, uint8_t *buf, uint64_t *rng) {
+	struct crc32_state crc;
+	uint64_t pos = 0;
+
+	crc32_init(&crc);
+	while (pos < pad_to) {
+		size_t n = pad_to - pos < FILL_CHUNK_SIZE ? pad_to - pos : FILL_CHUNK_SIZE;
+		size_t data = pos + n <= spec->size ? n : pos < spec->size ? spec->size - pos : 0;
+		fill_chunk(buf, data, pos, spec->fill, rng);
+		memset(buf + data, 0xFF, n - data);
+		crc32_update(&crc, buf, n);
+		pwrite_all(fd, buf, n, offset + pos);
+		pos += n;
+	}
+	return crc32_final(&crc);
+}
+
+static void write_mrvl(int fd, struct segment_spec *specs, int n, uint32_t ctime, uint64_t seed, uint8_t *buf) {
+	struct MarvellFirmware *fw = new_mrvl_firmware(NULL, n, NULL);
+	if (!fw)
+		errx(EXIT_FAILURE, "out of memory");
+	uint64_t rng = seed;
+	off_t offset = sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * n;
+
+	fw->header.ctime = ctime;
+	fw->header.elf_version = EV_CURRENT;
+	for (int i = 0; i < n; i++) {
+		struct MarvellSegmentHeader *sh = &fw->seghdrs[i];
+		sh->type = 2;
+		sh->offset = offset;
+		sh->size = (specs[i].size + 3) & ~(uint64_t) 3;
+		sh->vaddr = specs[i].vaddr;
+		sh->checksum = write_segment(fd, offset, &specs[i], sh->size, buf, &rng);
+		offset += sh->size;
+	}
+	pwrite_all(fd, &fw->header, sizeof(struct MarvellHeader), 0);
+	pwrite_all(fd, fw->seghdrs, sizeof(struct MarvellSegmentHeader) * n, sizeof(struct MarvellHeader));
+	free_mrvl_firmware(fw);
+}
+
+/* An ARM executable with one PT_LOAD program header per segment. */
+static void write_axf(int fd, struct segment_spec *specs, int n, uint64_t seed, uint8_t *buf) {
+	struct elf32_ehdr_le ehdr;
+	struct elf32_phdr_le phdrs[MRVL_MAX_SEGMENTS];
+	uint64_t rng = seed;
+	off_t offset = sizeof(ehdr) + sizeof(struct elf32_phdr_le) * n;
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memset(phdrs, 0, sizeof(phdrs));
+	for (int i = 0; i < n; i++) {
+		offset = (offset + 3) & ~(off_t) 3;
+		phdrs[i].p_type = PT_LOAD;
+		phdrs[i].p_offset = offset;
+		phdrs[i].p_vaddr = specs[i].vaddr;
+		phdrs[i].p_paddr = specs[i].vaddr;
+		phdrs[i].p_filesz = specs[i].size;
+		phdrs[i].p_memsz = specs[i].size;
+		phdrs[i].p_flags = PF_R | PF_W | PF_X;
+		phdrs[i].p_align = 4;
+		write_segment(fd, offset, &specs[i], specs[i].size, buf, &rng);
+		offset += specs[i].size;
+	}
+
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = ET_EXEC;
+	ehdr.e_machine = EM_ARM;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_entry = n >= 2 ? specs[1].vaddr + 1 : specs[0].vaddr + 1;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_flags = EF_ARM_EABI_VER5 | EF_ARM_ABI_FLOAT_SOFT;
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(struct elf32_phdr_le);
+	ehdr.e_phnum = n;
+	ehdr.e_shentsize = sizeof(struct elf32_shdr_le);
+	pwrite_all(fd, &ehdr, sizeof(ehdr), 0);
+	pwrite_all(fd, phdrs, sizeof(struct elf32_phdr_le) * n, sizeof(ehdr));
+}
+
+static void usage(const char *prog) {
+	errx(EXIT_FAILURE, "usage: %s [-a] [-t ctime] [-r seed] [-s size[@vaddr][:fill]]... output\n"
+		"  -a       write an AXF (ELF) file instead of a firmware image\n"
+		"  -s       add a segment; size takes K/M/G suffixes, up to %d segments\n"
+		"           fill: random (default), zero, ff, inc, text\n"
+		"  default: -s 16K -s 256K -s 4K", prog, MRVL_MAX_SEGMENTS);
+}
+
+int main(int argc, char** argv) {
+	struct segment_spec specs[MRVL_MAX_SEGMENTS];
+	int n = 0, axf = 0, opt, fd;
+	uint32_t ctime = 1505652059;
+	uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+	while ((opt = getopt(argc, argv, "as:t:r:")) != -1) {
+		switch (opt) {
+			case 'a':
+				axf = 1;
+				break;
+			case 's':
+				if (n == MRVL_MAX_SEGMENTS)
+					errx(EXIT_FAILURE, "at most %d segments", MRVL_MAX_SEGMENTS);
+				parse_segment(optarg, &specs[n++]);
+				break;
+			case 't':
+				ctime = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				seed = strtoull(optarg, NULL, 0) | 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+	if (n == 0) {
+		parse_segment("16K", &specs[n++]);
+		parse_segment("256K", &specs[n++]);
+		parse_segment("4K", &specs[n++]);
+	}
+
+	// default addresses: Code RAM, flash, SRAM, then consecutive
+	for (int i = 0; i < n; i++) {
+		if (specs[i].has_vaddr)
+			continue;
+		if (i < sizeof(default_vaddrs) / sizeof(default_vaddrs[0]))
+			specs[i].vaddr = default_vaddrs[i];
+		else
+			specs[i].vaddr = specs[i - 1].vaddr + ((specs[i - 1].size + 3) & ~(uint64_t) 3);
+	}
+
+	if ((fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		err(EXIT_FAILURE, "open %s failed", argv[optind]);
+	uint8_t *buf = malloc(FILL_CHUNK_SIZE);
+	if (!buf)
+		errx(EXIT_FAILURE, "failed to allocate buffer");
+
+	if (axf)
+		write_axf(fd, specs, n, seed, buf);
+	else
+		write_mrvl(fd, specs, n, ctime, seed, buf);
+
+	free(buf);
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "write failed");
+	return 0;
+}
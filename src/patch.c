@@ -0,0 +1,228 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _XOPEN_SOURCE 500
+
+#include "patch.h"
+#include "crc32.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Old data is read, and moved data copied, in pieces of this size. */
+#define PATCH_CHUNK_SIZE (64 * 1024)
+
+struct table {
+	struct MarvellHeader hdr;
+	struct MarvellSegmentHeader sh[MRVL_MAX_SEGMENTS];
+	uint64_t file_size;
+};
+
+
+static int pread_all(int fd, void *buf, size_t len, off_t offset) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pread(fd, (uint8_t*) buf + done, len - done, offset + done);
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pwrite(fd, (const uint8_t*) buf + done, len - done, offset + done);
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static const char* read_table(int fd, struct table *t) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return "not a regular file";
+	t->file_size = st.st_size;
+	if (pread_all(fd, &t->hdr, sizeof(t->hdr), 0) != 0)
+		return "file too small";
+	if (memcmp(t->hdr.mrvl, "MRVL", 4) != 0 || t->hdr.unknown1 != MRVL_HEADER_MAGIC2)
+		return "not a firmware image";
+	if (t->hdr.num_segments > MRVL_MAX_SEGMENTS)
+		return "too many segments";
+	if (pread_all(fd, t->sh, sizeof(struct MarvellSegmentHeader) * t->hdr.num_segments, sizeof(t->hdr)) != 0)
+		return "file too small";
+	for (int i = 0; i < t->hdr.num_segments; i++) {
+		if (t->sh[i].type != 2)
+			return "unexpected segment type";
+		if ((uint64_t) t->sh[i].offset + t->sh[i].size > t->file_size)
+			return "segment exceeds file size";
+	}
+	return NULL;
+}
+
+static int write_seghdr(int fd, const struct table *t, int i, struct MarvellPatchResult *res) {
+	res->bytes_written += sizeof(struct MarvellSegmentHeader);
+	return pwrite_all(fd, &t->sh[i], sizeof(struct MarvellSegmentHeader),
+		sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * i);
+}
+
+static void init_result(struct MarvellPatchResult *res, int segment, uint32_t checksum) {
+	memset(res, 0, sizeof(*res));
+	res->segment = segment;
+	res->old_checksum = checksum;
+}
+
+const char* mrvl_patch_range(int fd, uint32_t vaddr, const uint8_t *data, size_t len, struct MarvellPatchResult *res) {
+	uint8_t old[PATCH_CHUNK_SIZE];
+	struct table t;
+	const char *msg = read_table(fd, &t);
+	if (msg)
+		return msg;
+
+	int i;
+	for (i = 0; i < t.hdr.num_segments; i++) {
+		struct MarvellSegmentHeader *sh = &t.sh[i];
+		if (vaddr >= sh->vaddr && (uint64_t) vaddr - sh->vaddr + len <= sh->size)
+			break;
+	}
+	if (i == t.hdr.num_segments)
+		return "address range is not inside a single segment";
+	struct MarvellSegmentHeader *sh = &t.sh[i];
+	uint32_t start = vaddr - sh->vaddr;
+	init_result(res, i, sh->checksum);
+
+	// CRC of the difference, and writes of the bytes that differ
+	struct crc32_state crc;
+	crc32_init(&crc);
+	for (size_t done = 0; done < len; ) {
+		size_t n = len - done < PATCH_CHUNK_SIZE ? len - done : PATCH_CHUNK_SIZE;
+		off_t offset = (off_t) sh->offset + start + done;
+		if (pread_all(fd, old, n, offset) != 0)
+			return "cannot read segment data";
+		res->bytes_read += n;
+
+		size_t first = n, last = 0;
+		for (size_t k = 0; k < n; k++) {
+			old[k] ^= data[done + k];
+			if (old[k]) {
+				if (first == n)
+					first = k;
+				last = k;
+			}
+		}
+		crc32_update(&crc, old, n);
+		if (first < n) {
+			if (pwrite_all(fd, data + done + first, last - first + 1, offset + first) != 0)
+				return "cannot write segment data";
+			res->bytes_written += last - first + 1;
+		}
+		done += n;
+	}
+
+	uint32_t diff = crc32_combine(crc32_final(&crc), 0, sh->size - start - len);
+	res->checksum = sh->checksum ^ diff;
+	if (diff == 0)
+		return NULL;
+	sh->checksum = res->checksum;
+	if (write_seghdr(fd, &t, i, res) != 0)
+		return "cannot write segment header";
+	return NULL;
+}
+
+/* Move [from, file_size) up by shift bytes, last piece first. */
+static int move_up(int fd, uint64_t from, uint64_t file_size, uint64_t shift, struct MarvellPatchResult *res) {
+	uint8_t buf[PATCH_CHUNK_SIZE];
+	uint64_t end = file_size;
+	while (end > from) {
+		size_t n = end - from < PATCH_CHUNK_SIZE ? end - from : PATCH_CHUNK_SIZE;
+		end -= n;
+		if (pread_all(fd, buf, n, end) != 0 || pwrite_all(fd, buf, n, end + shift) != 0)
+			return -1;
+		res->bytes_read += n;
+		res->bytes_written += n;
+	}
+	return 0;
+}
+
+static int fill_ff(int fd, uint64_t from, uint64_t to, struct MarvellPatchResult *res) {
+	uint8_t buf[PATCH_CHUNK_SIZE];
+	memset(buf, 0xFF, sizeof(buf));
+	while (from < to) {
+		size_t n = to - from < PATCH_CHUNK_SIZE ? to - from : PATCH_CHUNK_SIZE;
+		if (pwrite_all(fd, buf, n, from) != 0)
+			return -1;
+		res->bytes_written += n;
+		from += n;
+	}
+	return 0;
+}
+
+const char* mrvl_patch_segment(int fd, int segment, const uint8_t *data, size_t len, struct MarvellPatchResult *res) {
+	struct table t;
+	const char *msg = read_table(fd, &t);
+	if (msg)
+		return msg;
+	if (segment < 0 || segment >= t.hdr.num_segments)
+		return "no such segment";
+	if (len > UINT32_MAX - 3)
+		return "segment too large";
+
+	struct MarvellSegmentHeader *sh = &t.sh[segment];
+	uint32_t size = (len + 3) & 0xfffffffc, old_size = sh->size;
+	init_result(res, segment, sh->checksum);
+
+	// the next segment in the file, which must not be overwritten
+	uint64_t limit = t.file_size;
+	for (int i = 0; i < t.hdr.num_segments; i++) {
+		if (i != segment && t.sh[i].offset >= sh->offset && t.sh[i].offset < limit)
+			limit = t.sh[i].offset;
+	}
+	if ((uint64_t) sh->offset + size > limit && limit < t.file_size) {
+		uint64_t shift = ((uint64_t) sh->offset + size - limit + 3) & ~(uint64_t) 3;
+		if (t.file_size + shift > UINT32_MAX)
+			return "image too large";
+		if (move_up(fd, limit, t.file_size, shift, res) != 0)
+			return "cannot move segment data";
+		for (int i = 0; i < t.hdr.num_segments; i++) {
+			if (i != segment && t.sh[i].offset >= limit) {
+				t.sh[i].offset += shift;
+				if (write_seghdr(fd, &t, i, res) != 0)
+					return "cannot write segment header";
+				res->relocated++;
+			}
+		}
+	}
+
+	struct crc32_state crc;
+	uint8_t pad[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+	crc32_init(&crc);
+	crc32_update(&crc, data, len);
+	crc32_update(&crc, pad, size - len);
+	if (pwrite_all(fd, data, len, sh->offset) != 0 || pwrite_all(fd, pad, size - len, (off_t) sh->offset + len) != 0)
+		return "cannot write segment data";
+	res->bytes_written += size;
+	// a shrunk segment leaves a gap, which holds 0xFF like every gap axf2firmware writes
+	if (old_size > size && fill_ff(fd, (uint64_t) sh->offset + size, (uint64_t) sh->offset + old_size, res) != 0)
+		return "cannot write segment data";
+
+	sh->size = size;
+	sh->checksum = res->checksum = crc32_final(&crc);
+	if (write_seghdr(fd, &t, segment, res) != 0)
+		return "cannot write segment header";
+	return NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+
+/*
+ * In-place patching of a firmware image open read-write on fd.
+ *
+ * Only the patched data and the affected segment headers are written. The
+ * segment CRC is linear in the data (no preset, no final inversion), so a
+ * range patch updates it from the XOR of old and new bytes:
+ *   crc' = crc ^ crc32_combine(crc(old ^ new), 0, bytes after the range)
+ * An existing checksum mismatch in the segment is therefore preserved.
+ */
+struct MarvellPatchResult {
+	int segment;
+	uint32_t old_checksum;
+	uint32_t checksum;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	int relocated;                        // segments moved to make room
+};
+
+/*
+ * Replace len bytes at vaddr, which must lie inside one segment. Unchanged
+ * bytes in the range are not rewritten. Returns NULL or an error message.
+ */
+extern const char* mrvl_patch_range(int fd, uint32_t vaddr, const uint8_t *data, size_t len, struct MarvellPatchResult *res);
+
+/*
+ * Replace the data of a segment, padded to 4 bytes with 0xFF. If it grows
+ * beyond the start of the next segment, everything from there to the end
+ * of the file moves up, keeping the layout axf2firmware would produce.
+ * If it shrinks, the bytes it no longer covers are set to 0xFF.
+ */
+extern const char* mrvl_patch_segment(int fd, int segment, const uint8_t *data, size_t len, struct MarvellPatchResult *res);
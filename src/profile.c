@@ -0,0 +1,441 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "profile.h"
+#include "stats.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_MASKS_AVX2
+#endif
+#ifdef __SSE2__
+#define HAVE_MASKS_SSE2
+#endif
+
+/* Segments are profiled in parts of about this size, one task each. */
+#define PROFILE_CHUNK_SIZE (4 * 1024 * 1024)
+
+struct mrvl_profiler {
+	uint32_t window;
+	uint32_t step;
+	double clog2c[];                      // c * log2(c), for c in 0..window
+};
+
+/* Runs of one byte value in a range of the segment. */
+struct runs {
+	uint32_t len;                         // of the range
+	uint32_t prefix;                      // run at its start
+	uint32_t suffix;                      // run at its end
+	uint32_t longest;
+	uint32_t start;                       // of the longest, within the range
+};
+
+struct block {
+	uint32_t histogram[256];
+	struct runs ff;
+	struct runs zero;
+};
+
+/* Blocks first..end-1 of a segment, one task each. */
+struct profile_part {
+	const struct mrvl_profiler *pr;
+	const uint8_t *p;
+	uint32_t len;                         // of the whole segment
+	uint32_t first;
+	uint32_t end;
+	struct mrvl_window *windows;          // of the whole segment
+	uint32_t histogram[256];
+	struct runs ff;
+	struct runs zero;
+	float min_entropy, max_entropy;
+	int failed;
+};
+
+/* Bit i of *ff and *zero is set if byte i is 0xFF or 0x00. */
+typedef void (*masks_fn)(const uint8_t *p, uint64_t *ff, uint64_t *zero);
+
+typedef void (*scan_fn)(const uint8_t *p, size_t len, struct runs *ff, struct runs *zero);
+
+static scan_fn scan;
+
+
+const char* mrvl_content_name(enum mrvl_content content) {
+	switch (content) {
+		case MRVL_CONTENT_CODE:       return "code";
+		case MRVL_CONTENT_PADDING:    return "padding";
+		case MRVL_CONTENT_COMPRESSED: return "compressed";
+		case MRVL_CONTENT_ENCRYPTED:  return "encrypted";
+	}
+	return "unknown";
+}
+
+struct mrvl_profiler* mrvl_profiler_new(uint32_t window, uint32_t step, const char **errmsg) {
+	if (window == 0)
+		window = MRVL_PROFILE_WINDOW;
+	if (step == 0)
+		step = window;
+	if (window > MRVL_PROFILE_MAX_WINDOW || window % step != 0 || window / step > MRVL_PROFILE_MAX_STEPS) {
+		*errmsg = "window must be at most 1M, and a multiple of at most 64 steps";
+		return NULL;
+	}
+	struct mrvl_profiler *pr = malloc(sizeof(*pr) + sizeof(double) * (window + 1));
+	if (!pr) {
+		*errmsg = "out of memory";
+		return NULL;
+	}
+	pr->window = window;
+	pr->step = step;
+	pr->clog2c[0] = 0;
+	for (uint32_t c = 1; c <= window; c++)
+		pr->clog2c[c] = c * log2(c);
+	return pr;
+}
+
+void mrvl_profiler_free(struct mrvl_profiler *pr) {
+	free(pr);
+}
+
+void mrvl_profile_free(struct mrvl_segment_profile *prof) {
+	free(prof->windows);
+	prof->windows = NULL;
+}
+
+/* Runs of a in front of runs of b; on ties the earlier run wins. */
+static struct runs merge_runs(struct runs a, struct runs b) {
+	struct runs r;
+	r.len = a.len + b.len;
+	r.prefix = a.prefix == a.len ? a.len + b.prefix : a.prefix;
+	r.suffix = b.suffix == b.len ? b.len + a.suffix : b.suffix;
+	r.longest = a.longest;
+	r.start = a.start;
+	if (a.suffix + b.prefix > r.longest) {
+		r.longest = a.suffix + b.prefix;
+		r.start = a.len - a.suffix;
+	}
+	if (b.longest > r.longest) {
+		r.longest = b.longest;
+		r.start = a.len + b.start;
+	}
+	return r;
+}
+
+/* Runs of set bits in the low n bits of m. */
+static inline struct runs mask_runs(uint64_t m, unsigned n) {
+	uint64_t valid = n == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1;
+	struct runs r = { n, 0, 0, 0, 0 };
+	m &= valid;
+	if (m == 0)
+		return r;
+	if (m == valid) {
+		r.prefix = r.suffix = r.longest = n;
+		return r;
+	}
+	r.prefix = __builtin_ctzll(~m);
+	r.suffix = n - 1 - (63 - __builtin_clzll(~m & valid));
+	// after k steps, bit i is set if bits i..i+k are
+	uint64_t last = m;
+	while (m) {
+		last = m;
+		m &= m >> 1;
+		r.longest++;
+	}
+	r.start = __builtin_ctzll(last);
+	return r;
+}
+
+static inline void masks_generic(const uint8_t *p, unsigned n, uint64_t *ff, uint64_t *zero) {
+	uint64_t f = 0, z = 0;
+	for (unsigned i = 0; i < n; i++) {
+		f |= (uint64_t) (p[i] == 0xff) << i;
+		z |= (uint64_t) (p[i] == 0x00) << i;
+	}
+	*ff = f;
+	*zero = z;
+}
+
+static void masks64_generic(const uint8_t *p, uint64_t *ff, uint64_t *zero) {
+	masks_generic(p, 64, ff, zero);
+}
+
+/*
+ * The scanner is written once and instantiated per mask function, which
+ * is inlined into each copy; the tail of a block is done byte by byte.
+ */
+static inline __attribute__((always_inline))
+void scan_with(masks_fn masks, const uint8_t *p, size_t len, struct runs *ff, struct runs *zero) {
+	struct runs f = { 0 }, z = { 0 };
+	uint64_t mf, mz;
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		masks(p + i, &mf, &mz);
+		f = merge_runs(f, mask_runs(mf, 64));
+		z = merge_runs(z, mask_runs(mz, 64));
+	}
+	if (i < len) {
+		masks_generic(p + i, len - i, &mf, &mz);
+		f = merge_runs(f, mask_runs(mf, len - i));
+		z = merge_runs(z, mask_runs(mz, len - i));
+	}
+	*ff = f;
+	*zero = z;
+}
+
+static void scan_generic(const uint8_t *p, size_t len, struct runs *ff, struct runs *zero) {
+	scan_with(masks64_generic, p, len, ff, zero);
+}
+
+#ifdef HAVE_MASKS_SSE2
+static inline __attribute__((always_inline)) void masks64_sse2(const uint8_t *p, uint64_t *ff, uint64_t *zero) {
+	const __m128i ones = _mm_set1_epi8(-1), zeros = _mm_setzero_si128();
+	uint64_t f = 0, z = 0;
+	for (int i = 0; i < 4; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (p + 16 * i));
+		f |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) << (16 * i);
+		z |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, zeros)) << (16 * i);
+	}
+	*ff = f;
+	*zero = z;
+}
+
+static void scan_sse2(const uint8_t *p, size_t len, struct runs *ff, struct runs *zero) {
+	scan_with(masks64_sse2, p, len, ff, zero);
+}
+#endif
+
+#ifdef HAVE_MASKS_AVX2
+__attribute__((target("avx2")))
+static inline void masks64_avx2(const uint8_t *p, uint64_t *ff, uint64_t *zero) {
+	const __m256i ones = _mm256_set1_epi8(-1), zeros = _mm256_setzero_si256();
+	__m256i lo = _mm256_loadu_si256((const __m256i*) p);
+	__m256i hi = _mm256_loadu_si256((const __m256i*) (p + 32));
+	*ff = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, ones)) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, ones)) << 32;
+	*zero = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zeros)) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zeros)) << 32;
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const uint8_t *p, size_t len, struct runs *ff, struct runs *zero) {
+	scan_with(masks64_avx2, p, len, ff, zero);
+}
+#endif
+
+__attribute__((constructor))
+static void profile_setup(void) {
+	scan = scan_generic;
+#ifdef HAVE_MASKS_SSE2
+	scan = scan_sse2;
+#endif
+#ifdef HAVE_MASKS_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+#endif
+}
+
+/*
+ * Four counter tables, so that repeated bytes do not serialize on one
+ * counter; they are summed at the end.
+ */
+static void histogram(const uint8_t *p, size_t len, uint32_t *out) {
+	uint32_t c[4][256];
+	size_t i = 0;
+	memset(c, 0, sizeof(c));
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		c[0][w & 0xff]++;
+		c[1][w >> 8 & 0xff]++;
+		c[2][w >> 16 & 0xff]++;
+		c[3][w >> 24 & 0xff]++;
+		c[0][w >> 32 & 0xff]++;
+		c[1][w >> 40 & 0xff]++;
+		c[2][w >> 48 & 0xff]++;
+		c[3][w >> 56]++;
+	}
+	for (; i < len; i++)
+		c[0][p[i]]++;
+	for (int k = 0; k < 256; k++)
+		out[k] = c[0][k] + c[1][k] + c[2][k] + c[3][k];
+}
+
+static enum mrvl_content classify(const uint32_t *h, uint32_t n, double entropy, double chi2) {
+	if (n == 0)
+		return MRVL_CONTENT_CODE;
+	if ((uint64_t) h[0x00] + h[0xff] >= n - n / 10)
+		return MRVL_CONTENT_PADDING;
+	double max = n < 256 ? log2(n) : 8;
+	if (entropy < 0.9 * max)
+		return MRVL_CONTENT_CODE;
+	// random bytes give chi2 ~ 255 +- 22.6; only meaningful for >= 5 per bin
+	if (n >= 5 * 256 && chi2 < 255 + 4 * 22.6)
+		return MRVL_CONTENT_ENCRYPTED;
+	return MRVL_CONTENT_COMPRESSED;
+}
+
+static void window_stats(const struct mrvl_profiler *pr, const uint32_t *h, uint32_t n, struct mrvl_window *w) {
+	double s = 0, sq = 0;
+	for (int k = 0; k < 256; k++) {
+		s += pr->clog2c[h[k]];
+		sq += (double) h[k] * h[k];
+	}
+	w->entropy = n ? log2(n) - s / n : 0;
+	w->content = classify(h, n, w->entropy, n ? sq * 256 / n - n : 0);
+}
+
+/*
+ * Emits windows first..end-1 and totals blocks first..end-1; the last
+ * windows read up to steps-1 blocks beyond.
+ */
+static void profile_part(void *arg) {
+	struct profile_part *part = arg;
+	const struct mrvl_profiler *pr = part->pr;
+	uint32_t step = pr->step, steps = pr->window / step;
+	uint32_t blocks = part->len / step + (part->len % step != 0);
+	uint32_t windows = blocks <= steps ? 1 : blocks - steps + 1;
+	uint32_t last = part->end < windows ? part->end : windows;
+	uint32_t counts[256] = { 0 };
+
+	part->min_entropy = 8;
+	struct block *ring = malloc(sizeof(struct block) * steps);
+	if (!ring) {
+		part->failed = 1;
+		return;
+	}
+	for (uint32_t j = part->first; j < blocks; j++) {
+		struct block *b = &ring[j % steps];
+		uint32_t offset = j * step, n = part->len - offset < step ? part->len - offset : step;
+		if (j >= part->end && j + 1 >= last + steps)
+			break;
+		scan(part->p + offset, n, &b->ff, &b->zero);
+		if (b->ff.longest == n || b->zero.longest == n) {
+			memset(b->histogram, 0, sizeof(b->histogram));
+			b->histogram[b->ff.longest == n ? 0xff : 0x00] = n;
+		} else {
+			histogram(part->p + offset, n, b->histogram);
+		}
+		for (int k = 0; k < 256; k++)
+			counts[k] += b->histogram[k];
+		if (j < part->end) {
+			for (int k = 0; k < 256; k++)
+				part->histogram[k] += b->histogram[k];
+			part->ff = merge_runs(part->ff, b->ff);
+			part->zero = merge_runs(part->zero, b->zero);
+		}
+
+		// the window of blocks i..j is complete, or the data ends
+		if (j + 1 < steps && j + 1 < blocks)
+			continue;
+		uint32_t i = j + 1 >= steps ? j + 1 - steps : 0;
+		if (i < part->first || i >= last)
+			continue;
+		struct mrvl_window *w = &part->windows[i];
+		struct runs wff = { 0 }, wzero = { 0 };
+		for (uint32_t k = i; k <= j; k++) {
+			wff = merge_runs(wff, ring[k % steps].ff);
+			wzero = merge_runs(wzero, ring[k % steps].zero);
+		}
+		w->offset = i * step;
+		w->size = offset + n - w->offset;
+		w->ff_run = wff.longest;
+		w->zero_run = wzero.longest;
+		window_stats(pr, counts, w->size, w);
+		if (w->entropy < part->min_entropy)
+			part->min_entropy = w->entropy;
+		if (w->entropy > part->max_entropy)
+			part->max_entropy = w->entropy;
+		for (int k = 0; k < 256; k++)
+			counts[k] -= ring[i % steps].histogram[k];
+	}
+	free(ring);
+}
+
+int mrvl_profile_segment(const struct mrvl_profiler *pr, const uint8_t *p, uint32_t len, struct threadpool *pool, struct mrvl_segment_profile *prof) {
+	MRVL_STATS_START(t);
+	uint32_t step = pr->step, steps = pr->window / step;
+	uint32_t blocks = len / step + (len % step != 0);
+	uint32_t per_part = PROFILE_CHUNK_SIZE > step ? PROFILE_CHUNK_SIZE / step : 1;
+	uint32_t num_parts = blocks / per_part + (blocks % per_part != 0);
+	memset(prof, 0, sizeof(*prof));
+	prof->size = len;
+	prof->num_windows = blocks == 0 ? 0 : blocks <= steps ? 1 : blocks - steps + 1;
+	prof->windows = malloc(sizeof(struct mrvl_window) * (prof->num_windows ? prof->num_windows : 1));
+	struct profile_part *parts = calloc(num_parts ? num_parts : 1, sizeof(struct profile_part));
+	if (!prof->windows || !parts) {
+		free(parts);
+		mrvl_profile_free(prof);
+		return -1;
+	}
+
+	struct taskgroup group = TASKGROUP_INIT;
+	for (uint32_t k = 0; k < num_parts; k++) {
+		struct profile_part *part = &parts[k];
+		part->pr = pr;
+		part->p = p;
+		part->len = len;
+		part->windows = prof->windows;
+		part->first = k * per_part;
+		part->end = blocks - part->first < per_part ? blocks : part->first + per_part;
+		if (pool && num_parts > 1)
+			threadpool_submit(pool, &group, profile_part, part);
+		else
+			profile_part(part);
+	}
+	if (pool && num_parts > 1)
+		threadpool_wait(pool, &group);
+
+	// parts are merged in order, which gives the runs their offsets
+	struct runs ff = { 0 }, zero = { 0 };
+	int failed = 0;
+	prof->min_entropy = num_parts ? 8 : 0;
+	for (uint32_t k = 0; k < num_parts; k++) {
+		struct profile_part *part = &parts[k];
+		for (int b = 0; b < 256; b++)
+			prof->histogram[b] += part->histogram[b];
+		ff = merge_runs(ff, part->ff);
+		zero = merge_runs(zero, part->zero);
+		if (part->min_entropy < prof->min_entropy)
+			prof->min_entropy = part->min_entropy;
+		if (part->max_entropy > prof->max_entropy)
+			prof->max_entropy = part->max_entropy;
+		failed |= part->failed;
+	}
+	free(parts);
+	if (failed) {
+		mrvl_profile_free(prof);
+		return -1;
+	}
+
+	double s = 0, sq = 0;
+	for (int k = 0; k < 256; k++) {
+		uint32_t c = prof->histogram[k];
+		if (c)
+			s += c * log2(c);
+		sq += (double) c * c;
+	}
+	prof->entropy = len ? log2(len) - s / len : 0;
+	prof->chi2 = len ? sq * 256 / len - len : 0;
+	prof->content = classify(prof->histogram, len, prof->entropy, prof->chi2);
+	prof->ff_run = ff.longest;
+	prof->ff_run_offset = ff.start;
+	prof->zero_run = zero.longest;
+	prof->zero_run_offset = zero.start;
+	MRVL_STATS_STOP(t, MRVL_PHASE_PROFILE, len);
+	return 0;
+}
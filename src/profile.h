@@ -0,0 +1,89 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+/*
+ * Content profile of a segment: byte histogram, Shannon entropy over
+ * sliding windows, and the longest runs of 0xFF and 0x00 bytes.
+ *
+ * A segment is cut into blocks of `step` bytes, each read once: a
+ * histogram with four interleaved counter tables, and the run lengths from
+ * 64-byte compare masks (SSE2/AVX2 where available). A window is `window`
+ * bytes starting every `step` bytes; its counts are the sum of its blocks,
+ * kept up to date by adding the newest and subtracting the oldest block.
+ *
+ * The content class is a heuristic: mostly 0x00/0xFF is padding, high
+ * entropy with a flat histogram (chi-square test) looks encrypted, high
+ * entropy otherwise compressed, and everything else is code or data.
+ */
+#define MRVL_PROFILE_WINDOW   4096        // default window size
+#define MRVL_PROFILE_MAX_WINDOW (1024 * 1024)
+#define MRVL_PROFILE_MAX_STEPS 64         // steps per window
+
+enum mrvl_content {
+	MRVL_CONTENT_CODE,                    // code or plain data
+	MRVL_CONTENT_PADDING,                 // mostly 0xFF or 0x00
+	MRVL_CONTENT_COMPRESSED,
+	MRVL_CONTENT_ENCRYPTED,               // or random
+};
+
+struct mrvl_window {
+	uint32_t offset;                      // in the segment
+	uint32_t size;                        // window size, less at the end
+	float entropy;                        // bits per byte
+	uint32_t ff_run;                      // longest run within the window
+	uint32_t zero_run;
+	uint8_t content;                      // enum mrvl_content
+};
+
+struct mrvl_segment_profile {
+	uint32_t histogram[256];
+	uint32_t size;
+	double entropy;                       // bits per byte, of the whole segment
+	double chi2;                          // against uniformly distributed bytes
+	float min_entropy, max_entropy;       // over the windows
+	uint32_t ff_run, ff_run_offset;       // longest run and where it starts
+	uint32_t zero_run, zero_run_offset;
+	enum mrvl_content content;
+	uint32_t num_windows;
+	struct mrvl_window *windows;          // malloc'ed
+};
+
+/* Window and step sizes and their lookup table, shared by threads. */
+struct mrvl_profiler;
+
+/*
+ * window is at most MRVL_PROFILE_MAX_WINDOW and a multiple of step, of at
+ * most MRVL_PROFILE_MAX_STEPS steps; window 0 selects MRVL_PROFILE_WINDOW,
+ * step 0 the window size. Returns NULL and an error message in *errmsg
+ * otherwise.
+ */
+extern struct mrvl_profiler* mrvl_profiler_new(uint32_t window, uint32_t step, const char **errmsg);
+extern void mrvl_profiler_free(struct mrvl_profiler *pr);
+
+/*
+ * Profile len bytes at p. Segments of more than a few MiB are split into
+ * parts on pool, if given. Returns 0, or -1 if out of memory.
+ */
+extern int mrvl_profile_segment(const struct mrvl_profiler *pr, const uint8_t *p, uint32_t len, struct threadpool *pool, struct mrvl_segment_profile *prof);
+extern void mrvl_profile_free(struct mrvl_segment_profile *prof);
+
+extern const char* mrvl_content_name(enum mrvl_content content);
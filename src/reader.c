@@ -0,0 +1,633 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "reader.h"
+#include "libmrvlfw.h"
+#include "decompress.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* Header and the longest segment table. */
+#define HEAD_SIZE (sizeof(struct MarvellHeader) + sizeof(struct MarvellSegmentHeader) * MRVL_MAX_SEGMENTS)
+
+enum op_kind {
+	OP_OPEN,
+	OP_STAT,
+	OP_READ,
+};
+
+struct image;
+
+struct op {
+	enum op_kind kind;
+	struct image *img;
+	uint8_t *buf;                         // OP_READ
+	uint32_t len;
+	uint64_t offset;
+	int64_t res;                          // fd, 0 or bytes read; -errno on failure
+	struct op *next;
+};
+
+enum stage {
+	STAGE_OPEN,                           // open and stat
+	STAGE_HEADER,
+	STAGE_SEGMENTS,
+};
+
+struct image {
+	struct mrvl_read rd;
+	mrvl_read_done done;
+	enum stage stage;
+	int pending;                          // operations of the current stage
+	int nops;
+	int fd;
+	int regular;
+	uint64_t size;
+#ifdef HAVE_IO_URING
+	struct statx stx;
+#endif
+	uint8_t head[HEAD_SIZE];
+	char errbuf[128];
+	struct op ops[3 + MRVL_MAX_SEGMENTS]; // open, stat, header, segments
+	uint64_t started;                     // for MRVL_PHASE_READ
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned to_submit;
+};
+#endif
+
+/* I/O threads of the pread backend. */
+struct io_threads {
+	pthread_t *threads;
+	unsigned count;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct op *queue, *queue_tail;        // issued, not yet picked up
+	struct op *completed;
+	int stop;
+};
+
+struct mrvl_reader {
+	enum mrvl_reader_backend backend;
+	unsigned depth;
+	unsigned inflight;
+	unsigned images;                      // added and not yet done
+	struct op *queue, *queue_tail;        // waiting for a slot
+	struct mrvl_reader_stats stats;
+	uint64_t first, last;                 // ns
+#ifdef HAVE_IO_URING
+	struct uring ring;
+#endif
+	struct io_threads io;
+};
+
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void push(struct op **head, struct op **tail, struct op *op) {
+	op->next = NULL;
+	if (*tail)
+		(*tail)->next = op;
+	else
+		*head = op;
+	*tail = op;
+}
+
+/* Run an operation on the calling thread, for the pread backend. */
+static void run_op(struct op *op) {
+	struct image *img = op->img;
+	struct stat st;
+	ssize_t n;
+
+	switch (op->kind) {
+		case OP_OPEN:
+			op->res = open(img->rd.path, O_RDONLY | O_CLOEXEC);
+			break;
+		case OP_STAT:
+			op->res = stat(img->rd.path, &st);
+			if (op->res == 0) {
+				img->size = st.st_size;
+				img->regular = S_ISREG(st.st_mode);
+			}
+			break;
+		case OP_READ:
+			while ((n = pread(img->fd, op->buf, op->len, op->offset)) < 0 && errno == EINTR)
+				;
+			op->res = n;
+			break;
+	}
+	if (op->res < 0)
+		op->res = -errno;
+}
+
+static void* io_thread(void *arg) {
+	struct io_threads *io = arg;
+	pthread_mutex_lock(&io->lock);
+	for (;;) {
+		while (!io->queue && !io->stop)
+			pthread_cond_wait(&io->work, &io->lock);
+		if (!io->queue)
+			break;
+		struct op *op = io->queue;
+		if (!(io->queue = op->next))
+			io->queue_tail = NULL;
+		pthread_mutex_unlock(&io->lock);
+		run_op(op);
+		pthread_mutex_lock(&io->lock);
+		op->next = io->completed;
+		io->completed = op;
+		pthread_cond_signal(&io->done);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+static int io_threads_start(struct io_threads *io, unsigned count) {
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->work, NULL);
+	pthread_cond_init(&io->done, NULL);
+	if (!(io->threads = calloc(count, sizeof(pthread_t))))
+		return -1;
+	for (; io->count < count; io->count++) {
+		if (pthread_create(&io->threads[io->count], NULL, io_thread, io) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void io_threads_stop(struct io_threads *io) {
+	pthread_mutex_lock(&io->lock);
+	io->stop = 1;
+	pthread_cond_broadcast(&io->work);
+	pthread_mutex_unlock(&io->lock);
+	for (unsigned i = 0; i < io->count; i++)
+		pthread_join(io->threads[i], NULL);
+	free(io->threads);
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->work);
+	pthread_cond_destroy(&io->done);
+}
+
+#ifdef HAVE_IO_URING
+static int uring_setup(struct uring *ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_ring_size > ring->sq_ring_size)
+		ring->sq_ring_size = ring->cq_ring_size;
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	return 0;
+
+fail:;
+	int saved = errno;
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	close(ring->fd);
+	errno = saved;
+	return -1;
+}
+
+static void uring_free(struct uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/* The reader never has more operations in flight than the ring has entries. */
+static void uring_queue(struct uring *ring, struct op *op) {
+	unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	struct image *img = op->img;
+
+	memset(sqe, 0, sizeof(*sqe));
+	switch (op->kind) {
+		case OP_OPEN:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) img->rd.path;
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			break;
+		case OP_STAT:
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) img->rd.path;
+			sqe->len = STATX_TYPE | STATX_SIZE;
+			sqe->addr2 = (uintptr_t) &img->stx;
+			break;
+		case OP_READ:
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = img->fd;
+			sqe->addr = (uintptr_t) op->buf;
+			sqe->len = op->len;
+			sqe->off = op->offset;
+			break;
+	}
+	sqe->user_data = (uintptr_t) op;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+static int uring_enter(struct uring *ring, unsigned min_complete) {
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0);
+		if (n >= 0) {
+			ring->to_submit -= n;
+			return 0;
+		}
+		if (errno == EINTR)
+			continue;
+		// completions must be reaped before more can be submitted
+		return errno == EAGAIN || errno == EBUSY ? 0 : -1;
+	}
+}
+
+/* Returns the completed operations, most recent first. */
+static struct op* uring_reap(struct uring *ring) {
+	unsigned head = *ring->cq_head, tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	struct op *done = NULL;
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		struct op *op = (struct op*) (uintptr_t) cqe->user_data;
+		op->res = cqe->res;
+		if (op->kind == OP_STAT && op->res == 0) {
+			op->img->size = op->img->stx.stx_size;
+			op->img->regular = S_ISREG(op->img->stx.stx_mode);
+		}
+		op->next = done;
+		done = op;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+#endif
+
+struct mrvl_reader* mrvl_reader_new(enum mrvl_reader_backend backend, unsigned depth, const char **errmsg) {
+	if (depth == 0)
+		depth = MRVL_READER_DEPTH;
+	if (depth > MRVL_READER_MAX_DEPTH) {
+		*errmsg = "queue depth too large";
+		return NULL;
+	}
+	struct mrvl_reader *r = calloc(1, sizeof(*r));
+	if (!r) {
+		*errmsg = "out of memory";
+		return NULL;
+	}
+	r->depth = depth;
+
+#ifdef HAVE_IO_URING
+	if (backend != MRVL_READER_PREAD) {
+		if (uring_setup(&r->ring, depth) == 0) {
+			r->backend = MRVL_READER_URING;
+			return r;
+		}
+		if (backend == MRVL_READER_URING) {
+			*errmsg = "io_uring is not available";
+			free(r);
+			return NULL;
+		}
+	}
+#else
+	if (backend == MRVL_READER_URING) {
+		*errmsg = "built without io_uring";
+		free(r);
+		return NULL;
+	}
+#endif
+	r->backend = MRVL_READER_PREAD;
+	if (io_threads_start(&r->io, depth) != 0) {
+		*errmsg = "cannot start I/O threads";
+		mrvl_reader_free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void mrvl_reader_free(struct mrvl_reader *r) {
+	if (!r)
+		return;
+#ifdef HAVE_IO_URING
+	if (r->backend == MRVL_READER_URING)
+		uring_free(&r->ring);
+#endif
+	if (r->backend == MRVL_READER_PREAD)
+		io_threads_stop(&r->io);
+	free(r);
+}
+
+const char* mrvl_reader_name(const struct mrvl_reader *r) {
+	return r->backend == MRVL_READER_URING ? "io_uring" : "pread";
+}
+
+unsigned mrvl_reader_depth(const struct mrvl_reader *r) {
+	return r->depth;
+}
+
+void mrvl_reader_stats(const struct mrvl_reader *r, struct mrvl_reader_stats *st) {
+	*st = r->stats;
+	st->seconds = r->last > r->first ? (r->last - r->first) / 1e9 : 0;
+}
+
+static void queue_op(struct mrvl_reader *r, struct image *img, enum op_kind kind, uint8_t *buf, uint32_t len, uint64_t offset) {
+	struct op *op = &img->ops[img->nops++];
+	img->pending++;
+	op->kind = kind;
+	op->img = img;
+	op->buf = buf;
+	op->len = len;
+	op->offset = offset;
+	push(&r->queue, &r->queue_tail, op);
+}
+
+void mrvl_reader_add(struct mrvl_reader *r, const char *path, mrvl_read_done done, void *arg) {
+	struct image *img = calloc(1, sizeof(*img));
+	if (!img) {
+		struct mrvl_read rd = { path, arg, NULL, MRVL_ERR_NOMEM, "out of memory", 0 };
+		done(&rd);
+		return;
+	}
+	img->rd.path = path;
+	img->rd.arg = arg;
+	img->rd.status = MRVL_OK;
+	img->done = done;
+	img->fd = -1;
+	img->stage = STAGE_OPEN;
+	MRVL_STATS_STAMP(img->started);
+	queue_op(r, img, OP_OPEN, NULL, 0, 0);
+	queue_op(r, img, OP_STAT, NULL, 0, 0);
+	r->images++;
+}
+
+/* The first failure of an image is the one reported. */
+static void fail(struct image *img, int status, const char *fmt, const char *detail) {
+	if (img->rd.status != MRVL_OK || img->rd.unsupported)
+		return;
+	img->rd.status = status;
+	snprintf(img->errbuf, sizeof(img->errbuf), fmt, detail);
+	img->rd.error = img->errbuf;
+}
+
+static void finish(struct mrvl_reader *r, struct image *img) {
+	if (img->fd >= 0)
+		close(img->fd);
+	if (img->rd.status != MRVL_OK && img->rd.fw) {
+		free_mrvl_firmware(img->rd.fw);
+		img->rd.fw = NULL;
+	}
+	if (img->rd.fw)
+		MRVL_STATS_STOP(img->started, MRVL_PHASE_READ, img->rd.fw->image_size);
+	r->images--;
+	r->stats.images++;
+	img->done(&img->rd);
+	free(img);
+}
+
+/* Header and segment table read: check them and read the segments. */
+static void start_segments(struct mrvl_reader *r, struct image *img) {
+	uint32_t sizes[MRVL_MAX_SEGMENTS];
+	enum mrvl_codec codec = mrvl_detect_codec(img->head, img->size < HEAD_SIZE ? img->size : HEAD_SIZE);
+	if (codec != MRVL_CODEC_NONE) {
+		fail(img, MRVL_ERR_FORMAT, "compressed with %s", mrvl_codec_name(codec));
+		img->rd.unsupported = 1;
+		return;
+	}
+	// the table has been read whole if it fits the file, and segments are checked against the file size
+	const char *msg = check_marvel_firmware(img->head, img->size);
+	if (msg) {
+		fail(img, MRVL_ERR_FORMAT, "%s", msg);
+		return;
+	}
+
+	const struct MarvellHeader *hdr = (const struct MarvellHeader*) img->head;
+	const struct MarvellSegmentHeader *sh = (const struct MarvellSegmentHeader*) (img->head + sizeof(*hdr));
+	for (uint32_t i = 0; i < hdr->num_segments; i++)
+		sizes[i] = sh[i].size;
+	struct MarvellFirmware *fw = new_mrvl_firmware(NULL, hdr->num_segments, sizes);
+	if (!fw) {
+		fail(img, MRVL_ERR_NOMEM, "%s", "out of memory");
+		return;
+	}
+	fw->header = *hdr;
+	memcpy(fw->seghdrs, sh, sizeof(struct MarvellSegmentHeader) * hdr->num_segments);
+	fw->image_size = img->size;
+	img->rd.fw = fw;
+
+	img->stage = STAGE_SEGMENTS;
+	for (uint32_t i = 0; i < hdr->num_segments; i++) {
+		if (sizes[i] > 0)
+			queue_op(r, img, OP_READ, fw->segments[i], sizes[i], sh[i].offset);
+	}
+}
+
+static void complete(struct mrvl_reader *r, struct op *op) {
+	struct image *img = op->img;
+	r->inflight--;
+	r->stats.ops++;
+	if (op->kind == OP_READ) {
+		r->stats.reads++;
+		if (op->res > 0)
+			r->stats.bytes += op->res;
+	}
+
+	switch (op->kind) {
+		case OP_OPEN:
+			// says more than the stat failure that usually comes with it
+			if (op->res < 0 && img->rd.status == MRVL_ERR_IO)
+				img->rd.status = MRVL_OK;
+			if (op->res < 0)
+				fail(img, MRVL_ERR_IO, "open failed: %s", strerror(-op->res));
+			else
+				img->fd = op->res;
+			break;
+		case OP_STAT:
+			if (op->res < 0)
+				fail(img, MRVL_ERR_IO, "stat failed: %s", strerror(-op->res));
+			break;
+		case OP_READ:
+			if (op->res < 0) {
+				fail(img, MRVL_ERR_IO, "read failed: %s", strerror(-op->res));
+			} else if (op->res == 0) {
+				fail(img, MRVL_ERR_TRUNCATED, "%s", mrvl_strerror(MRVL_ERR_TRUNCATED));
+			} else if (op->res < op->len) {
+				// short read: the rest is another operation of the same stage
+				op->buf += op->res;
+				op->len -= op->res;
+				op->offset += op->res;
+				push(&r->queue, &r->queue_tail, op);
+				return;
+			}
+			break;
+	}
+	if (--img->pending > 0)
+		return;
+
+	if (img->rd.status == MRVL_OK && !img->rd.unsupported) {
+		switch (img->stage) {
+			case STAGE_OPEN:
+				if (!img->regular) {
+					fail(img, MRVL_ERR_IO, "%s", "not a regular file");
+					img->rd.unsupported = 1;
+				} else if (img->size < sizeof(struct MarvellHeader)) {
+					fail(img, MRVL_ERR_FORMAT, "%s", "truncated firmware header");
+				} else {
+					img->stage = STAGE_HEADER;
+					queue_op(r, img, OP_READ, img->head, img->size < HEAD_SIZE ? img->size : HEAD_SIZE, 0);
+				}
+				break;
+			case STAGE_HEADER:
+				start_segments(r, img);
+				break;
+			case STAGE_SEGMENTS:
+				break;
+		}
+		if (img->pending > 0)
+			return;
+	}
+	finish(r, img);
+}
+
+/* Move queued operations into free slots. */
+static void issue(struct mrvl_reader *r) {
+	struct op *batch = NULL, *batch_tail = NULL;
+	if (r->queue && !r->first)
+		r->first = now_ns();
+	while (r->queue && r->inflight < r->depth) {
+		struct op *op = r->queue;
+		if (!(r->queue = op->next))
+			r->queue_tail = NULL;
+		r->inflight++;
+#ifdef HAVE_IO_URING
+		if (r->backend == MRVL_READER_URING) {
+			uring_queue(&r->ring, op);
+			continue;
+		}
+#endif
+		push(&batch, &batch_tail, op);
+	}
+	if (batch) {
+		pthread_mutex_lock(&r->io.lock);
+		if (r->io.queue_tail)
+			r->io.queue_tail->next = batch;
+		else
+			r->io.queue = batch;
+		r->io.queue_tail = batch_tail;
+		pthread_cond_broadcast(&r->io.work);
+		pthread_mutex_unlock(&r->io.lock);
+	}
+}
+
+int mrvl_reader_poll(struct mrvl_reader *r, int wait) {
+	if (r->images == 0)
+		return 0;
+	uint64_t before = r->stats.images;
+	issue(r);
+
+	struct op *done = NULL;
+#ifdef HAVE_IO_URING
+	if (r->backend == MRVL_READER_URING) {
+		if (uring_enter(&r->ring, wait && r->inflight > 0) != 0)
+			return -1;
+		done = uring_reap(&r->ring);
+	}
+#endif
+	if (r->backend == MRVL_READER_PREAD) {
+		pthread_mutex_lock(&r->io.lock);
+		while (wait && r->inflight > 0 && !r->io.completed)
+			pthread_cond_wait(&r->io.done, &r->io.lock);
+		done = r->io.completed;
+		r->io.completed = NULL;
+		pthread_mutex_unlock(&r->io.lock);
+	}
+
+	while (done) {
+		struct op *next = done->next;
+		complete(r, done);
+		done = next;
+	}
+	if (r->stats.images > before || r->inflight == 0)
+		r->last = now_ns();
+	return r->stats.images - before;
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+
+/*
+ * Asynchronous reader for many images, e.g. verifying an archive.
+ *
+ * Each image is read in three steps of I/O operations: open and stat, the
+ * header and segment table, then one read per segment to its exact offset
+ * into a heap-backed MarvellFirmware. Up to `depth` operations of all
+ * images are in flight at once, so storage with high latency but many
+ * queues stays busy.
+ *
+ * The io_uring backend (HAVE_IO_URING) submits the operations to the
+ * kernel; the pread backend runs them on `depth` I/O threads. AUTO uses
+ * io_uring when the kernel allows it.
+ *
+ * A reader is driven by one thread: mrvl_reader_poll() issues queued
+ * operations, reaps completions and calls the callback of every image
+ * that is done, on that thread.
+ */
+#define MRVL_READER_DEPTH      64         // default queue depth
+#define MRVL_READER_MAX_DEPTH  4096
+
+enum mrvl_reader_backend {
+	MRVL_READER_AUTO,
+	MRVL_READER_URING,
+	MRVL_READER_PREAD,
+};
+
+struct mrvl_read {
+	const char *path;
+	void *arg;
+	struct MarvellFirmware *fw;           // on success, owned by the callback
+	int status;                           // enum mrvl_status
+	const char *error;                    // message, valid during the callback
+	int unsupported;                      // compressed or not a regular file
+};
+
+typedef void (*mrvl_read_done)(struct mrvl_read *rd);
+
+struct mrvl_reader_stats {
+	uint64_t images;
+	uint64_t ops;                         // opens, stats and reads
+	uint64_t reads;
+	uint64_t bytes;                       // read
+	double seconds;                       // first operation to last completion
+};
+
+struct mrvl_reader;
+
+/* depth 0 means MRVL_READER_DEPTH. Returns NULL and a message in *errmsg. */
+extern struct mrvl_reader* mrvl_reader_new(enum mrvl_reader_backend backend, unsigned depth, const char **errmsg);
+extern void mrvl_reader_free(struct mrvl_reader *r);
+extern const char* mrvl_reader_name(const struct mrvl_reader *r);
+extern unsigned mrvl_reader_depth(const struct mrvl_reader *r);
+
+/* Queue an image. path must stay valid until done has been called. */
+extern void mrvl_reader_add(struct mrvl_reader *r, const char *path, mrvl_read_done done, void *arg);
+
+/*
+ * Issue queued operations and reap completions; with wait, block until at
+ * least one completes if any is in flight. Returns the number of images
+ * done, or -1 with errno set if the io_uring cannot be entered.
+ */
+extern int mrvl_reader_poll(struct mrvl_reader *r, int wait);
+
+extern void mrvl_reader_stats(const struct mrvl_reader *r, struct mrvl_reader_stats *st);
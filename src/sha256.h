@@ -0,0 +1,37 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* SHA-256 (FIPS 180-4). */
+
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_state {
+	uint32_t h[8];
+	uint64_t len;                         // bytes consumed so far
+	uint8_t block[64];
+	size_t fill;                          // bytes in block
+};
+
+extern void sha256_init(struct sha256_state *st);
+extern void sha256_update(struct sha256_state *st, const void *p, size_t len);
+extern void sha256_final(struct sha256_state *st, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/* Lower-case hex of a digest, NUL-terminated. */
+extern void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[2 * SHA256_DIGEST_SIZE + 1]);
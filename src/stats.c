@@ -0,0 +1,190 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "stats.h"
+
+#ifdef MRVL_STATS
+#include "marvel-88mw30x-firmware.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * Log-linear latency histogram: 8 linear buckets per power of two, so a
+ * percentile is off by at most 1/8 of its value.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct phase_stats {
+	atomic_ullong count;
+	atomic_ullong total_ns;
+	atomic_ullong max_ns;
+	atomic_ullong bytes;
+	atomic_ullong hist[HIST_BUCKETS];
+};
+
+static const char *phase_names[MRVL_NUM_PHASES] = {
+	"read", "parse", "crc", "elf_write", "fw_write", "profile", "xref", "strings", "job",
+};
+
+int mrvl_stats_active;
+static struct phase_stats phases[MRVL_NUM_PHASES];
+static atomic_ullong alloc_count, alloc_bytes;
+static const char *stats_tool;
+static uint64_t stats_start;
+static int perf_fds[2] = { -1, -1 };
+static int perf_requested;
+
+
+uint64_t mrvl_stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns) {
+	if (ns < HIST_SUB)
+		return ns;
+	int e = 63 - __builtin_clzll(ns);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Upper bound of a bucket. */
+static uint64_t hist_value(int bucket) {
+	if (bucket < HIST_SUB)
+		return bucket;
+	int e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t m = HIST_SUB + bucket % HIST_SUB;
+	return ((m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void mrvl_stats_record(enum mrvl_phase phase, uint64_t start, uint64_t bytes) {
+	struct phase_stats *p = &phases[phase];
+	uint64_t ns = mrvl_stats_now() - start;
+	atomic_fetch_add_explicit(&p->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->total_ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->bytes, bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->hist[hist_bucket(ns)], 1, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&p->max_ns, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&p->max_ns, &max, ns,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+void mrvl_stats_alloc(size_t bytes) {
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&alloc_bytes, bytes, memory_order_relaxed);
+}
+
+static uint64_t percentile(const struct phase_stats *p, uint64_t count, double q) {
+	uint64_t rank = (uint64_t) (q * count + 0.5), seen = 0;
+	uint64_t max = atomic_load(&p->max_ns);
+	if (rank < 1)
+		rank = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += atomic_load_explicit(&p->hist[i], memory_order_relaxed);
+		if (seen >= rank)
+			return hist_value(i) < max ? hist_value(i) : max;
+	}
+	return max;
+}
+
+/* Counters are inherited by threads created later, e.g. the thread pool. */
+static int perf_open(uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void perf_print(FILE *f) {
+	static const char *names[2] = { "cycles", "cache_misses" };
+	uint64_t values[2];
+	if (!perf_requested)
+		return;
+	for (int i = 0; i < 2; i++) {
+		if (perf_fds[i] < 0 || read(perf_fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+			fprintf(f, ",\"perf\":null");
+			return;
+		}
+	}
+	fprintf(f, ",\"perf\":{");
+	for (int i = 0; i < 2; i++)
+		fprintf(f, "%s\"%s\":%llu", i ? "," : "", names[i], (unsigned long long) values[i]);
+	fprintf(f, "}");
+}
+
+static void stats_report(void) {
+	FILE *f = stderr;
+	fprintf(f, "{\"tool\":\"%s\",\"version\":\"%s\",\"wall_ns\":%llu,\"phases\":{",
+		stats_tool, MRVLFW_VERSION, (unsigned long long) (mrvl_stats_now() - stats_start));
+	for (int i = 0; i < MRVL_NUM_PHASES; i++) {
+		const struct phase_stats *p = &phases[i];
+		uint64_t count = atomic_load(&p->count);
+		fprintf(f, "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"bytes\":%llu", i ? "," : "",
+			phase_names[i], (unsigned long long) count, (unsigned long long) atomic_load(&p->total_ns),
+			(unsigned long long) atomic_load(&p->bytes));
+		if (count)
+			fprintf(f, ",\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+				(unsigned long long) percentile(p, count, 0.50), (unsigned long long) percentile(p, count, 0.99),
+				(unsigned long long) atomic_load(&p->max_ns));
+		fprintf(f, "}");
+	}
+	fprintf(f, "},\"allocations\":{\"count\":%llu,\"bytes\":%llu}",
+		(unsigned long long) atomic_load(&alloc_count), (unsigned long long) atomic_load(&alloc_bytes));
+	perf_print(f);
+	fprintf(f, "}\n");
+}
+
+int mrvl_stats_enable(const char *tool, const char *opts) {
+	if (opts && strcmp(opts, "perf") != 0)
+		return -1;
+	if (mrvl_stats_active)
+		return 0;
+	if (opts) {
+		perf_requested = 1;
+		perf_fds[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+		perf_fds[1] = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+	}
+	stats_tool = tool;
+	stats_start = mrvl_stats_now();
+	mrvl_stats_active = 1;
+	atexit(stats_report);
+	return 0;
+}
+
+#else
+
+int mrvl_stats_enable(const char *tool, const char *opts) {
+	return -1;
+}
+
+#endif
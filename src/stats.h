@@ -0,0 +1,67 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hot-path instrumentation: phase timers on the monotonic clock, bytes
+ * processed, allocation counts and, on request, cycle and cache-miss
+ * counters from perf_event_open().
+ *
+ * The probes are built with -DMRVL_STATS (make STATS=1, the default) and
+ * expand to nothing otherwise. Recording is off until mrvl_stats_enable(),
+ * so a probe costs one predictable branch unless --stats is given.
+ * Counters are process-wide and updated atomically; every sample also goes
+ * into a per-phase latency histogram for the p50/p99 figures.
+ */
+enum mrvl_phase {
+	MRVL_PHASE_READ,                      // open and map, or read, an input
+	MRVL_PHASE_PARSE,                     // header and segment table checks
+	MRVL_PHASE_CRC,                       // segment checksums
+	MRVL_PHASE_ELF_WRITE,                 // writing an ELF file
+	MRVL_PHASE_FW_WRITE,                  // writing firmware segment data
+	MRVL_PHASE_PROFILE,                   // entropy and histogram of a segment
+	MRVL_PHASE_XREF,                      // cross-reference scan of an image
+	MRVL_PHASE_STRINGS,                   // string scan of an image
+	MRVL_PHASE_JOB,                       // one image, end to end
+	MRVL_NUM_PHASES
+};
+
+#ifdef MRVL_STATS
+extern int mrvl_stats_active;
+extern uint64_t mrvl_stats_now(void);
+extern void mrvl_stats_record(enum mrvl_phase phase, uint64_t start, uint64_t bytes);
+extern void mrvl_stats_alloc(size_t bytes);
+
+#define MRVL_STATS_START(t) uint64_t t = mrvl_stats_active ? mrvl_stats_now() : 0
+#define MRVL_STATS_STAMP(lv) ((lv) = mrvl_stats_active ? mrvl_stats_now() : 0)
+#define MRVL_STATS_STOP(t, phase, bytes) do { if (t) mrvl_stats_record(phase, t, bytes); } while (0)
+#define MRVL_STATS_ALLOC(bytes) do { if (mrvl_stats_active) mrvl_stats_alloc(bytes); } while (0)
+#else
+#define MRVL_STATS_START(t)
+#define MRVL_STATS_STAMP(lv) ((void) 0)
+#define MRVL_STATS_STOP(t, phase, bytes) do { } while (0)
+#define MRVL_STATS_ALLOC(bytes) do { } while (0)
+#endif
+
+/*
+ * Start recording, for the --stats[=perf] option of the tools. The JSON
+ * summary goes to stderr when the process exits. opts is NULL or "perf".
+ * Returns -1 if the tools were built without MRVL_STATS or opts is unknown.
+ */
+extern int mrvl_stats_enable(const char *tool, const char *opts);
@@ -0,0 +1,871 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+
+#include "store.h"
+#include "crc32.h"
+#include "sha256.h"
+#include "stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CUT_MASK (~0ull << (64 - MRVL_STORE_CHUNK_BITS))
+/* Boundaries: start and end of the image and of every segment. */
+#define MAX_REGIONS (2 * MRVL_MAX_SEGMENTS + 1)
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+store_file_header {
+	char magic[4];                        // "MRVP", "MRVK" or "MRVG"
+	uint32_t version;
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+store_chunk {
+	uint8_t sha[SHA256_DIGEST_SIZE];
+	uint64_t offset;                      // in the pack
+	uint32_t size;
+	uint32_t crc;
+};
+
+/* Followed by num_chunks store_refs. */
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+store_segment {
+	uint8_t sha[SHA256_DIGEST_SIZE];
+	uint32_t crc;                         // as in the segment table
+	uint32_t size;
+	uint32_t num_chunks;
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+store_ref {
+	uint32_t chunk;                       // record number in chunks
+};
+
+/* Followed by num_regions store_regions, then num_refs store_refs. */
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+store_manifest {
+	char magic[4];                        // "MRVI"
+	uint32_t version;
+	uint8_t sha[SHA256_DIGEST_SIZE];      // whole image
+	uint64_t image_size;
+	uint32_t num_regions;
+	uint32_t num_refs;
+	struct MarvellHeader header;
+	struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS];
+};
+
+struct __attribute__((packed, scalar_storage_order("little-endian")))
+store_region {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t num_chunks;
+};
+
+struct segment {
+	uint8_t sha[SHA256_DIGEST_SIZE];
+	uint32_t crc;
+	uint32_t size;
+	uint32_t first;                       // in segment_refs
+	uint32_t num_chunks;
+};
+
+/* Open addressing; slots hold record number + 1, 0 is empty. */
+struct table {
+	uint32_t *slots;
+	uint32_t mask;
+	uint32_t used;
+};
+
+struct mrvl_store {
+	char dir[PATH_MAX];
+	int writable;
+	int lock_fd, pack_fd, chunks_fd, segments_fd;
+	uint64_t pack_size, chunks_size, segments_size;
+
+	struct store_chunk *chunks;
+	uint32_t num_chunks, chunks_cap;
+	struct table chunk_table;             // by SHA-256
+
+	struct segment *segments;
+	uint32_t num_segments, segments_cap;
+	uint32_t *segment_refs;
+	uint32_t num_segment_refs, segment_refs_cap;
+	struct table segment_table;           // by CRC and size
+};
+
+/* A manifest being built or read. */
+struct manifest {
+	struct store_manifest m;
+	struct store_region regions[MAX_REGIONS];
+	uint32_t *refs;
+	uint32_t num_refs, cap;
+};
+
+static uint64_t gear[256];
+
+
+/* Fixed for all time: chunk boundaries must not change between versions. */
+__attribute__((constructor))
+static void store_setup(void) {
+	uint64_t x = 0x4d52564c53544f52ull;   // "MRVLSTOR"
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* Length of the next chunk of p[0..len). */
+static size_t next_cut(const uint8_t *p, size_t len) {
+	if (len <= MRVL_STORE_CHUNK_MIN)
+		return len;
+	size_t max = len < MRVL_STORE_CHUNK_MAX ? len : MRVL_STORE_CHUNK_MAX;
+	uint64_t h = 0;
+	// the hash covers the last 64 bytes, so start that far before the minimum
+	for (size_t i = MRVL_STORE_CHUNK_MIN - 64; i < max; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (i >= MRVL_STORE_CHUNK_MIN && !(h & CUT_MASK))
+			return i + 1;
+	}
+	return max;
+}
+
+static void sha256(const uint8_t *p, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+	struct sha256_state st;
+	sha256_init(&st);
+	sha256_update(&st, p, len);
+	sha256_final(&st, digest);
+}
+
+static int grow(void **p, uint32_t *cap, uint32_t need, size_t size) {
+	if (need <= *cap)
+		return 0;
+	uint32_t n = *cap ? *cap : 256;
+	while (n < need)
+		n *= 2;
+	void *q = realloc(*p, n * size);
+	if (!q)
+		return -1;
+	*p = q;
+	*cap = n;
+	return 0;
+}
+
+static uint32_t segment_hash(uint32_t crc, uint32_t size) {
+	return (crc ^ size * 0x9e3779b9u) * 0x85ebca6bu;
+}
+
+static uint32_t chunk_hash(const uint8_t *sha) {
+	uint32_t h;
+	memcpy(&h, sha, sizeof(h));
+	return h;
+}
+
+static int table_insert(struct table *t, uint32_t hash, uint32_t id, uint32_t (*rehash)(struct mrvl_store*, uint32_t), struct mrvl_store *s) {
+	if (2 * (t->used + 1) > t->mask + 1) {
+		uint32_t size = t->mask ? 2 * (t->mask + 1) : 1024;
+		uint32_t *slots = calloc(size, sizeof(uint32_t));
+		if (!slots)
+			return -1;
+		for (uint32_t i = 0; t->slots && i <= t->mask; i++) {
+			if (!t->slots[i])
+				continue;
+			uint32_t j = rehash(s, t->slots[i] - 1) & (size - 1);
+			while (slots[j])
+				j = (j + 1) & (size - 1);
+			slots[j] = t->slots[i];
+		}
+		free(t->slots);
+		t->slots = slots;
+		t->mask = size - 1;
+	}
+	uint32_t j = hash & t->mask;
+	while (t->slots[j])
+		j = (j + 1) & t->mask;
+	t->slots[j] = id + 1;
+	t->used++;
+	return 0;
+}
+
+static uint32_t rehash_chunk(struct mrvl_store *s, uint32_t id) {
+	return chunk_hash(s->chunks[id].sha);
+}
+
+static uint32_t rehash_segment(struct mrvl_store *s, uint32_t id) {
+	return segment_hash(s->segments[id].crc, s->segments[id].size);
+}
+
+/* Returns the chunk number, or -1. */
+static int64_t find_chunk(struct mrvl_store *s, const uint8_t *sha, uint32_t size) {
+	struct table *t = &s->chunk_table;
+	if (!t->slots)
+		return -1;
+	for (uint32_t j = chunk_hash(sha) & t->mask; t->slots[j]; j = (j + 1) & t->mask) {
+		const struct store_chunk *c = &s->chunks[t->slots[j] - 1];
+		if (c->size == size && memcmp(c->sha, sha, SHA256_DIGEST_SIZE) == 0)
+			return t->slots[j] - 1;
+	}
+	return -1;
+}
+
+static int write_at(int fd, const void *buf, size_t len, uint64_t offset) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pwrite(fd, (const uint8_t*) buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int read_at(int fd, void *buf, size_t len, uint64_t offset) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pread(fd, (uint8_t*) buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = write(fd, (const uint8_t*) buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* Open one of the record files; a new one gets its header. */
+static int open_file(struct mrvl_store *s, const char *name, const char *magic, uint64_t *size) {
+	char path[PATH_MAX + 16];
+	struct store_file_header hdr;
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", s->dir, name);
+	int fd = open(path, s->writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0666);
+	if (fd < 0 || fstat(fd, &st) != 0)
+		return -1;
+	if (st.st_size == 0 && s->writable) {
+		memcpy(hdr.magic, magic, 4);
+		hdr.version = MRVL_STORE_VERSION;
+		if (write_at(fd, &hdr, sizeof(hdr), 0) != 0)
+			goto bad;
+		st.st_size = sizeof(hdr);
+	}
+	if (read_at(fd, &hdr, sizeof(hdr), 0) != 0 || memcmp(hdr.magic, magic, 4) != 0 ||
+			hdr.version != MRVL_STORE_VERSION) {
+		errno = EINVAL;
+		goto bad;
+	}
+	*size = st.st_size;
+	return fd;
+
+bad:
+	close(fd);
+	return -1;
+}
+
+static uint8_t* read_file(int fd, uint64_t size) {
+	uint8_t *buf = malloc(size ? size : 1);
+	if (buf && read_at(fd, buf, size, 0) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * Records left incomplete by an interrupted import, or pointing past the
+ * end of the pack, are dropped; a writable store truncates them away so
+ * that appends stay aligned.
+ */
+static const char* load_chunks(struct mrvl_store *s) {
+	uint8_t *buf = read_file(s->chunks_fd, s->chunks_size);
+	if (!buf)
+		return "cannot read chunks";
+	uint64_t pos = sizeof(struct store_file_header);
+	for (; pos + sizeof(struct store_chunk) <= s->chunks_size; pos += sizeof(struct store_chunk)) {
+		const struct store_chunk *c = (const struct store_chunk*) (buf + pos);
+		if (c->offset + c->size > s->pack_size)
+			break;
+		if (grow((void**) &s->chunks, &s->chunks_cap, s->num_chunks + 1, sizeof(struct store_chunk)) != 0) {
+			free(buf);
+			return "out of memory";
+		}
+		s->chunks[s->num_chunks] = *c;
+		if (table_insert(&s->chunk_table, chunk_hash(c->sha), s->num_chunks, rehash_chunk, s) != 0) {
+			free(buf);
+			return "out of memory";
+		}
+		s->num_chunks++;
+	}
+	free(buf);
+	s->chunks_size = pos;
+	return NULL;
+}
+
+static const char* load_segments(struct mrvl_store *s) {
+	uint8_t *buf = read_file(s->segments_fd, s->segments_size);
+	if (!buf)
+		return "cannot read segments";
+	uint64_t pos = sizeof(struct store_file_header);
+	while (pos + sizeof(struct store_segment) <= s->segments_size) {
+		const struct store_segment *rec = (const struct store_segment*) (buf + pos);
+		uint64_t end = pos + sizeof(*rec) + (uint64_t) rec->num_chunks * sizeof(struct store_ref);
+		if (end > s->segments_size)
+			break;
+		const struct store_ref *refs = (const struct store_ref*) (rec + 1);
+		uint32_t i;
+		for (i = 0; i < rec->num_chunks && refs[i].chunk < s->num_chunks; i++)
+			;
+		if (i < rec->num_chunks)
+			break;
+		if (grow((void**) &s->segments, &s->segments_cap, s->num_segments + 1, sizeof(struct segment)) != 0 ||
+				grow((void**) &s->segment_refs, &s->segment_refs_cap, s->num_segment_refs + rec->num_chunks, sizeof(uint32_t)) != 0 ||
+				table_insert(&s->segment_table, segment_hash(rec->crc, rec->size), s->num_segments, rehash_segment, s) != 0) {
+			free(buf);
+			return "out of memory";
+		}
+		struct segment *seg = &s->segments[s->num_segments++];
+		memcpy(seg->sha, rec->sha, SHA256_DIGEST_SIZE);
+		seg->crc = rec->crc;
+		seg->size = rec->size;
+		seg->first = s->num_segment_refs;
+		seg->num_chunks = rec->num_chunks;
+		for (i = 0; i < rec->num_chunks; i++)
+			s->segment_refs[s->num_segment_refs++] = refs[i].chunk;
+		pos = end;
+	}
+	free(buf);
+	s->segments_size = pos;
+	return NULL;
+}
+
+static int make_dir(const char *path) {
+	return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+struct mrvl_store* mrvl_store_open(const char *dir, int create, int writable, const char **errmsg) {
+	char path[PATH_MAX + 16];
+	struct stat st;
+	struct mrvl_store *s = calloc(1, sizeof(*s));
+	if (!s) {
+		*errmsg = "out of memory";
+		return NULL;
+	}
+	s->lock_fd = s->pack_fd = s->chunks_fd = s->segments_fd = -1;
+	s->writable = writable || create;
+	if (strlen(dir) >= sizeof(s->dir) - 16) {
+		*errmsg = "path too long";
+		goto fail;
+	}
+	strcpy(s->dir, dir);
+
+	snprintf(path, sizeof(path), "%s/images", dir);
+	if (create && (make_dir(dir) != 0 || make_dir(path) != 0)) {
+		*errmsg = "cannot create the store directory";
+		goto fail;
+	}
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		*errmsg = "not a firmware store";
+		goto fail;
+	}
+	snprintf(path, sizeof(path), "%s/lock", dir);
+	s->lock_fd = open(path, (s->writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0666);
+	if (s->lock_fd < 0 || flock(s->lock_fd, s->writable ? LOCK_EX : LOCK_SH) != 0) {
+		*errmsg = "cannot lock the store";
+		goto fail;
+	}
+	if ((s->pack_fd = open_file(s, "pack", "MRVP", &s->pack_size)) < 0 ||
+			(s->chunks_fd = open_file(s, "chunks", "MRVK", &s->chunks_size)) < 0 ||
+			(s->segments_fd = open_file(s, "segments", "MRVG", &s->segments_size)) < 0) {
+		*errmsg = errno == EINVAL ? "damaged or incompatible store" : "not a firmware store";
+		goto fail;
+	}
+	if ((*errmsg = load_chunks(s)) || (*errmsg = load_segments(s)))
+		goto fail;
+	if (s->writable && (ftruncate(s->chunks_fd, s->chunks_size) != 0 ||
+			ftruncate(s->segments_fd, s->segments_size) != 0)) {
+		*errmsg = "cannot repair the store";
+		goto fail;
+	}
+	return s;
+
+fail:
+	mrvl_store_close(s);
+	return NULL;
+}
+
+void mrvl_store_close(struct mrvl_store *s) {
+	if (!s)
+		return;
+	int fds[] = { s->pack_fd, s->chunks_fd, s->segments_fd, s->lock_fd };
+	for (int i = 0; i < 4; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	free(s->chunks);
+	free(s->chunk_table.slots);
+	free(s->segments);
+	free(s->segment_refs);
+	free(s->segment_table.slots);
+	free(s);
+}
+
+static int add_ref(struct manifest *mf, uint32_t chunk) {
+	if (grow((void**) &mf->refs, &mf->cap, mf->num_refs + 1, sizeof(uint32_t)) != 0)
+		return -1;
+	mf->refs[mf->num_refs++] = chunk;
+	return 0;
+}
+
+/* Returns the chunk number of p[0..len), appending it if it is new. */
+static int64_t add_chunk(struct mrvl_store *s, const uint8_t *p, uint32_t len, struct mrvl_store_import *st) {
+	struct store_chunk c;
+	sha256(p, len, c.sha);
+	int64_t id = find_chunk(s, c.sha, len);
+	st->chunks++;
+	if (id >= 0)
+		return id;
+
+	MRVL_STATS_START(t);
+	c.offset = s->pack_size;
+	c.size = len;
+	c.crc = crc32_byte((uint8_t*) p, len);
+	if (write_at(s->pack_fd, p, len, s->pack_size) != 0 ||
+			write_at(s->chunks_fd, &c, sizeof(c), s->chunks_size) != 0)
+		return -1;
+	s->pack_size += len;
+	s->chunks_size += sizeof(c);
+	if (grow((void**) &s->chunks, &s->chunks_cap, s->num_chunks + 1, sizeof(struct store_chunk)) != 0)
+		return -1;
+	s->chunks[s->num_chunks] = c;
+	if (table_insert(&s->chunk_table, chunk_hash(c.sha), s->num_chunks, rehash_chunk, s) != 0)
+		return -1;
+	st->new_chunks++;
+	st->new_bytes += len;
+	MRVL_STATS_STOP(t, MRVL_PHASE_FW_WRITE, len);
+	return s->num_chunks++;
+}
+
+/* A stored segment with this CRC, size and SHA-256, or NULL. */
+static const struct segment* find_segment(struct mrvl_store *s, uint32_t crc, uint32_t size, const uint8_t *sha) {
+	struct table *t = &s->segment_table;
+	if (!t->slots)
+		return NULL;
+	for (uint32_t j = segment_hash(crc, size) & t->mask; t->slots[j]; j = (j + 1) & t->mask) {
+		const struct segment *seg = &s->segments[t->slots[j] - 1];
+		if (seg->crc == crc && seg->size == size && memcmp(seg->sha, sha, SHA256_DIGEST_SIZE) == 0)
+			return seg;
+	}
+	return NULL;
+}
+
+static int has_segment(struct mrvl_store *s, uint32_t crc, uint32_t size) {
+	struct table *t = &s->segment_table;
+	if (!t->slots)
+		return 0;
+	for (uint32_t j = segment_hash(crc, size) & t->mask; t->slots[j]; j = (j + 1) & t->mask) {
+		const struct segment *seg = &s->segments[t->slots[j] - 1];
+		if (seg->crc == crc && seg->size == size)
+			return 1;
+	}
+	return 0;
+}
+
+static const char* add_segment(struct mrvl_store *s, const struct MarvellSegmentHeader *sh, const uint8_t *sha, const uint32_t *refs, uint32_t count) {
+	struct store_segment rec;
+	memcpy(rec.sha, sha, SHA256_DIGEST_SIZE);
+	rec.crc = sh->checksum;
+	rec.size = sh->size;
+	rec.num_chunks = count;
+
+	size_t len = sizeof(rec) + sizeof(struct store_ref) * count;
+	uint8_t *buf = malloc(len);
+	if (!buf)
+		return "out of memory";
+	memcpy(buf, &rec, sizeof(rec));
+	struct store_ref *out = (struct store_ref*) (buf + sizeof(rec));
+	for (uint32_t i = 0; i < count; i++)
+		out[i].chunk = refs[i];
+	int res = write_at(s->segments_fd, buf, len, s->segments_size);
+	free(buf);
+	if (res != 0)
+		return "cannot write segments";
+	s->segments_size += len;
+
+	if (grow((void**) &s->segments, &s->segments_cap, s->num_segments + 1, sizeof(struct segment)) != 0 ||
+			grow((void**) &s->segment_refs, &s->segment_refs_cap, s->num_segment_refs + count, sizeof(uint32_t)) != 0)
+		return "out of memory";
+	struct segment *seg = &s->segments[s->num_segments];
+	memcpy(seg->sha, sha, SHA256_DIGEST_SIZE);
+	seg->crc = rec.crc;
+	seg->size = rec.size;
+	seg->first = s->num_segment_refs;
+	seg->num_chunks = count;
+	memcpy(s->segment_refs + s->num_segment_refs, refs, sizeof(uint32_t) * count);
+	s->num_segment_refs += count;
+	if (table_insert(&s->segment_table, segment_hash(rec.crc, rec.size), s->num_segments, rehash_segment, s) != 0)
+		return "out of memory";
+	s->num_segments++;
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static int valid_name(const char *name) {
+	size_t len = strlen(name);
+	return len > 0 && len < NAME_MAX - 16 && name[0] != '.' && !strchr(name, '/');
+}
+
+static const char* write_manifest(struct mrvl_store *s, const char *name, const struct manifest *mf) {
+	char path[PATH_MAX + NAME_MAX + 16], tmp[PATH_MAX + NAME_MAX + 32];
+	snprintf(path, sizeof(path), "%s/images/%s", s->dir, name);
+	snprintf(tmp, sizeof(tmp), "%s/images/.%s.%ld", s->dir, name, (long) getpid());
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return "cannot write manifest";
+	int ok = write_all(fd, &mf->m, sizeof(mf->m)) == 0 &&
+		write_all(fd, mf->regions, sizeof(struct store_region) * mf->m.num_regions) == 0;
+	for (uint32_t i = 0; ok && i < mf->num_refs; i++) {
+		struct store_ref ref = { mf->refs[i] };
+		ok = write_all(fd, &ref, sizeof(ref)) == 0;
+	}
+	if (close(fd) != 0)
+		ok = 0;
+	if (!ok || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return "cannot write manifest";
+	}
+	return NULL;
+}
+
+const char* mrvl_store_import(struct mrvl_store *s, const char *name, const struct MarvellFirmware *fw, struct mrvl_store_import *st) {
+	uint64_t bounds[MAX_REGIONS + 1];
+	struct manifest mf;
+	struct sha256_state image_sha;
+	const char *msg = NULL;
+
+	if (!valid_name(name))
+		return "invalid image name";
+	if (!fw->image)
+		return "not a view of the whole image";
+	memset(st, 0, sizeof(*st));
+	memset(&mf, 0, sizeof(mf));
+	const uint8_t *image = fw->image;
+	uint64_t size = fw->image_size;
+	st->bytes = size;
+	st->segments = fw->header.num_segments;
+
+	int n = 0;
+	bounds[n++] = 0;
+	bounds[n++] = size;
+	for (uint32_t i = 0; i < fw->header.num_segments; i++) {
+		bounds[n++] = fw->seghdrs[i].offset;
+		bounds[n++] = (uint64_t) fw->seghdrs[i].offset + fw->seghdrs[i].size;
+	}
+	qsort(bounds, n, sizeof(uint64_t), compare_u64);
+
+	sha256_init(&image_sha);
+	for (int b = 0; b + 1 < n; b++) {
+		uint64_t start = bounds[b], len = bounds[b + 1] - start;
+		if (len == 0)
+			continue;
+		struct store_region *r = &mf.regions[mf.m.num_regions++];
+		r->offset = start;
+		r->size = len;
+		uint32_t first = mf.num_refs;
+		const uint8_t *p = image + start;
+		sha256_update(&image_sha, p, len);
+
+		const struct MarvellSegmentHeader *sh = NULL;
+		for (uint32_t i = 0; i < fw->header.num_segments && !sh; i++) {
+			if (fw->seghdrs[i].offset == start && fw->seghdrs[i].size == len)
+				sh = &fw->seghdrs[i];
+		}
+		uint8_t sha[SHA256_DIGEST_SIZE];
+		if (sh) {
+			// the CRC from the table decides whether hashing the segment can pay off
+			const struct segment *seg = NULL;
+			if (has_segment(s, sh->checksum, sh->size)) {
+				sha256(p, len, sha);
+				seg = find_segment(s, sh->checksum, sh->size, sha);
+			}
+			if (seg) {
+				for (uint32_t i = 0; i < seg->num_chunks; i++) {
+					if (add_ref(&mf, s->segment_refs[seg->first + i]) != 0) {
+						msg = "out of memory";
+						goto out;
+					}
+				}
+				r->num_chunks = seg->num_chunks;
+				st->chunks += seg->num_chunks;
+				st->known_segments++;
+				continue;
+			}
+		}
+
+		for (uint64_t done = 0; done < len; ) {
+			size_t cut = next_cut(p + done, len - done);
+			int64_t id = add_chunk(s, p + done, cut, st);
+			if (id < 0 || add_ref(&mf, id) != 0) {
+				msg = id < 0 ? "cannot write pack" : "out of memory";
+				goto out;
+			}
+			done += cut;
+		}
+		r->num_chunks = mf.num_refs - first;
+		if (sh) {
+			if (!has_segment(s, sh->checksum, sh->size))
+				sha256(p, len, sha);
+			if ((msg = add_segment(s, sh, sha, mf.refs + first, r->num_chunks)))
+				goto out;
+		}
+	}
+
+	memcpy(mf.m.magic, "MRVI", 4);
+	mf.m.version = MRVL_STORE_VERSION;
+	sha256_final(&image_sha, mf.m.sha);
+	mf.m.image_size = size;
+	mf.m.num_refs = mf.num_refs;
+	mf.m.header = fw->header;
+	memcpy(mf.m.seghdrs, fw->seghdrs, sizeof(struct MarvellSegmentHeader) * fw->header.num_segments);
+	msg = write_manifest(s, name, &mf);
+
+out:
+	free(mf.refs);
+	return msg;
+}
+
+static const char* read_manifest(struct mrvl_store *s, const char *name, struct manifest *mf, int header_only) {
+	char path[PATH_MAX + NAME_MAX + 16];
+	memset(mf, 0, sizeof(*mf));
+	snprintf(path, sizeof(path), "%s/images/%s", s->dir, name);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? "no such image" : "cannot open manifest";
+
+	const char *msg = "damaged manifest";
+	if (read_at(fd, &mf->m, sizeof(mf->m), 0) != 0 || memcmp(mf->m.magic, "MRVI", 4) != 0 ||
+			mf->m.version != MRVL_STORE_VERSION || mf->m.num_regions > MAX_REGIONS ||
+			mf->m.header.num_segments > MRVL_MAX_SEGMENTS)
+		goto out;
+	if (header_only) {
+		msg = NULL;
+		goto out;
+	}
+	uint64_t pos = sizeof(mf->m);
+	if (read_at(fd, mf->regions, sizeof(struct store_region) * mf->m.num_regions, pos) != 0)
+		goto out;
+	pos += sizeof(struct store_region) * mf->m.num_regions;
+	if (!(mf->refs = malloc(sizeof(uint32_t) * (mf->m.num_refs + 1)))) {
+		msg = "out of memory";
+		goto out;
+	}
+	struct store_ref *refs = (struct store_ref*) mf->refs;
+	if (read_at(fd, refs, sizeof(struct store_ref) * mf->m.num_refs, pos) != 0)
+		goto out;
+	mf->num_refs = mf->m.num_refs;
+	for (uint32_t i = 0; i < mf->num_refs; i++) {
+		mf->refs[i] = refs[i].chunk;
+		if (mf->refs[i] >= s->num_chunks)
+			goto out;
+	}
+	uint64_t total = 0, count = 0;
+	for (uint32_t i = 0; i < mf->m.num_regions; i++) {
+		total += mf->regions[i].size;
+		count += mf->regions[i].num_chunks;
+	}
+	if (total == mf->m.image_size && count == mf->num_refs)
+		msg = NULL;
+out:
+	close(fd);
+	if (msg) {
+		free(mf->refs);
+		mf->refs = NULL;
+	}
+	return msg;
+}
+
+static const uint8_t* map_pack(struct mrvl_store *s) {
+	void *p = mmap(NULL, s->pack_size, PROT_READ, MAP_SHARED, s->pack_fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	madvise(p, s->pack_size, MADV_WILLNEED);
+	return p;
+}
+
+const char* mrvl_store_export(struct mrvl_store *s, const char *name, int fd) {
+	struct manifest mf;
+	struct sha256_state st;
+	uint8_t sha[SHA256_DIGEST_SIZE];
+	const char *msg;
+
+	if (!valid_name(name))
+		return "invalid image name";
+	if ((msg = read_manifest(s, name, &mf, 0)))
+		return msg;
+	const uint8_t *pack = map_pack(s);
+	if (!pack) {
+		free(mf.refs);
+		return "cannot map pack";
+	}
+
+	MRVL_STATS_START(t);
+	sha256_init(&st);
+	for (uint32_t i = 0; i < mf.num_refs && !msg; i++) {
+		const struct store_chunk *c = &s->chunks[mf.refs[i]];
+		sha256_update(&st, pack + c->offset, c->size);
+		if (write_all(fd, pack + c->offset, c->size) != 0)
+			msg = "cannot write image";
+	}
+	sha256_final(&st, sha);
+	if (!msg && memcmp(sha, mf.m.sha, SHA256_DIGEST_SIZE) != 0)
+		msg = "rebuilt image does not match its SHA-256";
+	MRVL_STATS_STOP(t, MRVL_PHASE_FW_WRITE, mf.m.image_size);
+	munmap((void*) pack, s->pack_size);
+	free(mf.refs);
+	return msg;
+}
+
+const char* mrvl_store_list(struct mrvl_store *s, void (*fn)(const char *name, const struct MarvellHeader *hdr, uint64_t size, void *arg), void *arg) {
+	char path[PATH_MAX + 16];
+	struct manifest mf;
+	snprintf(path, sizeof(path), "%s/images", s->dir);
+	DIR *d = opendir(path);
+	if (!d)
+		return "cannot read images";
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.' || read_manifest(s, e->d_name, &mf, 1))
+			continue;
+		fn(e->d_name, &mf.m.header, mf.m.image_size, arg);
+	}
+	closedir(d);
+	return NULL;
+}
+
+static void count_image(const char *name, const struct MarvellHeader *hdr, uint64_t size, void *arg) {
+	struct mrvl_store_stats *st = arg;
+	st->images++;
+	st->image_bytes += size;
+}
+
+const char* mrvl_store_stats(struct mrvl_store *s, struct mrvl_store_stats *st) {
+	memset(st, 0, sizeof(*st));
+	st->pack_bytes = s->pack_size - sizeof(struct store_file_header);
+	st->chunks = s->num_chunks;
+	st->segments = s->num_segments;
+	return mrvl_store_list(s, count_image, st);
+}
+
+struct verify_state {
+	struct mrvl_store *s;
+	const uint8_t *bad;                   // per chunk
+	mrvl_store_check_fn fn;
+	void *arg;
+};
+
+static void check_image(const char *name, const struct MarvellHeader *hdr, uint64_t size, void *arg) {
+	struct verify_state *vs = arg;
+	struct mrvl_store_check check;
+	struct manifest mf;
+
+	memset(&check, 0, sizeof(check));
+	check.name = name;
+	if (read_manifest(vs->s, name, &mf, 0)) {
+		check.damaged = 1;
+		vs->fn(&check, vs->arg);
+		return;
+	}
+	check.header = mf.m.header;
+	memcpy(check.seghdrs, mf.m.seghdrs, sizeof(check.seghdrs));
+
+	// segments are unions of whole regions, since every segment edge is a region edge
+	for (uint32_t i = 0; i < mf.m.header.num_segments; i++) {
+		const struct MarvellSegmentHeader *sh = &mf.m.seghdrs[i];
+		uint64_t end = (uint64_t) sh->offset + sh->size;
+		uint32_t crc = 0, ref = 0;
+		for (uint32_t r = 0; r < mf.m.num_regions; r++) {
+			const struct store_region *reg = &mf.regions[r];
+			int inside = reg->offset >= sh->offset && reg->offset + reg->size <= end;
+			for (uint32_t k = 0; k < reg->num_chunks; k++, ref++) {
+				const struct store_chunk *c = &vs->s->chunks[mf.refs[ref]];
+				if (vs->bad[mf.refs[ref]])
+					check.damaged = 1;
+				if (inside)
+					crc = crc32_combine(crc, c->crc, c->size);
+			}
+		}
+		check.checksums[i] = crc;
+	}
+	free(mf.refs);
+	vs->fn(&check, vs->arg);
+}
+
+const char* mrvl_store_verify(struct mrvl_store *s, mrvl_store_check_fn fn, void *arg, uint32_t *bad_chunks) {
+	struct verify_state vs = { s, NULL, fn, arg };
+	uint8_t *bad = calloc(s->num_chunks + 1, 1);
+	if (!bad)
+		return "out of memory";
+	const uint8_t *pack = map_pack(s);
+	if (!pack) {
+		free(bad);
+		return "cannot map pack";
+	}
+
+	MRVL_STATS_START(t);
+	*bad_chunks = 0;
+	for (uint32_t i = 0; i < s->num_chunks; i++) {
+		const struct store_chunk *c = &s->chunks[i];
+		if (crc32_byte((uint8_t*) pack + c->offset, c->size) != c->crc) {
+			bad[i] = 1;
+			(*bad_chunks)++;
+		}
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_CRC, s->pack_size);
+	munmap((void*) pack, s->pack_size);
+
+	vs.bad = bad;
+	const char *msg = mrvl_store_list(s, check_image, &vs);
+	free(bad);
+	return msg;
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+
+/*
+ * Deduplicating store for many firmware images.
+ *
+ * An image is cut into regions at every segment boundary: the header and
+ * segment table, each segment, gaps and trailing data. Regions are cut
+ * into chunks of 2 to 64 KiB (8 KiB on average) where a gear hash of the
+ * last bytes matches, so an insertion or a changed variable only changes
+ * the chunks around it. Every distinct chunk is stored once, found by its
+ * SHA-256. A whole segment whose size and CRC (from the segment table, so
+ * without reading it) match one stored before is confirmed by SHA-256 and
+ * not chunked again.
+ *
+ * Layout of the store directory:
+ *   pack        chunk data, appended; mapped for reading
+ *   chunks      one record per chunk: SHA-256, CRC, pack offset and size
+ *   segments    whole segments: CRC, size, SHA-256 and their chunks
+ *   images/     one manifest per image: header, segment table, SHA-256 of
+ *               the image, its regions and their chunks
+ *   lock        flock()ed, exclusively while importing
+ *
+ * Records are appended after the data they refer to, and manifests are
+ * written to a temporary file and renamed, so an interrupted import leaves
+ * at most unreferenced data behind.
+ */
+#define MRVL_STORE_VERSION      1
+#define MRVL_STORE_CHUNK_MIN    (2 * 1024)
+#define MRVL_STORE_CHUNK_MAX    (64 * 1024)
+#define MRVL_STORE_CHUNK_BITS   13        // 8 KiB average
+
+struct mrvl_store;
+
+struct mrvl_store_import {
+	uint64_t bytes;                       // image size
+	uint64_t new_bytes;                   // appended to the pack
+	uint32_t chunks;
+	uint32_t new_chunks;
+	uint32_t segments;
+	uint32_t known_segments;              // found whole by CRC and SHA-256
+};
+
+struct mrvl_store_stats {
+	uint32_t images;
+	uint64_t image_bytes;                 // sum of the image sizes
+	uint64_t pack_bytes;
+	uint32_t chunks;
+	uint32_t segments;
+};
+
+/* One image as verify sees it. */
+struct mrvl_store_check {
+	const char *name;
+	struct MarvellHeader header;
+	struct MarvellSegmentHeader seghdrs[MRVL_MAX_SEGMENTS];
+	uint32_t checksums[MRVL_MAX_SEGMENTS]; // actual CRCs
+	int damaged;                          // a chunk of the image is corrupt
+};
+
+typedef void (*mrvl_store_check_fn)(const struct mrvl_store_check *check, void *arg);
+
+/*
+ * Functions that can fail return NULL on success or an error message.
+ * mrvl_store_open() returns NULL and a message in *errmsg; with create,
+ * the directory is created if needed. writable takes the lock for import.
+ */
+extern struct mrvl_store* mrvl_store_open(const char *dir, int create, int writable, const char **errmsg);
+extern void mrvl_store_close(struct mrvl_store *s);
+
+/*
+ * Add the image fw, a view of the whole file (mapped, buffered or
+ * viewed), under name. An image of the same name is replaced.
+ */
+extern const char* mrvl_store_import(struct mrvl_store *s, const char *name, const struct MarvellFirmware *fw, struct mrvl_store_import *st);
+
+/* Write the image back to fd, bit for bit; its SHA-256 is checked. */
+extern const char* mrvl_store_export(struct mrvl_store *s, const char *name, int fd);
+
+/* Calls fn with each image name, in directory order. */
+extern const char* mrvl_store_list(struct mrvl_store *s, void (*fn)(const char *name, const struct MarvellHeader *hdr, uint64_t size, void *arg), void *arg);
+
+extern const char* mrvl_store_stats(struct mrvl_store *s, struct mrvl_store_stats *st);
+
+/*
+ * Check the CRC of every chunk once, then derive the segment CRCs of every
+ * image from the CRCs of its chunks, without reading the data again.
+ * *bad_chunks receives the number of corrupt chunks.
+ */
+extern const char* mrvl_store_verify(struct mrvl_store *s, mrvl_store_check_fn fn, void *arg, uint32_t *bad_chunks);
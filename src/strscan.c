@@ -0,0 +1,400 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "strscan.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_MASKS_AVX2
+#endif
+#ifdef __SSE2__
+#define HAVE_MASKS_SSE2
+#endif
+
+/* Segments are scanned in parts of this size, one task each. */
+#define STRINGS_CHUNK_SIZE (4 * 1024 * 1024)
+
+#define EVEN_BITS 0x5555555555555555ull
+
+/* Strings of one stream, in address order. */
+struct string_list {
+	struct mrvl_string *strings;          // malloc'ed
+	uint32_t count;
+	uint32_t cap;
+};
+
+/* An open run of one stream: ASCII, or UTF-16 at even or odd offsets. */
+struct tracker {
+	int open;
+	uint32_t start;                       // offset in the segment
+	unsigned min_bits;                    // shortest run kept, in bytes
+	uint8_t encoding;
+	uint8_t list;                         // index into strings_part.lists
+};
+
+/*
+ * Strings starting in [start, end) of a segment. A part reads on past end
+ * to finish its last strings; the ones it finds cut off at start belong
+ * to the part before.
+ */
+struct strings_part {
+	const uint8_t *p;                     // segment data
+	uint32_t len;                         // of the segment
+	uint32_t start;                       // multiple of 64
+	uint32_t end;
+	uint32_t vaddr;                       // of the segment
+	uint8_t segment;
+	unsigned min_len;
+	unsigned encodings;
+	struct string_list lists[3];          // ASCII, UTF-16 even, odd
+	int failed;
+};
+
+/* Printable and zero masks of the 64 bytes at p. */
+typedef void (*masks_fn)(const uint8_t *p, uint64_t *printable, uint64_t *zero);
+typedef void (*scan_fn)(struct strings_part *part);
+
+static scan_fn scan;
+
+
+static inline int printable(uint8_t c) {
+	return (c >= 0x20 && c < 0x7f) || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline void masks_generic(const uint8_t *p, unsigned n, uint64_t *pr, uint64_t *zero) {
+	uint64_t m = 0, z = 0;
+	for (unsigned i = 0; i < n; i++) {
+		m |= (uint64_t) printable(p[i]) << i;
+		z |= (uint64_t) (p[i] == 0) << i;
+	}
+	*pr = m;
+	*zero = z;
+}
+
+static void masks64_generic(const uint8_t *p, uint64_t *pr, uint64_t *zero) {
+	masks_generic(p, 64, pr, zero);
+}
+
+/*
+ * Bits of m in runs of at least k: windows of k set bits are found by
+ * and-ing shifted copies, log2(k) steps, and spread back over the run.
+ */
+static inline uint64_t long_runs(uint64_t m, unsigned k) {
+	unsigned n = 1;
+	if (k > 64)
+		return 0;
+	while (2 * n <= k) {
+		m &= m >> n;
+		n *= 2;
+	}
+	if (n < k)
+		m &= m >> (k - n);
+	uint64_t l = m;
+	for (n = 1; 2 * n <= k; n *= 2)
+		l |= l << n;
+	if (n < k)
+		l |= l << (k - n);
+	return l;
+}
+
+static int add_string(struct strings_part *part, struct string_list *l, uint32_t start, uint32_t size, uint8_t encoding) {
+	if (l->count == l->cap) {
+		uint32_t cap = l->cap ? l->cap * 2 : 256;
+		struct mrvl_string *strings = realloc(l->strings, sizeof(struct mrvl_string) * cap);
+		if (!strings) {
+			part->failed = 1;
+			return -1;
+		}
+		l->strings = strings;
+		l->cap = cap;
+	}
+	l->strings[l->count++] = (struct mrvl_string) { part->vaddr + start, size, part->segment, encoding };
+	return 0;
+}
+
+static void emit(struct strings_part *part, struct tracker *t, uint32_t end) {
+	const uint8_t *p = part->p;
+	uint32_t s = t->start;
+	t->open = 0;
+	if (end - s < t->min_bits || s >= part->end || part->failed)
+		return;
+	// continued from the part before
+	if (s == part->start && s > 0 && t->encoding == MRVL_STRING_ASCII && printable(p[s - 1]))
+		return;
+	if (s < part->start + 2 && s >= 2 && t->encoding == MRVL_STRING_UTF16LE && printable(p[s - 2]) && p[s - 1] == 0)
+		return;
+	add_string(part, &part->lists[t->list], s, end - s, t->encoding);
+}
+
+/*
+ * Runs of the block mask m at offset base. Runs shorter than the minimum
+ * are dropped from the mask first, except where they may continue in the
+ * blocks around.
+ */
+static inline void track(struct strings_part *part, struct tracker *t, uint64_t m, uint32_t base) {
+	uint64_t keep = long_runs(m, t->min_bits);
+	if (t->open)
+		keep |= m & ~(m + 1);             // run from bit 0
+	if (~m == 0)
+		keep = m;
+	else
+		keep |= m & ~(uint64_t) 0 << (63 - __builtin_clzll(~m)); // run up to bit 63
+	m = keep;
+
+	for (;;) {
+		if (t->open) {
+			if (~m == 0)
+				return;
+			unsigned end = __builtin_ctzll(~m);
+			emit(part, t, base + end);
+			m &= ~(uint64_t) 0 << end;
+		}
+		if (m == 0)
+			return;
+		unsigned start = __builtin_ctzll(m);
+		t->open = 1;
+		t->start = base + start;
+		m |= ((uint64_t) 1 << start) - 1;
+	}
+}
+
+static inline __attribute__((always_inline))
+void block_masks(masks_fn masks, const struct strings_part *part, uint32_t off, uint64_t *pr, uint64_t *zero) {
+	if (off >= part->len)
+		*pr = *zero = 0;
+	else if (part->len - off >= 64)
+		masks(part->p + off, pr, zero);
+	else
+		masks_generic(part->p + off, part->len - off, pr, zero);
+}
+
+/*
+ * The scanner is written once and instantiated per mask function, which
+ * is inlined into each copy. A UTF-16 character at bit i needs the zero
+ * bit i+1, so the masks of the next block are taken one step ahead; its
+ * two bytes are then both set in the mask of its parity, and a character
+ * at bit 63 carries into the next block.
+ */
+static inline __attribute__((always_inline))
+void scan_with(masks_fn masks, struct strings_part *part) {
+	struct tracker ascii = { 0, 0, part->min_len, MRVL_STRING_ASCII, 0 };
+	struct tracker even = { 0, 0, 2 * part->min_len, MRVL_STRING_UTF16LE, 1 };
+	struct tracker odd = { 0, 0, 2 * part->min_len, MRVL_STRING_UTF16LE, 2 };
+	int do_ascii = part->encodings & MRVL_STRING_ASCII, do_utf16 = part->encodings & MRVL_STRING_UTF16LE;
+	uint64_t pr, zero, next_pr, next_zero, carry = 0;
+	uint32_t off = part->start;
+
+	block_masks(masks, part, off, &pr, &zero);
+	for (; off < part->len; off += 64) {
+		if (off >= part->end && !(ascii.open && ascii.start < part->end) &&
+				!(even.open && even.start < part->end) && !(odd.open && odd.start < part->end))
+			return;
+		block_masks(masks, part, off + 64, &next_pr, &next_zero);
+		if (do_ascii)
+			track(part, &ascii, pr, off);
+		if (do_utf16) {
+			uint64_t chars = pr & (zero >> 1 | next_zero << 63);
+			uint64_t e = chars & EVEN_BITS, o = chars & ~EVEN_BITS;
+			track(part, &even, e | e << 1, off);
+			track(part, &odd, o | o << 1 | carry, off);
+			carry = o >> 63;
+		}
+		pr = next_pr;
+		zero = next_zero;
+	}
+	if (ascii.open)
+		emit(part, &ascii, part->len);
+	if (even.open)
+		emit(part, &even, part->len);
+	if (odd.open)
+		emit(part, &odd, part->len);
+}
+
+static void scan_generic(struct strings_part *part) {
+	scan_with(masks64_generic, part);
+}
+
+/*
+ * c is printable if c - 0x20 < 0x5F unsigned; with signed compares only,
+ * both sides are biased by 0x80: c + 0x60 < (int8_t) 0xDF.
+ */
+#ifdef HAVE_MASKS_SSE2
+static inline __attribute__((always_inline)) void masks64_sse2(const uint8_t *p, uint64_t *pr, uint64_t *zero) {
+	const __m128i bias = _mm_set1_epi8(0x60), limit = _mm_set1_epi8((char) 0xdf);
+	const __m128i tab = _mm_set1_epi8('\t'), lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	uint64_t m = 0, z = 0;
+	for (int i = 0; i < 4; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (p + 16 * i));
+		__m128i r = _mm_cmpgt_epi8(limit, _mm_add_epi8(v, bias));
+		r = _mm_or_si128(r, _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr))));
+		m |= (uint64_t) (uint16_t) _mm_movemask_epi8(r) << (16 * i);
+		z |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) << (16 * i);
+	}
+	*pr = m;
+	*zero = z;
+}
+
+static void scan_sse2(struct strings_part *part) {
+	scan_with(masks64_sse2, part);
+}
+#endif
+
+#ifdef HAVE_MASKS_AVX2
+__attribute__((target("avx2")))
+static inline void masks64_avx2(const uint8_t *p, uint64_t *pr, uint64_t *zero) {
+	const __m256i bias = _mm256_set1_epi8(0x60), limit = _mm256_set1_epi8((char) 0xdf);
+	const __m256i tab = _mm256_set1_epi8('\t'), lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+	uint64_t m = 0, z = 0;
+	for (int i = 0; i < 2; i++) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (p + 32 * i));
+		__m256i r = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, bias));
+		r = _mm256_or_si256(r, _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr))));
+		m |= (uint64_t) (uint32_t) _mm256_movemask_epi8(r) << (32 * i);
+		z |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) << (32 * i);
+	}
+	*pr = m;
+	*zero = z;
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(struct strings_part *part) {
+	scan_with(masks64_avx2, part);
+}
+#endif
+
+__attribute__((constructor))
+static void strings_setup(void) {
+	scan = scan_generic;
+#ifdef HAVE_MASKS_SSE2
+	scan = scan_sse2;
+#endif
+#ifdef HAVE_MASKS_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+#endif
+}
+
+static void scan_task(void *arg) {
+	scan(arg);
+}
+
+static int cmp_string(const void *a, const void *b) {
+	const struct mrvl_string *x = a, *y = b;
+	if (x->vaddr != y->vaddr)
+		return x->vaddr < y->vaddr ? -1 : 1;
+	return x->encoding - y->encoding;
+}
+
+/* Append the three sorted lists of a part to out, in address order. */
+static void merge_lists(const struct string_list *lists, struct mrvl_strings *out) {
+	uint32_t pos[3] = { 0, 0, 0 };
+	for (;;) {
+		int best = -1;
+		for (int l = 0; l < 3; l++) {
+			if (pos[l] < lists[l].count && (best < 0 ||
+					cmp_string(&lists[l].strings[pos[l]], &lists[best].strings[pos[best]]) < 0))
+				best = l;
+		}
+		if (best < 0)
+			return;
+		out->strings[out->count++] = lists[best].strings[pos[best]++];
+	}
+}
+
+int mrvl_strings_scan(const struct MarvellFirmware *fw, unsigned min_len, unsigned encodings, struct threadpool *pool, struct mrvl_strings *out) {
+	MRVL_STATS_START(t);
+	int order[MRVL_MAX_SEGMENTS], n = 0;
+	uint32_t num_parts = 0;
+	uint64_t bytes = 0;
+
+	memset(out, 0, sizeof(*out));
+	if (min_len == 0)
+		min_len = MRVL_STRINGS_MIN_LEN;
+	// segments in address order
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		int j = n++;
+		for (; j > 0 && fw->seghdrs[order[j - 1]].vaddr > fw->seghdrs[i].vaddr; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+		uint32_t size = fw->seghdrs[i].size;
+		num_parts += size / STRINGS_CHUNK_SIZE + (size % STRINGS_CHUNK_SIZE != 0);
+	}
+	struct strings_part *parts = calloc(num_parts ? num_parts : 1, sizeof(struct strings_part));
+	if (!parts)
+		return -1;
+
+	struct taskgroup group = TASKGROUP_INIT;
+	uint32_t k = 0;
+	for (int i = 0; i < n; i++) {
+		const struct MarvellSegmentHeader *sh = &fw->seghdrs[order[i]];
+		for (uint32_t start = 0; start < sh->size; start += STRINGS_CHUNK_SIZE) {
+			struct strings_part *part = &parts[k++];
+			part->p = fw->segments[order[i]];
+			part->len = sh->size;
+			part->start = start;
+			part->end = sh->size - start < STRINGS_CHUNK_SIZE ? sh->size : start + STRINGS_CHUNK_SIZE;
+			part->vaddr = sh->vaddr;
+			part->segment = order[i];
+			part->min_len = min_len;
+			part->encodings = encodings;
+			bytes += part->end - start;
+			if (pool && num_parts > 1)
+				threadpool_submit(pool, &group, scan_task, part);
+			else
+				scan(part);
+		}
+	}
+	if (pool && num_parts > 1)
+		threadpool_wait(pool, &group);
+
+	uint64_t total = 0;
+	int failed = 0;
+	for (k = 0; k < num_parts; k++) {
+		for (int l = 0; l < 3; l++)
+			total += parts[k].lists[l].count;
+		failed |= parts[k].failed;
+	}
+	if (!failed && total < UINT32_MAX)
+		out->strings = malloc(sizeof(struct mrvl_string) * (total ? total : 1));
+	for (k = 0; out->strings && k < num_parts; k++)
+		merge_lists(parts[k].lists, out);
+	for (k = 0; k < num_parts; k++) {
+		for (int l = 0; l < 3; l++)
+			free(parts[k].lists[l].strings);
+	}
+	free(parts);
+	if (!out->strings)
+		return -1;
+
+	// only segments that overlap each other leave strings out of order
+	for (uint32_t i = 1; i < out->count; i++) {
+		if (out->strings[i - 1].vaddr > out->strings[i].vaddr) {
+			qsort(out->strings, out->count, sizeof(struct mrvl_string), cmp_string);
+			break;
+		}
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_STRINGS, bytes);
+	return 0;
+}
+
+void mrvl_strings_free(struct mrvl_strings *out) {
+	free(out->strings);
+	memset(out, 0, sizeof(*out));
+}
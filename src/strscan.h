@@ -0,0 +1,61 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+#include "threadpool.h"
+
+/*
+ * Printable strings in the segments of an image, with their addresses.
+ *
+ * A string is a run of at least min_len printable characters: 0x20..0x7E,
+ * tab, CR and LF. UTF-16LE strings are such characters each followed by a
+ * zero byte, at either byte alignment. Every byte is read once: 64-byte
+ * blocks are classified into printable and zero masks (SSE2/AVX2 where
+ * available), and the runs are taken from the masks with bit operations.
+ * Only the strings found are stored, 12 bytes each; their text stays in
+ * the firmware. Segments are scanned in parts of a few MiB, one task each
+ * on a pool.
+ */
+#define MRVL_STRINGS_MIN_LEN   4          // default minimum length, in characters
+
+enum mrvl_string_encoding {
+	MRVL_STRING_ASCII = 1 << 0,
+	MRVL_STRING_UTF16LE = 1 << 1,
+};
+
+struct mrvl_string {
+	uint32_t vaddr;
+	uint32_t size;                        // in bytes, 2 per UTF-16 character
+	uint8_t segment;
+	uint8_t encoding;                     // enum mrvl_string_encoding
+};
+
+struct mrvl_strings {
+	uint32_t count;
+	struct mrvl_string *strings;          // sorted by vaddr
+};
+
+/*
+ * Find the strings of the encodings given (a mask of enum
+ * mrvl_string_encoding); min_len 0 selects MRVL_STRINGS_MIN_LEN. Returns
+ * 0, or -1 if out of memory. pool may be NULL.
+ */
+extern int mrvl_strings_scan(const struct MarvellFirmware *fw, unsigned min_len, unsigned encodings, struct threadpool *pool, struct mrvl_strings *out);
+extern void mrvl_strings_free(struct mrvl_strings *out);
@@ -0,0 +1,231 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "strtab.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t hash_string(const char *s, size_t len) {
+	uint32_t h = 2166136261u;             // FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t) s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* realloc(), but marks the table failed; p is still valid then. */
+static void* grow(struct strtab *st, void *p, size_t n) {
+	void *q = realloc(p, n);
+	if (!q)
+		st->failed = 1;
+	return q;
+}
+
+int strtab_init(struct strtab *st, int merge_tails) {
+	memset(st, 0, sizeof(*st));
+	st->merge_tails = merge_tails;
+	st->bufcap = 256;
+	st->num_slots = 64;
+	st->entries_cap = 16;
+	st->buf = malloc(st->bufcap);
+	st->slots = calloc(st->num_slots, sizeof(uint32_t));
+	st->entries = malloc(sizeof(struct strtab_entry) * st->entries_cap);
+	if (!st->buf || !st->slots || !st->entries) {
+		st->failed = 1;
+		return -1;
+	}
+	st->buf[0] = '\0';
+	st->buflen = 1;
+
+	// handle 0: the empty string at offset 0
+	st->entries[0].offset = 0;
+	st->entries[0].len = 0;
+	st->entries[0].hash = hash_string("", 0);
+	st->num_entries = 1;
+	return 0;
+}
+
+void strtab_free(struct strtab *st) {
+	free(st->buf);
+	free(st->entries);
+	free(st->slots);
+	memset(st, 0, sizeof(*st));
+}
+
+/* Slot holding name, or the empty slot where it belongs. */
+static uint32_t* find_slot(const struct strtab *st, const char *name, size_t len, uint32_t hash) {
+	uint32_t mask = st->num_slots - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+		uint32_t *slot = &st->slots[i];
+		if (*slot == 0)
+			return slot;
+		const struct strtab_entry *e = &st->entries[*slot - 1];
+		if (e->hash == hash && e->len == len && memcmp(st->buf + e->offset, name, len) == 0)
+			return slot;
+	}
+}
+
+static void grow_slots(struct strtab *st) {
+	uint32_t *old = st->slots;
+	uint32_t old_num = st->num_slots;
+
+	// the old index stays usable, but full tables are not added to
+	uint32_t *slots = calloc(old_num * 2, sizeof(uint32_t));
+	if (!slots) {
+		st->failed = 1;
+		return;
+	}
+	st->slots = slots;
+	st->num_slots = old_num * 2;
+	for (uint32_t i = 0; i < old_num; i++) {
+		if (old[i]) {
+			const struct strtab_entry *e = &st->entries[old[i] - 1];
+			*find_slot(st, st->buf + e->offset, e->len, e->hash) = old[i];
+		}
+	}
+	free(old);
+}
+
+uint32_t strtab_add(struct strtab *st, const char *name) {
+	size_t len = strlen(name);
+	if (len == 0 || st->failed)
+		return 0;
+	assert(!st->finalized);
+
+	uint32_t hash = hash_string(name, len);
+	uint32_t *slot = find_slot(st, name, len, hash);
+	if (*slot)
+		return *slot - 1;
+
+	if (st->buflen + len + 1 > st->bufcap) {
+		size_t cap = st->bufcap;
+		while (st->buflen + len + 1 > cap)
+			cap *= 2;
+		char *buf = grow(st, st->buf, cap);
+		if (!buf)
+			return 0;
+		st->buf = buf;
+		st->bufcap = cap;
+	}
+	if (st->num_entries == st->entries_cap) {
+		struct strtab_entry *entries = grow(st, st->entries, sizeof(struct strtab_entry) * st->entries_cap * 2);
+		if (!entries)
+			return 0;
+		st->entries = entries;
+		st->entries_cap *= 2;
+	}
+
+	uint32_t handle = st->num_entries++;
+	struct strtab_entry *e = &st->entries[handle];
+	e->offset = st->buflen;
+	e->len = len;
+	e->hash = hash;
+	memcpy(st->buf + st->buflen, name, len + 1);
+	st->buflen += len + 1;
+
+	*slot = handle + 1;
+	if (st->num_entries * 4 > st->num_slots * 3)
+		grow_slots(st);
+	return handle;
+}
+
+int64_t strtab_find(const struct strtab *st, const char *name) {
+	size_t len = strlen(name);
+	if (len == 0)
+		return 0;
+	uint32_t *slot = find_slot(st, name, len, hash_string(name, len));
+	return *slot ? (int64_t) *slot - 1 : -1;
+}
+
+struct sort_key {
+	const char *s;
+	size_t len;
+	uint32_t handle;
+};
+
+/* Order by reversed string, so that suffixes follow the strings they end. */
+static int compare_reversed(const void *a, const void *b) {
+	const struct sort_key *x = a, *y = b;
+	size_t i = x->len, j = y->len;
+
+	while (i > 0 && j > 0) {
+		unsigned char cx = x->s[--i], cy = y->s[--j];
+		if (cx != cy)
+			return cx < cy ? 1 : -1;
+	}
+	// the longer string first
+	return (x->len < y->len) - (x->len > y->len);
+}
+
+int strtab_finalize(struct strtab *st) {
+	if (st->failed)
+		return -1;
+	if (st->finalized)
+		return 0;
+	if (!st->merge_tails || st->num_entries <= 2) {
+		st->finalized = 1;
+		return 0;
+	}
+
+	uint32_t n = st->num_entries - 1;
+	struct sort_key *keys = malloc(sizeof(struct sort_key) * n);
+	char *buf = malloc(st->buflen);
+	if (!keys || !buf) {
+		free(keys);
+		free(buf);
+		st->failed = 1;
+		return -1;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		struct strtab_entry *e = &st->entries[i + 1];
+		keys[i].s = st->buf + e->offset;
+		keys[i].len = e->len;
+		keys[i].handle = i + 1;
+	}
+	qsort(keys, n, sizeof(struct sort_key), compare_reversed);
+
+	size_t buflen = 1;
+	buf[0] = '\0';
+	const struct sort_key *prev = NULL;
+	size_t prevoff = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		const struct sort_key *k = &keys[i];
+		struct strtab_entry *e = &st->entries[k->handle];
+		if (prev && prev->len >= k->len && memcmp(prev->s + prev->len - k->len, k->s, k->len) == 0) {
+			e->offset = prevoff + prev->len - k->len;
+		} else {
+			memcpy(buf + buflen, k->s, k->len + 1);
+			e->offset = buflen;
+			buflen += k->len + 1;
+		}
+		prev = k;
+		prevoff = e->offset;
+	}
+	free(keys);
+	free(st->buf);
+	st->buf = buf;
+	st->buflen = buflen;
+	st->bufcap = buflen;
+	st->finalized = 1;
+	return 0;
+}
+
+uint32_t strtab_offset(const struct strtab *st, uint32_t handle) {
+	assert(st->finalized);
+	return st->entries[handle].offset;
+}
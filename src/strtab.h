@@ -0,0 +1,65 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Builder for ELF string tables (.shstrtab, .strtab).
+ *
+ * Strings are interned through an open-addressing hash index, so adding a
+ * string that is already present is O(1). strtab_add() returns a handle;
+ * after strtab_finalize() the handle is turned into a table offset with
+ * strtab_offset(). With merge_tails, a string that is a suffix of another
+ * one shares its bytes (".text" inside ".rel.text"), as ld does.
+ *
+ * Running out of memory is sticky: strtab_add() then returns handle 0 and
+ * strtab_finalize() fails, so callers need only check the latter.
+ */
+struct strtab_entry {
+	size_t offset;                        // in buf before and after finalize
+	size_t len;                           // without the NUL
+	uint32_t hash;
+};
+
+struct strtab {
+	char *buf;
+	size_t buflen;
+	size_t bufcap;
+	struct strtab_entry *entries;
+	uint32_t num_entries;
+	uint32_t entries_cap;
+	uint32_t *slots;                      // entry index + 1, 0 = empty
+	uint32_t num_slots;                   // power of 2
+	int merge_tails;
+	int finalized;
+	int failed;                           // out of memory
+};
+
+/* Returns -1 if out of memory; strtab_free() must still be called. */
+extern int strtab_init(struct strtab *st, int merge_tails);
+extern void strtab_free(struct strtab *st);
+
+/* Handle of name, added if necessary. The empty string is handle 0. */
+extern uint32_t strtab_add(struct strtab *st, const char *name);
+
+/* Handle of name, or -1 if not present. */
+extern int64_t strtab_find(const struct strtab *st, const char *name);
+
+/* Lay out the table; no strings can be added afterwards. Returns -1 if out of memory. */
+extern int strtab_finalize(struct strtab *st);
+extern uint32_t strtab_offset(const struct strtab *st, uint32_t handle);
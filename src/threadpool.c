@@ -0,0 +1,284 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct task {
+	task_fn fn;
+	void *arg;
+	struct taskgroup *group;
+};
+
+/* Growable ring buffer; the owner uses the back, thieves the front. */
+struct deque {
+	pthread_mutex_t lock;
+	struct task *buf;
+	size_t cap;
+	size_t front;
+	size_t len;
+};
+
+struct worker {
+	struct threadpool *pool;
+	struct deque q;
+	pthread_t thread;
+	int index;
+	unsigned rng;
+};
+
+struct threadpool {
+	int nthreads;
+	struct worker *workers;
+	struct deque shared;                  // tasks submitted from outside
+	atomic_long queued;                   // tasks in all deques
+	pthread_mutex_t lock;                 // for sleeping only
+	pthread_cond_t cond;
+	int shutdown;
+};
+
+static __thread struct worker *current_worker;
+
+
+static int deque_init(struct deque *q) {
+	pthread_mutex_init(&q->lock, NULL);
+	q->cap = 64;
+	q->buf = malloc(sizeof(struct task) * q->cap);
+	q->front = 0;
+	q->len = 0;
+	return q->buf ? 0 : -1;
+}
+
+static void deque_destroy(struct deque *q) {
+	pthread_mutex_destroy(&q->lock);
+	free(q->buf);
+}
+
+static int deque_push_back(struct deque *q, struct task t) {
+	pthread_mutex_lock(&q->lock);
+	if (q->len == q->cap) {
+		struct task *buf = malloc(sizeof(struct task) * q->cap * 2);
+		if (!buf) {
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		for (size_t i = 0; i < q->len; i++)
+			buf[i] = q->buf[(q->front + i) % q->cap];
+		free(q->buf);
+		q->buf = buf;
+		q->front = 0;
+		q->cap *= 2;
+	}
+	q->buf[(q->front + q->len) % q->cap] = t;
+	q->len++;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+static int deque_pop_back(struct deque *q, struct task *t) {
+	int found = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->len > 0) {
+		q->len--;
+		*t = q->buf[(q->front + q->len) % q->cap];
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static int deque_pop_front(struct deque *q, struct task *t) {
+	int found = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->len > 0) {
+		*t = q->buf[q->front];
+		q->front = (q->front + 1) % q->cap;
+		q->len--;
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+/* Own deque first, then the shared queue, then steal from a random victim. */
+static int find_task(struct threadpool *pool, struct worker *self, struct task *t) {
+	if (atomic_load(&pool->queued) == 0)
+		return 0;
+	if (self && deque_pop_back(&self->q, t))
+		goto found;
+	if (deque_pop_front(&pool->shared, t))
+		goto found;
+
+	unsigned start = self ? (self->rng = self->rng * 1103515245 + 12345) >> 16 : 0;
+	for (int i = 0; i < pool->nthreads; i++) {
+		struct worker *victim = &pool->workers[(start + i) % pool->nthreads];
+		if (victim != self && deque_pop_front(&victim->q, t))
+			goto found;
+	}
+	return 0;
+
+found:
+	atomic_fetch_sub(&pool->queued, 1);
+	return 1;
+}
+
+static void run_task(struct threadpool *pool, struct task *t) {
+	t->fn(t->arg);
+	if (t->group && atomic_fetch_sub(&t->group->pending, 1) == 1) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void* worker_main(void *arg) {
+	struct worker *self = arg;
+	struct threadpool *pool = self->pool;
+	struct task t;
+
+	current_worker = self;
+	for (;;) {
+		if (find_task(pool, self, &t)) {
+			run_task(pool, &t);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->shutdown && atomic_load(&pool->queued) == 0)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		int stop = pool->shutdown && atomic_load(&pool->queued) == 0;
+		pthread_mutex_unlock(&pool->lock);
+		if (stop)
+			break;
+	}
+	return NULL;
+}
+
+/* Shut down and free the pool; the workers from started on were never created. */
+static void destroy_pool(struct threadpool *pool, int started) {
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	for (int i = 0; i < pool->nthreads; i++)
+		deque_destroy(&pool->workers[i].q);
+	deque_destroy(&pool->shared);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->workers);
+	free(pool);
+}
+
+struct threadpool* threadpool_new(int nthreads) {
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	struct threadpool *pool = calloc(1, sizeof(struct threadpool));
+	if (!pool)
+		return NULL;
+	pool->workers = calloc(nthreads, sizeof(struct worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	pool->nthreads = nthreads;
+	int failed = deque_init(&pool->shared) != 0;
+	atomic_init(&pool->queued, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (int i = 0; i < nthreads; i++) {
+		struct worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i;
+		w->rng = i * 2654435761u + 1;
+		if (deque_init(&w->q) != 0)
+			failed = 1;
+	}
+	if (failed) {
+		destroy_pool(pool, 0);
+		return NULL;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+			destroy_pool(pool, i);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+void threadpool_free(struct threadpool *pool) {
+	destroy_pool(pool, pool->nthreads);
+}
+
+int threadpool_size(struct threadpool *pool) {
+	return pool->nthreads;
+}
+
+int threadpool_worker(void) {
+	return current_worker ? current_worker->index : -1;
+}
+
+int threadpool_submit(struct threadpool *pool, struct taskgroup *group, task_fn fn, void *arg) {
+	struct task t = { fn, arg, group };
+	struct worker *self = current_worker;
+	int rc;
+
+	if (group)
+		atomic_fetch_add(&group->pending, 1);
+	// count first, so that queued never drops below the real queue length
+	atomic_fetch_add(&pool->queued, 1);
+	if (self && self->pool == pool)
+		rc = deque_push_back(&self->q, t);
+	else
+		rc = deque_push_back(&pool->shared, t);
+	if (rc != 0) {
+		atomic_fetch_sub(&pool->queued, 1);
+		if (group)
+			atomic_fetch_sub(&group->pending, 1);
+		fn(arg);
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+void threadpool_wait(struct threadpool *pool, struct taskgroup *group) {
+	struct worker *self = current_worker && current_worker->pool == pool ? current_worker : NULL;
+	struct task t;
+
+	while (atomic_load(&group->pending) > 0) {
+		if (find_task(pool, self, &t)) {
+			run_task(pool, &t);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (atomic_load(&group->pending) > 0 && atomic_load(&pool->queued) == 0)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stdatomic.h>
+
+/*
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a deque: it pushes and pops its own tasks at the back,
+ * idle workers steal from the front of the others. Tasks submitted from
+ * outside the pool go to a shared queue. A task may submit further tasks,
+ * e.g. to split a large job, and they will be picked up by idle workers.
+ */
+struct threadpool;
+
+typedef void (*task_fn)(void *arg);
+
+/* Tasks in a group can be waited for together. */
+struct taskgroup {
+	atomic_long pending;
+};
+
+#define TASKGROUP_INIT { 0 }
+
+/* nthreads <= 0 means one per online CPU. Returns NULL if out of resources. */
+extern struct threadpool* threadpool_new(int nthreads);
+extern void threadpool_free(struct threadpool *pool);
+extern int threadpool_size(struct threadpool *pool);
+
+/*
+ * Returns -1 if the task queue cannot grow; the task has then been run on
+ * the calling thread, so the result can be ignored unless it matters where.
+ */
+extern int threadpool_submit(struct threadpool *pool, struct taskgroup *group, task_fn fn, void *arg);
+
+/* Run queued tasks on the calling thread until the group is done. */
+extern void threadpool_wait(struct threadpool *pool, struct taskgroup *group);
+
+/* Index of the calling worker, 0..size-1, or -1 outside the pool. */
+extern int threadpool_worker(void);
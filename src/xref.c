@@ -0,0 +1,393 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "xref.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_XREF_AVX2
+#endif
+#ifdef __SSE2__
+#define HAVE_XREF_SSE2
+#endif
+
+/* Segments are scanned in parts of this size, one task each. */
+#define XREF_CHUNK_SIZE (4 * 1024 * 1024)
+
+/*
+ * Target ranges: the segments, sorted and merged where they touch. A word
+ * w is inside if w - start < size, unsigned; the vector code has signed
+ * compares only, so both sides are biased by 2^31 (bsize = size ^ 2^31).
+ */
+struct ranges {
+	int n;
+	uint32_t start[MRVL_MAX_SEGMENTS];
+	uint32_t size[MRVL_MAX_SEGMENTS];
+	uint32_t bsize[MRVL_MAX_SEGMENTS];
+};
+
+/* nwords aligned words of a segment from p, one task each. */
+struct xref_part {
+	const struct ranges *ranges;
+	const uint8_t *p;
+	uint32_t vaddr;                       // of p
+	uint32_t nwords;
+	struct mrvl_xref *refs;               // malloc'ed, in address order
+	uint32_t count;
+	uint32_t cap;
+	int failed;
+};
+
+/* Bit i is set if word i of the 8 at p is inside a range. */
+typedef unsigned (*mask_fn)(const uint8_t *p, const struct ranges *r);
+typedef void (*scan_fn)(struct xref_part *part);
+
+static scan_fn scan;
+
+
+static inline uint32_t load_le32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline int in_ranges(const struct ranges *r, uint32_t w) {
+	for (int k = 0; k < r->n; k++) {
+		if (w - r->start[k] < r->size[k])
+			return 1;
+	}
+	return 0;
+}
+
+static int add_ref(struct xref_part *part, uint32_t from, uint32_t to) {
+	if (part->count == part->cap) {
+		uint32_t cap = part->cap ? part->cap * 2 : 1024;
+		struct mrvl_xref *refs = realloc(part->refs, sizeof(struct mrvl_xref) * cap);
+		if (!refs) {
+			part->failed = 1;
+			return -1;
+		}
+		part->refs = refs;
+		part->cap = cap;
+	}
+	part->refs[part->count++] = (struct mrvl_xref) { from, to };
+	return 0;
+}
+
+static unsigned mask8_generic(const uint8_t *p, const struct ranges *r) {
+	unsigned m = 0;
+	for (int i = 0; i < 8; i++)
+		m |= in_ranges(r, load_le32(p + 4 * i)) << i;
+	return m;
+}
+
+/*
+ * The scanner is written once and instantiated per mask function, which
+ * is inlined into each copy; the last words are done one by one.
+ */
+static inline __attribute__((always_inline))
+void scan_with(mask_fn mask, struct xref_part *part) {
+	const uint8_t *p = part->p;
+	uint32_t i = 0;
+	for (; i + 8 <= part->nwords; i += 8) {
+		unsigned m = mask(p + 4 * i, part->ranges);
+		while (m) {
+			uint32_t k = i + __builtin_ctz(m);
+			if (add_ref(part, part->vaddr + 4 * k, load_le32(p + 4 * k)) != 0)
+				return;
+			m &= m - 1;
+		}
+	}
+	for (; i < part->nwords; i++) {
+		uint32_t w = load_le32(p + 4 * i);
+		if (in_ranges(part->ranges, w) && add_ref(part, part->vaddr + 4 * i, w) != 0)
+			return;
+	}
+}
+
+static void scan_generic(struct xref_part *part) {
+	scan_with(mask8_generic, part);
+}
+
+#ifdef HAVE_XREF_SSE2
+static inline __attribute__((always_inline)) unsigned mask8_sse2(const uint8_t *p, const struct ranges *r) {
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	__m128i a = _mm_loadu_si128((const __m128i*) p);
+	__m128i b = _mm_loadu_si128((const __m128i*) (p + 16));
+	__m128i ha = _mm_setzero_si128(), hb = _mm_setzero_si128();
+	for (int k = 0; k < r->n; k++) {
+		__m128i start = _mm_set1_epi32(r->start[k]);
+		__m128i size = _mm_set1_epi32(r->bsize[k]);
+		ha = _mm_or_si128(ha, _mm_cmpgt_epi32(size, _mm_xor_si128(_mm_sub_epi32(a, start), bias)));
+		hb = _mm_or_si128(hb, _mm_cmpgt_epi32(size, _mm_xor_si128(_mm_sub_epi32(b, start), bias)));
+	}
+	return _mm_movemask_ps(_mm_castsi128_ps(ha)) | _mm_movemask_ps(_mm_castsi128_ps(hb)) << 4;
+}
+
+static void scan_sse2(struct xref_part *part) {
+	scan_with(mask8_sse2, part);
+}
+#endif
+
+#ifdef HAVE_XREF_AVX2
+__attribute__((target("avx2")))
+static inline unsigned mask8_avx2(const uint8_t *p, const struct ranges *r) {
+	const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+	__m256i a = _mm256_loadu_si256((const __m256i*) p);
+	__m256i h = _mm256_setzero_si256();
+	for (int k = 0; k < r->n; k++) {
+		__m256i d = _mm256_xor_si256(_mm256_sub_epi32(a, _mm256_set1_epi32(r->start[k])), bias);
+		h = _mm256_or_si256(h, _mm256_cmpgt_epi32(_mm256_set1_epi32(r->bsize[k]), d));
+	}
+	return _mm256_movemask_ps(_mm256_castsi256_ps(h));
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(struct xref_part *part) {
+	scan_with(mask8_avx2, part);
+}
+#endif
+
+__attribute__((constructor))
+static void xref_setup(void) {
+	scan = scan_generic;
+#ifdef HAVE_XREF_SSE2
+	scan = scan_sse2;
+#endif
+#ifdef HAVE_XREF_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+#endif
+}
+
+static void scan_task(void *arg) {
+	scan(arg);
+}
+
+/* Segment indices in address order. */
+static int sort_segments(const struct MarvellFirmware *fw, int *order) {
+	int n = 0;
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		int j = n++;
+		for (; j > 0 && fw->seghdrs[order[j - 1]].vaddr > fw->seghdrs[i].vaddr; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	return n;
+}
+
+static void merge_ranges(const struct MarvellFirmware *fw, const int *order, int n, struct ranges *r) {
+	uint64_t start = 0, end = 0;
+	r->n = 0;
+	for (int k = 0; k <= n; k++) {
+		const struct MarvellSegmentHeader *sh = k < n ? &fw->seghdrs[order[k]] : NULL;
+		if (sh && sh->size == 0)
+			continue;
+		if (sh && end > start && sh->vaddr <= end) {
+			if ((uint64_t) sh->vaddr + sh->size > end)
+				end = (uint64_t) sh->vaddr + sh->size;
+			continue;
+		}
+		if (end > start) {
+			r->start[r->n] = start;
+			r->size[r->n] = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+			r->bsize[r->n] = r->size[r->n] ^ 0x80000000u;
+			r->n++;
+		}
+		if (sh) {
+			start = sh->vaddr;
+			end = start + sh->size;
+		}
+	}
+}
+
+static int cmp_xref(const void *a, const void *b) {
+	const struct mrvl_xref *x = a, *y = b;
+	if (x->from != y->from)
+		return x->from < y->from ? -1 : 1;
+	return x->to < y->to ? -1 : x->to > y->to;
+}
+
+/*
+ * Stable radix sort of the indices by target, 16 bits per pass; refs are
+ * sorted by source already, so equal targets stay in source order.
+ */
+static int sort_by_target(struct mrvl_xrefs *x) {
+	uint32_t *tmp = malloc(sizeof(uint32_t) * (x->count ? x->count : 1));
+	uint32_t *counts = malloc(sizeof(uint32_t) * 65536);
+	if (!tmp || !counts) {
+		free(tmp);
+		free(counts);
+		return -1;
+	}
+	for (uint32_t i = 0; i < x->count; i++)
+		tmp[i] = i;
+	for (int shift = 0; shift < 32; shift += 16) {
+		uint32_t sum = 0;
+		memset(counts, 0, sizeof(uint32_t) * 65536);
+		for (uint32_t i = 0; i < x->count; i++)
+			counts[x->refs[i].to >> shift & 0xffff]++;
+		for (uint32_t b = 0; b < 65536; b++) {
+			uint32_t c = counts[b];
+			counts[b] = sum;
+			sum += c;
+		}
+		uint32_t *src = shift ? x->by_target : tmp, *dst = shift ? tmp : x->by_target;
+		for (uint32_t i = 0; i < x->count; i++)
+			dst[counts[x->refs[src[i]].to >> shift & 0xffff]++] = src[i];
+	}
+	memcpy(x->by_target, tmp, sizeof(uint32_t) * x->count);
+	free(tmp);
+	free(counts);
+	return 0;
+}
+
+int mrvl_xref_scan(const struct MarvellFirmware *fw, struct threadpool *pool, struct mrvl_xrefs *x) {
+	MRVL_STATS_START(t);
+	const uint32_t per_part = XREF_CHUNK_SIZE / 4;
+	int order[MRVL_MAX_SEGMENTS];
+	int n = sort_segments(fw, order);
+	struct ranges ranges;
+	uint32_t num_parts = 0;
+	uint64_t bytes = 0;
+
+	memset(x, 0, sizeof(*x));
+	merge_ranges(fw, order, n, &ranges);
+	for (int k = 0; k < n; k++) {
+		const struct MarvellSegmentHeader *sh = &fw->seghdrs[order[k]];
+		uint32_t skip = -sh->vaddr & 3;
+		uint32_t nwords = sh->size > skip ? (sh->size - skip) / 4 : 0;
+		num_parts += nwords / per_part + (nwords % per_part != 0);
+	}
+	struct xref_part *parts = calloc(num_parts ? num_parts : 1, sizeof(struct xref_part));
+	if (!parts)
+		return -1;
+
+	// parts in address order, so that their results can be appended
+	struct taskgroup group = TASKGROUP_INIT;
+	uint32_t p = 0;
+	for (int k = 0; k < n; k++) {
+		const struct MarvellSegmentHeader *sh = &fw->seghdrs[order[k]];
+		uint32_t skip = -sh->vaddr & 3;
+		uint32_t nwords = sh->size > skip ? (sh->size - skip) / 4 : 0;
+		for (uint32_t w = 0; w < nwords; w += per_part) {
+			struct xref_part *part = &parts[p++];
+			part->ranges = &ranges;
+			part->p = fw->segments[order[k]] + skip + 4 * w;
+			part->vaddr = sh->vaddr + skip + 4 * w;
+			part->nwords = nwords - w < per_part ? nwords - w : per_part;
+			bytes += 4 * (uint64_t) part->nwords;
+			if (pool && num_parts > 1)
+				threadpool_submit(pool, &group, scan_task, part);
+			else
+				scan(part);
+		}
+	}
+	if (pool && num_parts > 1)
+		threadpool_wait(pool, &group);
+
+	uint64_t total = 0;
+	int failed = 0;
+	for (uint32_t k = 0; k < num_parts; k++) {
+		total += parts[k].count;
+		failed |= parts[k].failed;
+	}
+	if (!failed && total < UINT32_MAX) {
+		x->refs = malloc(sizeof(struct mrvl_xref) * (total ? total : 1));
+		x->by_target = malloc(sizeof(uint32_t) * (total ? total : 1));
+	}
+	if (x->refs && x->by_target) {
+		for (uint32_t k = 0; k < num_parts; k++) {
+			memcpy(x->refs + x->count, parts[k].refs, sizeof(struct mrvl_xref) * parts[k].count);
+			x->count += parts[k].count;
+		}
+	}
+	for (uint32_t k = 0; k < num_parts; k++)
+		free(parts[k].refs);
+	free(parts);
+	if (!x->refs || !x->by_target) {
+		mrvl_xref_free(x);
+		return -1;
+	}
+
+	// only segments that overlap each other leave refs out of order
+	for (uint32_t i = 1; i < x->count; i++) {
+		if (x->refs[i - 1].from > x->refs[i].from) {
+			qsort(x->refs, x->count, sizeof(struct mrvl_xref), cmp_xref);
+			break;
+		}
+	}
+	if (sort_by_target(x) != 0) {
+		mrvl_xref_free(x);
+		return -1;
+	}
+	MRVL_STATS_STOP(t, MRVL_PHASE_XREF, bytes);
+	return 0;
+}
+
+void mrvl_xref_free(struct mrvl_xrefs *x) {
+	free(x->refs);
+	free(x->by_target);
+	memset(x, 0, sizeof(*x));
+}
+
+const struct mrvl_xref* mrvl_xrefs_from(const struct mrvl_xrefs *x, uint32_t addr, uint32_t size, uint32_t *count) {
+	uint64_t end = (uint64_t) addr + size;
+	uint32_t lo = 0, hi = x->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (x->refs[mid].from < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	uint32_t first = lo;
+	hi = x->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (x->refs[mid].from < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*count = lo - first;
+	return x->refs + first;
+}
+
+const uint32_t* mrvl_xrefs_to(const struct mrvl_xrefs *x, uint32_t addr, uint32_t size, uint32_t *count) {
+	uint64_t end = (uint64_t) addr + size;
+	uint32_t lo = 0, hi = x->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (x->refs[x->by_target[mid]].to < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	uint32_t first = lo;
+	hi = x->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (x->refs[x->by_target[mid]].to < end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*count = lo - first;
+	return x->by_target + first;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "marvel-88mw30x-firmware.h"
+#include "threadpool.h"
+
+/*
+ * Cross-reference index: every aligned 32-bit word of any segment whose
+ * value is an address inside a segment (Code RAM 0x00100000, flash
+ * 0x1F000000, SRAM 0x20000000, ...), e.g. literal pool entries, vector
+ * tables and pointer tables. Thumb function pointers, with bit 0 set, fall
+ * inside their segment like any other address.
+ *
+ * The segment ranges are sorted and merged, and each word is compared
+ * against all of them at once, 4 or 8 words per instruction with SSE2 or
+ * AVX2 where available; only the rare hits leave the vector loop.
+ * Segments are scanned in parts of a few MiB, one task each on a pool.
+ */
+struct mrvl_xref {
+	uint32_t from;                        // address of the word
+	uint32_t to;                          // its value
+};
+
+struct mrvl_xrefs {
+	uint32_t count;
+	struct mrvl_xref *refs;               // sorted by from
+	uint32_t *by_target;                  // indices into refs, sorted by to, then from
+};
+
+/* Returns 0, or -1 if out of memory. pool may be NULL. */
+extern int mrvl_xref_scan(const struct MarvellFirmware *fw, struct threadpool *pool, struct mrvl_xrefs *x);
+extern void mrvl_xref_free(struct mrvl_xrefs *x);
+
+/* References from words in [addr, addr + size): a run of x->refs. */
+extern const struct mrvl_xref* mrvl_xrefs_from(const struct mrvl_xrefs *x, uint32_t addr, uint32_t size, uint32_t *count);
+
+/* References to [addr, addr + size): a run of x->by_target. */
+extern const uint32_t* mrvl_xrefs_to(const struct mrvl_xrefs *x, uint32_t addr, uint32_t size, uint32_t *count);
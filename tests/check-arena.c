@@ -0,0 +1,112 @@
+/*
+ * This file is part of mrvl-88mw30x-firmware-tools
+ * Copyright (c) 2017 Wolfgang Frisch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Allocation regression test. Parses the same image many times through one
+ * arena and through malloc, and checks the arena counters and the peak RSS
+ * of the process: each image must cost a fixed number of bytes in a single
+ * block, and nothing may leak.
+ */
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "marvel-88mw30x-firmware.h"
+
+#define IMAGES      4096
+#define PILED       256                   // without reset
+#define MAX_RSS_KB  (32 * 1024)           // a leaked image per round would need > 128 MiB
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { warnx(__VA_ARGS__); failures++; } } while (0)
+
+/* A heap copy of fw in one block, from the arena or malloc'ed. */
+static struct MarvellFirmware* copy_firmware(const struct MarvellFirmware *fw, struct MarvellArena *arena) {
+	uint32_t sizes[MRVL_MAX_SEGMENTS];
+	for (int i = 0; i < fw->header.num_segments; i++)
+		sizes[i] = fw->seghdrs[i].size;
+	struct MarvellFirmware *copy = new_mrvl_firmware(arena, fw->header.num_segments, sizes);
+	if (!copy)
+		errx(EXIT_FAILURE, "out of memory");
+	copy->header = fw->header;
+	for (int i = 0; i < fw->header.num_segments; i++) {
+		copy->seghdrs[i] = fw->seghdrs[i];
+		memcpy(copy->segments[i], fw->segments[i], sizes[i]);
+	}
+	return copy;
+}
+
+int main(int argc, char **argv) {
+	const char *path = argc > 1 ? argv[1] : "samples/hello_world.bin";
+	struct MarvellArena arena;
+	char msg[256];
+
+	// reset between images: the first block is reused, the peak is one image
+	mrvl_arena_init(&arena);
+	size_t per_image = 0;
+	for (int i = 0; i < IMAGES; i++) {
+		struct MarvellFirmware *fw = load_marvel_firmware(path, &arena, msg, sizeof(msg));
+		if (!fw)
+			errx(EXIT_FAILURE, "%s", msg);
+		free_mrvl_firmware(copy_firmware(fw, &arena));
+		free_mrvl_firmware(fw);
+		if (i == 0)
+			per_image = arena.peak;
+		mrvl_arena_reset(&arena);
+	}
+	CHECK(arena.allocations == 1, "arena with reset: %zu blocks for %d images, expected 1", arena.allocations, IMAGES);
+	CHECK(arena.peak == per_image, "arena with reset: peak %zu, expected %zu", arena.peak, per_image);
+	mrvl_arena_free(&arena);
+
+	// malloc: free_mrvl_firmware() must release the whole block
+	struct MarvellFirmware *image = load_marvel_firmware(path, NULL, msg, sizeof(msg));
+	if (!image)
+		errx(EXIT_FAILURE, "%s", msg);
+	for (int i = 0; i < IMAGES; i++)
+		free_mrvl_firmware(copy_firmware(image, NULL));
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	CHECK(ru.ru_maxrss < MAX_RSS_KB, "peak RSS %ld KiB, expected below %d KiB", ru.ru_maxrss, MAX_RSS_KB);
+
+	// no reset, after the RSS check: the images pile up, in blocks of doubling size
+	mrvl_arena_init(&arena);
+	size_t per_copy = 0;
+	for (int i = 0; i < PILED; i++) {
+		copy_firmware(image, &arena);
+		if (i == 0)
+			per_copy = arena.in_use;
+	}
+	size_t blocks = 0;
+	for (size_t cap = 0, size = 64 * 1024; cap < arena.in_use; cap += size, size *= 2)
+		blocks++;
+	CHECK(arena.in_use == PILED * per_copy, "arena without reset: %zu bytes in use, expected %zu",
+		arena.in_use, PILED * per_copy);
+	CHECK(arena.peak == arena.in_use, "arena without reset: peak %zu, in use %zu", arena.peak, arena.in_use);
+	CHECK(arena.allocations <= blocks + 1, "arena without reset: %zu blocks, expected at most %zu",
+		arena.allocations, blocks + 1);
+	mrvl_arena_free(&arena);
+	free_mrvl_firmware(image);
+
+	if (failures)
+		return EXIT_FAILURE;
+	printf("check-arena: ok, %zu bytes per image, peak RSS %ld KiB\n", per_image, ru.ru_maxrss);
+	return EXIT_SUCCESS;
+}
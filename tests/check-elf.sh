@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# This file is part of mrvl-88mw30x-firmware-tools
+# Copyright (c) 2017 Wolfgang Frisch.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+# The ELF writer must produce the same bytes as the libelf backend (-L),
+# for the sample and for generated images, with every option.
+
+set -e
+bin=${1:-bin}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+unset MRVLFW_CACHE_DIR
+
+cp samples/hello_world.bin "$tmp/hello_world.bin"
+"$bin/mkfirmware" -r 1 "$tmp/default.bin"
+"$bin/mkfirmware" -r 2 -s 4K@0x100000:text -s 64K@0x1f000f40 -s 328@0x20000000:text "$tmp/text.bin"
+"$bin/mkfirmware" -r 3 -s 1K:zero -s 3@0x1000:inc -s 8K:ff -s 5K:text "$tmp/odd.bin"
+
+failed=0
+for fw in "$tmp"/*.bin; do
+	for opts in "" "-x" "--strings" "--strings=12" "-x --strings"; do
+		"$bin/firmware2elf" $opts "$fw" "$tmp/writer.elf" >/dev/null
+		"$bin/firmware2elf" -L $opts "$fw" "$tmp/libelf.elf" >/dev/null
+		if ! cmp "$tmp/writer.elf" "$tmp/libelf.elf"; then
+			echo "FAIL: firmware2elf $opts $(basename "$fw")" >&2
+			failed=1
+		fi
+	done
+done
+[ $failed = 0 ] && echo "check-elf: ok"
+exit $failed